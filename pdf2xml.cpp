@@ -10,6 +10,22 @@
 
 // General libs
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Threads for parallel conversion
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Copying picture bytes straight from the source file
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 // GNUpdf general libs
 #include "GString.h"
@@ -37,6 +53,46 @@
 
 const char HEXADECIMAL_CHARACTERS[] = "0123456789ABCDEF";
 
+// two digits for each number below 100
+const char DECIMAL_PAIRS[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// size of the output buffer
+const int XML_BUFFER_SIZE = 64 * 1024;
+
+// number of pages a worker renders before claiming new ones
+const int PAGES_PER_CHUNK = 4;
+
+// how many chunks per worker may be rendered ahead of the output
+const int CHUNKS_AHEAD = 4;
+
+//------------------------------------------------------------
+
+// Returns the file name part of <path>
+static const char* strip_directory (const char* path)
+{
+	const char* name = path;
+
+	for (const char* p = path; *p != 0; p++)
+	{
+		if ((*p == '\\') || (*p == '/'))
+		{
+			name = p + 1;
+		}
+	}
+
+	return name;
+}
+
 //------------------------------------------------------------
 
 bool Rect::is_intersecting (const Rect &other, Rect &rect) const
@@ -112,6 +168,11 @@ void Rect::enlarge_to_contain (const Rect &contained)
 
 XmlOutput::XmlOutput () :
 	xml_file(NULL),
+	xml_sink(NULL),
+	buffer(NULL),
+	buffer_length(0),
+	buffer_capacity(0),
+	image_position(0),
 	page_opened(false),
 	font_opened(false)
 {
@@ -119,73 +180,218 @@ XmlOutput::XmlOutput () :
 
 //------------------------------------------------------------
 
+XmlOutput::~XmlOutput ()
+{
+	close();
+	delete [] buffer;
+}
+
+//------------------------------------------------------------
+
 bool XmlOutput::open (GString& filename)
 {
 	xml_file = fopen(filename.getCString(), "wb");
 
 	if (xml_file == NULL) return true;
 
+	if (buffer == NULL)
+	{
+		buffer_capacity = XML_BUFFER_SIZE;
+		buffer = new char[buffer_capacity];
+	}
+	buffer_length = 0;
+
+	return write("<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n");
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::open (OutputSink* sink)
+{
+	xml_sink = sink;
+
+	if (buffer == NULL)
+	{
+		buffer_capacity = XML_BUFFER_SIZE;
+		buffer = new char[buffer_capacity];
+	}
+	buffer_length = 0;
+
 	return write("<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n");
 }
 
 //------------------------------------------------------------
 
-bool XmlOutput::write (const char* content)
+bool XmlOutput::open_memory ()
+{
+	if (buffer == NULL)
+	{
+		buffer_capacity = XML_BUFFER_SIZE;
+		buffer = new char[buffer_capacity];
+	}
+	buffer_length = 0;
+
+	return false;
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::write_overflow (const char* content, int length)
 {
-	size_t towrite = strlen(content);
-	size_t written = fwrite(content, sizeof(char), towrite, xml_file);
+	if ((xml_file != NULL) || (xml_sink != NULL))
+	{
+		bool error = flush();
+
+		// too large to be buffered
+		if (length > buffer_capacity)
+		{
+			if (xml_sink != NULL)
+				return error || xml_sink->write_xml(content, length);
+
+			size_t written = fwrite(content, sizeof(char), length, xml_file);
+			return error || (length != (int) written);
+		}
+
+		memcpy(buffer, content, length);
+		buffer_length = length;
 
-	return (towrite != written);
+		return error;
+	}
+
+	// in memory, grow the buffer
+	int capacity = (buffer_capacity > 0) ? buffer_capacity * 2 : XML_BUFFER_SIZE;
+	while (buffer_length + length > capacity) capacity *= 2;
+
+	char* data = new char[capacity];
+	memcpy(data, buffer, buffer_length);
+	delete [] buffer;
+	buffer = data;
+	buffer_capacity = capacity;
+
+	memcpy(buffer + buffer_length, content, length);
+	buffer_length += length;
+
+	return false;
 }
 
 //------------------------------------------------------------
 
 bool XmlOutput::write (int number)
 {
-	static char char_number[12];
+	// formatted from the end, two digits at a time
+	char char_number[12];
+	char* p = char_number + sizeof(char_number);
 
-	char_number[11] = 0;
-	if (number == 0)
+	// unsigned, -INT_MIN does not fit in an int
+	unsigned int value = (number < 0) ? 0u - (unsigned int) number : (unsigned int) number;
+
+	while (value >= 100)
 	{
-		char_number[10] = '0';
+		const char* pair = &DECIMAL_PAIRS[(value % 100) << 1];
+		value /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
 
-		return write(&(char_number[10]));
+	if (value >= 10)
+	{
+		const char* pair = &DECIMAL_PAIRS[value << 1];
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+	else
+	{
+		*--p = (char)('0' + value);
 	}
 
-	int index;
-	bool negative = false;
 	if (number < 0)
 	{
-		number = -number;
-		negative = true;
+		*--p = '-';
 	}
 
-	for (index = 10; (index >= 0) && (number != 0); index--)
+	return write(p, (int) (char_number + sizeof(char_number) - p));
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::write_escaped (const char* content)
+{
+	bool error = false;
+	const char* run = content;	// characters not written yet
+	const char* p;
+
+	for (p = content; *p != 0; p++)
 	{
-		char_number[index] = (char)('0' + (number % 10));
-		number = number / 10;
+		switch (*p)
+		{
+		case '<':
+			error |= write(run, (int) (p - run));
+			error |= write("&lt;");
+			run = p + 1;
+			break;
+
+		case '>':
+			error |= write(run, (int) (p - run));
+			error |= write("&gt;");
+			run = p + 1;
+			break;
+
+		case '&':
+			error |= write(run, (int) (p - run));
+			error |= write("&amp;");
+			run = p + 1;
+			break;
+		}
 	}
 
-	if (negative)
+	error |= write(run, (int) (p - run));
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::flush ()
+{
+	if (buffer_length == 0) return false;
+
+	bool error;
+
+	if (xml_sink != NULL)
+	{
+		error = xml_sink->write_xml(buffer, buffer_length);
+	}
+	else if (xml_file != NULL)
 	{
-		char_number[index] = '-';
-		index--;
+		size_t written = fwrite(buffer, sizeof(char), buffer_length, xml_file);
+		error = (buffer_length != (int) written);
 	}
+	else return false; // in memory
+
+	buffer_length = 0;
 
-	return write(&(char_number[index + 1]));
+	return error;
 }
 
 //------------------------------------------------------------
 
 bool XmlOutput::close ()
 {
+	bool error = false;
+
 	if (xml_file != NULL)
 	{
+		error = flush();
 		fclose(xml_file);
 		xml_file = NULL;
 	}
+	else if (xml_sink != NULL)
+	{
+		error = flush();
+		xml_sink = NULL;
+	}
 
-	return false;
+	return error;
 }
 
 //------------------------------------------------------------
@@ -198,7 +404,7 @@ bool XmlOutput::add_metatag (const char* tag, GString* value)
 	}
 
 	write("  <");
-	write(tag);
+	write_string(tag);
 	write(">");
 
 	bool is_unicode  = false;
@@ -304,11 +510,11 @@ bool XmlOutput::add_metatag (const char* tag, GString* value)
 	}
 	utf8_value[utf8_index] = '\0';
 
-	write(utf8_value);
+	write_string(utf8_value);
 	delete [] utf8_value;
 
 	write("</");
-	write(tag);
+	write_string(tag);
 	write(">\n");
 
 	return false;
@@ -343,6 +549,27 @@ bool XmlOutput::start_page (int width, int height)
 
 //------------------------------------------------------------
 
+bool XmlOutput::end_page ()
+{
+	bool error = false;
+
+	if (font_opened)
+	{
+		error |= write("    </font>\n");
+	}
+	font_opened = false;
+
+	if (page_opened)
+	{
+		error |= write("  </page>\n");
+	}
+	page_opened = false;
+
+	return error;
+}
+
+//------------------------------------------------------------
+
 bool XmlOutput::change_font (GString* face, int size, int color, bool bold, bool italic)
 {
 	bool error = false;
@@ -359,18 +586,17 @@ bool XmlOutput::change_font (GString* face, int size, int color, bool bold, bool
 	if ((face != NULL) && (face->getLength() > 0))
 	{
 		error |= write("\" face=\"");
-		error |= write(face->getCString());
+		error |= write_string(face->getCString());
 	}
 
 	if (color != 0)
 	{
-		char number[7];
+		char number[6];
 		for (int i = 0; i < 6; i++)
 			number[i] = HEXADECIMAL_CHARACTERS[(color >> ((5 - i) << 2)) & 0x0F];
-		number[6] = 0;
 
 		error |= write("\" color=\"#");
-		error |= write(number);
+		error |= write(number, 6);
 	}
 
 	if (bold)
@@ -416,7 +642,7 @@ bool XmlOutput::add_link (const Rect& rect, GString& dest_url)
 	error |= write("      <link x=\"");
 	WRITE_BOUNDS
 	error |= write("\" href=\"");
-	error |= write(dest_url.getCString());
+	error |= write_string(dest_url.getCString());
 	error |= write("\"/>");
 
 	return error;
@@ -431,7 +657,7 @@ bool XmlOutput::add_text_block (GString& str, const Rect& rect)
 	error |= write("      <text x=\"");
 	WRITE_BOUNDS
 	error |= write("\">");
-	error |= write(str.getCString());
+	error |= write_escaped(str.getCString());
 	error |= write("</text>\n");
 
 	return error;
@@ -439,184 +665,1652 @@ bool XmlOutput::add_text_block (GString& str, const Rect& rect)
 
 //------------------------------------------------------------
 
-bool XmlOutput::add_image_block(GString& filename, const Rect& rect)
+bool XmlOutput::add_image_block(GString& filename, const Rect& rect, const char* attributes)
 {
 	bool error = false;
 
 	error |= write("      <img x=\"");
 	WRITE_BOUNDS
 	error |= write("\" src=\"");
-	error |= write(filename.getCString());
-	error |= write("\"/>\n");
+	image_position = buffer_length;
+	error |= write_string(filename.getCString());
+	error |= write("\"");
+	if (attributes != NULL)
+		error |= write_string(attributes);
+	error |= write("/>\n");
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::add_image_bounds(const Rect& rect, const char* attributes)
+{
+	bool error = false;
+
+	error |= write("      <img x=\"");
+	WRITE_BOUNDS
+	error |= write("\"");
+	error |= write_string(attributes);
+	error |= write("/>\n");
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::load_from_pdf (GString& pdf_file_name, GString& picture_base_name, int jobs)
+{
+	// the configuration is created by the caller, so that its caches
+	// stay warm across documents
+	if (globalParams == NULL) return true; // ERROR: globals not initialized
+
+	GString *owner_password = NULL;
+	GString *user_password  = NULL;
+
+	PDFDoc *doc = new PDFDoc(new GString(&pdf_file_name), owner_password, user_password); // created string deleted by ~PDFDoc
+
+	bool error = load_from_doc(doc, &pdf_file_name, picture_base_name, NULL, jobs);
+
+	delete doc;
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+bool XmlOutput::load_from_memory (const char* data, int length, GString& picture_base_name, OutputSink* sink)
+{
+	if (globalParams == NULL) return true; // ERROR: globals not initialized
+
+	GString *owner_password = NULL;
+	GString *user_password  = NULL;
+
+	// the stream reads the caller's buffer, it is copied only to be decrypted
+	Object dict;
+	dict.initNull();
+	MemStream *str = new MemStream((char*) data, 0, length, &dict);
+
+	PDFDoc *doc = new PDFDoc(str, owner_password, user_password); // stream deleted by ~PDFDoc
+
+	bool error = load_from_doc(doc, NULL, picture_base_name, sink, 1);
+
+	delete doc;
 
 	return error;
 }
 
 //------------------------------------------------------------
 
-bool XmlOutput::load_from_pdf (GString& pdf_file_name, GString& picture_base_name)
+bool XmlOutput::load_from_doc (PDFDoc* doc, GString* pdf_file_name, GString& picture_base_name,
+							   OutputSink* sink, int jobs)
 {
-	PDFDoc *doc = NULL;
 	//UnicodeMap *uMap = NULL;
 	MbpOutputDev *mbpOut = NULL;
 	
 	bool error = false;
 	
-	// default configuration
-	globalParams = new GlobalParams(NULL);
-	if (globalParams != NULL)
-	{
-		// text encoding ???
-		//globalParams->setTextEncoding(textEncName);
-		// EOL config ???
-		//globalParams->setTextEOL(textEOL));
-		
-		// get mapping to output encoding
-		//uMap = globalParams->getTextEncoding();
-		//if (uMap != NULL)
-		//{	
-			GString *owner_password = NULL;
-			GString *user_password  = NULL;
+	// text encoding ???
+	//globalParams->setTextEncoding(textEncName);
+	// EOL config ???
+	//globalParams->setTextEOL(textEOL));
+	
+	// get mapping to output encoding
+	//uMap = globalParams->getTextEncoding();
+	//if (uMap != NULL)
+	//{	
+		if (doc != NULL && doc->isOk() && (doc->okToCopy() || doc->okToPrint()))
+		{
+			// number of pages
+			int nb_pages = doc->getNumPages();
+			GString* title = NULL;
 			
-			doc = new PDFDoc(new GString(&pdf_file_name), owner_password, user_password); // created string deleted by ~PDFDoc
-
-			if (doc != NULL && doc->isOk() && (doc->okToCopy() || doc->okToPrint()))
+			// various metadata are accessible here in "info" with the following dict keys:
+			Object info;
+			doc->getDocInfo(&info);
+			if (info.isDict())
 			{
-				// number of pages
-				int nb_pages = doc->getNumPages();
-				GString* title = NULL;
-				
-				// various metadata are accessible here in "info" with the following dict keys:
-				Object info;
-				doc->getDocInfo(&info);
-				if (info.isDict())
-				{
-					//	"Title"; "Subject"; "Keywords"; "Author"; "Creator"; "Producer"; "CreationDate"; "LastModifiedDate"
-					Dict* dict = info.getDict();
-					Object title_obj;
-					dict->lookup("Title", &title_obj);
-
-					if (title_obj.isString())
-					{
-						title = title_obj.getString()->copy();
-					}
+				//	"Title"; "Subject"; "Keywords"; "Author"; "Creator"; "Producer"; "CreationDate"; "LastModifiedDate"
+				Dict* dict = info.getDict();
+				Object title_obj;
+				dict->lookup("Title", &title_obj);
 
-					title_obj.free();
-				}
-				info.free();
-				
-				// extract information
-				mbpOut = new MbpOutputDev(*this, picture_base_name);
-				if (mbpOut != NULL)
+				if (title_obj.isString())
 				{
-					// open main tag
-					write("<pdf2xml pages=\"");
-					write(nb_pages);
-					write("\">\n");
-
-					// title tag
-					add_metatag("title", title);
+					title = title_obj.getString()->copy();
+				}
 
-					// launch the parsing
+				title_obj.free();
+			}
+			info.free();
+			
+			// extract information
+			mbpOut = new MbpOutputDev(*this, picture_base_name, sink);
+			if (mbpOut != NULL)
+			{
+				// open main tag
+				write("<pdf2xml pages=\"");
+				write(nb_pages);
+				write("\">\n");
+
+				// title tag
+				add_metatag("title", title);
+
+				// launch the parsing
+				// the workers reopen the file and write their pictures as files
+				if (jobs > 1 && nb_pages > 1 && pdf_file_name != NULL && sink == NULL)
+					error |= display_pages_parallel(*pdf_file_name, picture_base_name, nb_pages, jobs);
+				else
 					doc->displayPages(mbpOut, 1, nb_pages, 72, 72, 0, gFalse, gFalse, gTrue);
 
-					bool error = false;
-
-					if (font_opened)
-					{
-						error |= write("    </font>\n");
-					}
-					font_opened = false;
-
-					if (page_opened)
-					{
-						error |= write("  </page>\n");
-					}
-					page_opened = false;
+				// the pictures are all written when returning
+				mbpOut->finish_pictures();
 
-					// close main tag
-					error |= write("</pdf2xml>\n");
-				}
+				error |= end_page();
 
-				delete title;
-				delete mbpOut;
+				// close main tag
+				error |= write("</pdf2xml>\n");
 			}
-			else error = true; // ERROR: Couldn't open the PDF file (file error / password protection / data corruption / copy protection)
-		//}
-		//else error = true; // ERROR: Couldn't get text encoding
-	}
-	else error = true; // ERROR: could not init globals
+
+			delete title;
+			delete mbpOut;
+		}
+		else error = true; // ERROR: Couldn't open the PDF file (file error / password protection / data corruption / copy protection)
+	//}
+	//else error = true; // ERROR: Couldn't get text encoding
 	
 	// clean up
-	delete doc;
 	//uMap->decRefCnt();
-	delete globalParams;
 	
 	return error;
 }
 
+//------------------------------------------------------------
+// Parallel conversion
+// Each worker opens its own PDFDoc, so the XRef, Catalog and their stream
+// positions stay private to a thread; only globalParams is shared and its
+// caches are locked (MULTITHREADED). Workers claim chunks of pages and
+// render every page into its own fragment. The fragments are written in
+// page order, which is when the pictures get their final names.
 //------------------------------------------------------------
 
-MbpOutputDev::MbpOutputDev(XmlOutput& target, GString& picture_base_name) :
-	dev_output(target),
-	dev_page_state(NULL),
-	dev_picture_references(16),
-	dev_picture_base(picture_base_name),
-	dev_picture_number(0),
-	dev_current_font_face(),
-	dev_current_font_bold(false),
-	dev_current_font_italic(false),
-	dev_current_font_size(0)
+// Output of a worker for one page
+class PageFragment
 {
-}
+public:
+
+	PageFragment () : pictures(4) {}
+
+	~PageFragment ()
+	{
+		for (int i = 0; i < pictures.getLength(); i++)
+		{
+			delete ((DeferredPicture*) pictures.get(i));
+		}
+	}
+
+	GString	xml;
+	GList	pictures;	// DeferredPicture*, in document order
+};
+
+// State shared by the workers and the thread writing the output
+class ParallelConversion
+{
+public:
+
+	ParallelConversion (GString& pdf_file, GString& picture_base, const PictureOptions& options,
+						int pages, int workers) :
+		pdf_file_name(pdf_file),
+		picture_base_name(picture_base),
+		picture_options(options),
+		nb_pages(pages),
+		next_page(1),
+		written_pages(0),
+		active_workers(workers),
+		window(workers * PAGES_PER_CHUNK * CHUNKS_AHEAD)
+	{
+		fragments = new PageFragment*[nb_pages];
+		for (int i = 0; i < nb_pages; i++) fragments[i] = NULL;
+	}
+
+	~ParallelConversion ()
+	{
+		for (int i = 0; i < nb_pages; i++) delete fragments[i];
+		delete [] fragments;
+	}
+
+	GString&				pdf_file_name;
+	GString&				picture_base_name;
+	const PictureOptions&	picture_options;
+	int						nb_pages;
+
+	std::mutex				lock;
+	std::condition_variable	changed;
+	int						next_page;		// first page not claimed by a worker
+	int						written_pages;	// pages already written to the output
+	int						active_workers;
+	int						window;			// pages allowed ahead of the output
+	PageFragment**			fragments;		// indexed by page - 1
+};
 
 //------------------------------------------------------------
 
-MbpOutputDev::~MbpOutputDev()
+static void render_pages (ParallelConversion* conversion, int worker)
 {
-	for (int i = 0; i < dev_picture_references.getLength(); i++)
+	PDFDoc* doc = new PDFDoc(new GString(&conversion->pdf_file_name), NULL, NULL);
+
+	// temporary picture names, renamed when the page is written
+	GString picture_base(&conversion->picture_base_name);
+	GString* worker_number = GString::fromInt(worker);
+	picture_base.append(".w");
+	picture_base.append(worker_number);
+	delete worker_number;
+
+	XmlOutput page_output;
+	page_output.open_memory();
+	page_output.set_picture_options(conversion->picture_options);
+	MbpOutputDev* dev = new MbpOutputDev(page_output, picture_base);
+
+	while (doc->isOk())
 	{
-		delete ((PictureReference*) dev_picture_references.get(i));
+		// claim the next chunk of pages
+		int first, last;
+		{
+			std::unique_lock<std::mutex> guard(conversion->lock);
+			while (   (conversion->next_page <= conversion->nb_pages)
+				   && (conversion->next_page > conversion->written_pages + conversion->window))
+			{
+				conversion->changed.wait(guard);
+			}
+
+			if (conversion->next_page > conversion->nb_pages) break;
+
+			first = conversion->next_page;
+			last  = first + PAGES_PER_CHUNK - 1;
+			if (last > conversion->nb_pages) last = conversion->nb_pages;
+			conversion->next_page = last + 1;
+		}
+
+		for (int page = first; page <= last; page++)
+		{
+			PageFragment* fragment = new PageFragment();
+
+			dev->defer_pictures(&fragment->pictures);
+			doc->displayPage(dev, page, 72, 72, 0, gFalse, gFalse, gTrue);
+			page_output.end_page();
+
+			// the pictures are renamed once the page is published
+			dev->finish_pictures();
+
+			fragment->xml.append(page_output.get_data(), page_output.get_length());
+			page_output.clear_memory();
+
+			std::lock_guard<std::mutex> guard(conversion->lock);
+			conversion->fragments[page - 1] = fragment;
+			conversion->changed.notify_all();
+		}
 	}
+
+	delete dev;
+	delete doc;
+
+	std::lock_guard<std::mutex> guard(conversion->lock);
+	conversion->active_workers--;
+	conversion->changed.notify_all();
 }
 
 //------------------------------------------------------------
 
-void MbpOutputDev::drawLink(Link *link, Catalog *catalog)
+bool XmlOutput::display_pages_parallel (GString& pdf_file_name, GString& picture_base_name, int nb_pages, int jobs)
 {
-	bool handled = true;
+	bool error = false;
 
-	if (link != NULL && link->isOk() && dev_page_state != NULL)
-	{
-		// border
-		double x1,y1,x2,y2;
-		// destination
-		double x, y, dx, dy;
-		link->getRect(&x1,&y1,&x2,&y2);
-		Rect active_rect;
+	if (jobs > nb_pages) jobs = nb_pages;
 
-		// active area
-		dev_page_state->transform(x1, y1, &x, &y);
-		dev_page_state->transformDelta(x2 - x1, y2 - y1, &dx, &dy);
-		active_rect.x		= round(x);
-		active_rect.y		= round(y);
-		active_rect.width	= round(dx);
-		active_rect.height	= round(dy);
+	ParallelConversion conversion(pdf_file_name, picture_base_name, picture_options, nb_pages, jobs);
 
-		// action
-		LinkAction* action = link->getAction();
+	std::thread** workers = new std::thread*[jobs];
+	for (int i = 0; i < jobs; i++)
+	{
+		workers[i] = new std::thread(render_pages, &conversion, i);
+	}
 
-		if (action != NULL && action->isOk())
+	// final names of the pictures, same numbering as a serial conversion
+	PictureIndex pictures;
+	int picture_number = 0;
+	GString pic_file;
+
+	for (int page = 1; page <= nb_pages; page++)
+	{
+		PageFragment* fragment;
 		{
-			switch (action->getKind())
+			std::unique_lock<std::mutex> guard(conversion.lock);
+			while (   (conversion.fragments[page - 1] == NULL)
+				   && (conversion.active_workers > 0))
 			{
-			// destination is on the web
-			case actionURI:
-				{
-					LinkURI* uri = (LinkURI*)action;
-					if (uri->isOk())
-					{
-						GString* dest = uri->getURI();
+				conversion.changed.wait(guard);
+			}
+
+			fragment = conversion.fragments[page - 1];
+			conversion.fragments[page - 1] = NULL;
+		}
+
+		// all the workers are gone without rendering this page
+		if (fragment == NULL)
+		{
+			error = true;
+			break;
+		}
+
+		const char* xml = fragment->xml.getCString();
+		int written = 0;
+
+		for (int i = 0; i < fragment->pictures.getLength(); i++)
+		{
+			DeferredPicture* picture = (DeferredPicture*) fragment->pictures.get(i);
+			PictureReference* reference = pictures.find(picture->reference_number, picture->picture_flip,
+														picture->picture_key);
+
+			if (reference != NULL)
+			{
+				// an earlier page already has this picture
+				pictures.alias(reference, picture->reference_number, picture->picture_flip, picture->picture_key);
+				MbpOutputDev::compose_image_filename(picture_base_name,
+													 reference->picture_number,
+													 reference->picture_extension,
+													 pic_file);
+				if (picture->picture_written)
+					remove(picture->picture_file.getCString());
+			}
+			else
+			{
+				MbpOutputDev::compose_image_filename(picture_base_name,
+													 ++picture_number,
+													 picture->picture_extension,
+													 pic_file);
+				remove(pic_file.getCString());
+				rename(picture->picture_file.getCString(), pic_file.getCString());
+
+				pictures.add(picture->reference_number, picture->picture_flip, picture->picture_key,
+							 picture_number, picture->picture_extension);
+			}
+
+			error |= write(xml + written, picture->xml_position - written);
+			error |= write_string(strip_directory(pic_file.getCString()));
+			written = picture->xml_position;
+		}
+
+		error |= write(xml + written, fragment->xml.getLength() - written);
+		delete fragment;
+
+		// let the workers run further ahead
+		std::lock_guard<std::mutex> guard(conversion.lock);
+		conversion.written_pages = page;
+		conversion.changed.notify_all();
+	}
+
+	// on error, stop the workers from claiming more pages
+	{
+		std::lock_guard<std::mutex> guard(conversion.lock);
+		conversion.next_page = nb_pages + 1;
+		conversion.written_pages = nb_pages;
+		conversion.changed.notify_all();
+	}
+
+	for (int i = 0; i < jobs; i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+	delete [] workers;
+
+	return error;
+}
+
+//------------------------------------------------------------
+// Background PNG encoding
+// Deflating the pictures takes longer than rendering the pages they are on,
+// so the pixels are handed to a pool of threads which encode and write the
+// PNG files while the rendering goes on. The file names are chosen by the
+// rendering thread, the XML does not depend on when the files are written.
+// The pixels waiting in the pool are limited in size: the rendering thread
+// waits when a new picture would exceed the limit.
+//------------------------------------------------------------
+
+// Write a PNG through <write_fn> and <flush_fn>, which receive <io_ptr>
+// returns true on error
+static bool encode_png (png_voidp io_ptr, png_rw_ptr write_fn, png_flush_ptr flush_fn,
+						const PngProfile& profile,
+						unsigned int width, unsigned int height, unsigned int row_stride,
+						unsigned char* data,
+						unsigned char bpp, unsigned char color_type, png_color* palette, unsigned short color_count)
+{
+	png_struct *png_ptr;
+	png_info *info_ptr;
+
+	// Create necessary structs
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL)
+	{
+		return true;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL)
+	{
+		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+		return true;
+	}
+
+	if (setjmp(png_ptr->jmpbuf))
+	{
+		png_destroy_write_struct(&png_ptr, (png_infopp) &info_ptr);
+		return true;
+	}
+ 
+	// Writing functions
+    png_set_write_fn(png_ptr, io_ptr, write_fn, flush_fn);
+
+	// Compression, before the header which starts zlib
+	if (profile.level >= 0)
+		png_set_compression_level(png_ptr, profile.level);
+	if (profile.filter >= 0)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, profile.filter);
+	int strategy = (bpp == 1) ? profile.bilevel_strategy : profile.strategy;
+	if (strategy >= 0)
+		png_set_compression_strategy(png_ptr, strategy);
+
+	// Image header
+	info_ptr->width				= width;
+	info_ptr->height			= height;
+	info_ptr->pixel_depth		= bpp;
+	info_ptr->channels			= (bpp>8) ? (unsigned char)3: (unsigned char)1;
+	info_ptr->bit_depth			= (unsigned char)(bpp/info_ptr->channels);
+	info_ptr->color_type		= color_type;
+	info_ptr->compression_type	= info_ptr->filter_type = 0;
+	info_ptr->valid				= 0;
+	info_ptr->rowbytes			= row_stride;
+	info_ptr->interlace_type	= PNG_INTERLACE_NONE;
+
+	// Background
+	png_color_16 image_background={ 0, 255, 255, 255, 0 };
+	png_set_bKGD(png_ptr, info_ptr, &image_background);
+
+	// Metrics
+	png_set_pHYs(png_ptr, info_ptr, 3780, 3780, PNG_RESOLUTION_METER); // 3780 dot per meter
+
+	// Palette
+	if (palette != NULL)
+	{
+		png_set_IHDR(png_ptr, info_ptr, info_ptr->width, info_ptr->height, info_ptr->bit_depth, 
+					 PNG_COLOR_TYPE_PALETTE, info_ptr->interlace_type, 
+					 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		info_ptr->valid |= PNG_INFO_PLTE;
+		info_ptr->palette = palette;
+		info_ptr->num_palette = color_count;
+	}  
+
+	// Write the file header
+	png_write_info(png_ptr, info_ptr);
+ 
+	// The pictures are not interlaced, the rows are written in a single pass
+	for (unsigned int y = 0; y < height; y++)
+	{
+		png_write_row(png_ptr, &data[row_stride * y]);
+	}
+	
+	// Finish writing
+	png_write_end(png_ptr, info_ptr);
+
+	// Cleanup
+	png_destroy_write_struct(&png_ptr, (png_infopp) &info_ptr);
+
+	return false;
+}
+
+//------------------------------------------------------------
+
+// libpng output functions of the encoder threads, writing to a FILE
+static void png_write_file (png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	if (fwrite(data, 1, length, (FILE*) png_ptr->io_ptr) != length)
+		png_error(png_ptr, "Write Error");
+}
+
+static void png_flush_file (png_structp png_ptr)
+{
+	if (fflush((FILE*) png_ptr->io_ptr))
+		png_error(png_ptr, "Flush Error");
+}
+
+//------------------------------------------------------------
+
+// Pixels of a picture waiting to be encoded
+class PngPicture
+{
+public:
+
+	PngPicture (GString& file, const PngProfile& settings,
+				unsigned int w, unsigned int h, unsigned int stride,
+				unsigned char* pixels, unsigned char depth, unsigned char type,
+				png_color* colors, unsigned short count, bool* done) :
+		file_name(&file),
+		profile(settings),
+		width(w),
+		height(h),
+		row_stride(stride),
+		data(pixels),
+		bpp(depth),
+		color_type(type),
+		color_count(colors != NULL ? count : 0),
+		pending(NULL),
+		written(done)
+	{
+		if (color_count > 256) color_count = 256;
+		if (color_count > 0) memcpy(palette, colors, color_count * sizeof(png_color));
+	}
+
+	~PngPicture () { delete [] data; }
+
+	size_t memory_size () const { return (size_t) row_stride * height; }
+
+	GString			file_name;
+	PngProfile		profile;
+	unsigned int	width;
+	unsigned int	height;
+	unsigned int	row_stride;
+	unsigned char*	data;			// owned, allocated with new[]
+	unsigned char	bpp;
+	unsigned char	color_type;
+	png_color		palette[256];
+	unsigned short	color_count;	// 0 without palette
+	int*			pending;		// counter of the device which queued the picture
+	bool*			written;		// set if the file is complete, may be NULL
+};
+
+//------------------------------------------------------------
+
+// Pool of threads encoding PNG pictures into files
+class PictureEncoder
+{
+public:
+
+	// <memory_limit> bytes of pixels at most wait in the pool
+	PictureEncoder (int threads, size_t memory_limit);
+
+	// waits for the pictures still queued
+	~PictureEncoder ();
+
+	// queue <picture>, which is deleted once written, <pending> is
+	// incremented until then and <picture->written> set beforehand
+	// waits while the pool holds too many pixels
+	void encode (PngPicture* picture, int* pending);
+
+	// wait until <pending> falls to zero
+	void wait (int* pending);
+
+private:
+
+	static void run (PictureEncoder* encoder);
+
+	std::mutex				lock;
+	std::condition_variable	changed;
+	GList					queue;			// PngPicture*, oldest first
+	size_t					memory_limit;
+	size_t					memory_used;	// pixels queued or being encoded
+	bool					stopping;
+	int						nb_threads;
+	std::thread**			threads;
+};
+
+//------------------------------------------------------------
+
+PictureEncoder::PictureEncoder (int threads_count, size_t memory) :
+	queue(16),
+	memory_limit(memory),
+	memory_used(0),
+	stopping(false),
+	nb_threads(threads_count)
+{
+	threads = new std::thread*[nb_threads];
+	for (int i = 0; i < nb_threads; i++)
+	{
+		threads[i] = new std::thread(run, this);
+	}
+}
+
+//------------------------------------------------------------
+
+PictureEncoder::~PictureEncoder ()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		changed.notify_all();
+	}
+
+	for (int i = 0; i < nb_threads; i++)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete [] threads;
+}
+
+//------------------------------------------------------------
+
+void PictureEncoder::encode (PngPicture* picture, int* pending)
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	// a picture larger than the limit goes alone
+	while ((memory_used > 0) && (memory_used + picture->memory_size() > memory_limit))
+	{
+		changed.wait(guard);
+	}
+
+	picture->pending = pending;
+	(*pending)++;
+	memory_used += picture->memory_size();
+	queue.append(picture);
+	changed.notify_all();
+}
+
+//------------------------------------------------------------
+
+void PictureEncoder::wait (int* pending)
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (*pending > 0)
+	{
+		changed.wait(guard);
+	}
+}
+
+//------------------------------------------------------------
+
+void PictureEncoder::run (PictureEncoder* encoder)
+{
+	std::unique_lock<std::mutex> guard(encoder->lock);
+
+	for (;;)
+	{
+		// the queue is emptied before stopping
+		while ((encoder->queue.getLength() == 0) && !encoder->stopping)
+		{
+			encoder->changed.wait(guard);
+		}
+
+		if (encoder->queue.getLength() == 0) break;
+
+		PngPicture* picture = (PngPicture*) encoder->queue.del(0);
+
+		guard.unlock();
+
+		// like on the rendering thread, a picture which cannot be written
+		// is left out
+		FILE* file = fopen(picture->file_name.getCString(), "wb");
+		bool error = (file == NULL);
+
+		if (!error)
+		{
+			error = encode_png((png_voidp) file, (png_rw_ptr) png_write_file, (png_flush_ptr) png_flush_file,
+							   picture->profile, picture->width, picture->height, picture->row_stride, picture->data,
+							   picture->bpp, picture->color_type,
+							   (picture->color_count > 0) ? picture->palette : NULL, picture->color_count);
+			error |= (fclose(file) != 0);
+		}
+
+		size_t size = picture->memory_size();
+		int* pending = picture->pending;
+		bool* written = picture->written;
+		delete picture;
+
+		guard.lock();
+
+		if (written != NULL) *written = !error;
+		encoder->memory_used -= size;
+		(*pending)--;
+		encoder->changed.notify_all();
+	}
+}
+
+//------------------------------------------------------------
+// PNG benchmark
+// With --png-benchmark, every PNG picture is encoded in memory with the
+// current profile and with each value of each setting in turn, the other
+// settings staying as in the profile. A line is printed on stderr for each
+// encoding and the totals per setting when the program ends.
+//------------------------------------------------------------
+
+// names of the filters and strategies on the command line
+static const char* const PNG_FILTER_NAMES[] = { "none", "sub", "up", "paeth", "adaptive" };
+static const int PNG_FILTER_VALUES[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+static const char* const PNG_STRATEGY_NAMES[] = { "default", "filtered", "huffman", "rle" };	// Z_DEFAULT_STRATEGY to Z_RLE
+
+// settings tried: the profile, levels 0-9, the 5 filters and the 4 strategies
+const int PNG_BENCHMARK_SETTINGS = 1 + 10 + 5 + 4;
+
+// Returns the index of <name> in <names>, -1 if not found
+static int find_name (const char* name, const char* const* names, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+
+	return -1;
+}
+
+//------------------------------------------------------------
+
+// libpng output function counting the bytes in a size_t
+static void png_count_data (png_structp png_ptr, png_bytep /* data */, png_size_t length)
+{
+	*((size_t*) png_ptr->io_ptr) += length;
+}
+
+static void png_no_flush (png_structp /* png_ptr */)
+{
+}
+
+//------------------------------------------------------------
+
+class PngBenchmark
+{
+public:
+
+	// compares the settings against <base>
+	PngBenchmark (const PngProfile& base) :
+		profile(base)
+	{
+		for (int kind = 0; kind < 2; kind++)
+		{
+			pictures[kind] = 0;
+			for (int i = 0; i < PNG_BENCHMARK_SETTINGS; i++)
+			{
+				total_bytes[kind][i] = 0;
+				total_ms[kind][i] = 0;
+			}
+		}
+	}
+
+	// encode a picture with each setting and report it
+	void run (const char* name,
+			  unsigned int width, unsigned int height, unsigned int row_stride,
+			  unsigned char* data,
+			  unsigned char bpp, unsigned char color_type, png_color* palette, unsigned short color_count);
+
+	// print the totals
+	void print_totals ();
+
+private:
+
+	// setting <i> derived from <profile>
+	PngProfile setting (int i) const;
+
+	// write the description of <profile> in <text>
+	static void describe (const PngProfile& profile, bool bilevel, char* text, int size);
+
+	PngProfile	profile;
+	std::mutex	lock;
+	int			pictures[2];	// indexed by bilevel
+	double		total_bytes[2][PNG_BENCHMARK_SETTINGS];
+	double		total_ms[2][PNG_BENCHMARK_SETTINGS];
+};
+
+//------------------------------------------------------------
+
+PngProfile PngBenchmark::setting (int i) const
+{
+	PngProfile result(profile);
+
+	if (i == 0) return result;
+	i--;
+
+	if (i < 10)
+	{
+		result.level = i;
+		return result;
+	}
+	i -= 10;
+
+	if (i < 5)
+	{
+		result.filter = PNG_FILTER_VALUES[i];
+		return result;
+	}
+	i -= 5;
+
+	result.strategy = result.bilevel_strategy = i;
+	return result;
+}
+
+//------------------------------------------------------------
+
+void PngBenchmark::describe (const PngProfile& profile, bool bilevel, char* text, int size)
+{
+	char level[12];	// fits any int
+	const char* filter = "default";
+	int strategy = bilevel ? profile.bilevel_strategy : profile.strategy;
+
+	if (profile.level >= 0)
+		snprintf(level, sizeof(level), "%d", profile.level);
+	else
+		strcpy(level, "default");
+
+	for (int i = 0; i < 5; i++)
+	{
+		if (profile.filter == PNG_FILTER_VALUES[i]) filter = PNG_FILTER_NAMES[i];
+	}
+
+	snprintf(text, size, "level=%s filter=%s strategy=%s", level, filter,
+			 (strategy >= 0) ? PNG_STRATEGY_NAMES[strategy] : "default");
+}
+
+//------------------------------------------------------------
+
+void PngBenchmark::run (const char* name,
+						unsigned int width, unsigned int height, unsigned int row_stride,
+						unsigned char* data,
+						unsigned char bpp, unsigned char color_type, png_color* palette, unsigned short color_count)
+{
+	int kind = (bpp == 1) ? 1 : 0;
+	size_t bytes[PNG_BENCHMARK_SETTINGS];
+	double ms[PNG_BENCHMARK_SETTINGS];
+
+	// the encodings are timed before taking the lock
+	for (int i = 0; i < PNG_BENCHMARK_SETTINGS; i++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		bytes[i] = 0;
+		encode_png((png_voidp) &bytes[i], (png_rw_ptr) png_count_data, (png_flush_ptr) png_no_flush,
+				   setting(i), width, height, row_stride, data,
+				   bpp, color_type, palette, color_count);
+
+		ms[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	char text[80];
+
+	pictures[kind]++;
+	for (int i = 0; i < PNG_BENCHMARK_SETTINGS; i++)
+	{
+		describe(setting(i), kind == 1, text, sizeof(text));
+		fprintf(stderr, "png-benchmark\t%s\t%ux%ux%d\t%s%s\t%lu bytes\t%.2f ms\n",
+				name, width, height, (int) bpp, text, (i == 0) ? " (profile)" : "",
+				(unsigned long) bytes[i], ms[i]);
+		total_bytes[kind][i] += (double) bytes[i];
+		total_ms[kind][i] += ms[i];
+	}
+}
+
+//------------------------------------------------------------
+
+void PngBenchmark::print_totals ()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	char text[80];
+
+	for (int kind = 0; kind < 2; kind++)
+	{
+		if (pictures[kind] == 0) continue;
+
+		for (int i = 0; i < PNG_BENCHMARK_SETTINGS; i++)
+		{
+			describe(setting(i), kind == 1, text, sizeof(text));
+			fprintf(stderr, "png-benchmark\ttotal %d %s pictures\t%s%s\t%.0f bytes\t%.2f ms\n",
+					pictures[kind], (kind == 1) ? "bilevel" : "color", text, (i == 0) ? " (profile)" : "",
+					total_bytes[kind][i], total_ms[kind][i]);
+		}
+	}
+}
+
+//------------------------------------------------------------
+// Picture keys
+// A picture is identified by a hash of its encoded bytes and of whatever
+// changes their decoding, so that copies of a picture stored in different
+// objects are found before being decoded, and pictures written by earlier
+// conversions can be copied from the cache directory (--picture-cache).
+// Inline images have no bytes of their own, they are keyed by their pixels.
+// The keys of a single document use a fast hash, those shared with other
+// documents through the cache directory are SHA-256 digests, so that a
+// crafted document cannot give its picture the key of another one.
+//------------------------------------------------------------
+
+// SHA-256 (FIPS 180-4), the result does not depend on how the bytes are
+// split between the calls to add
+class Sha256
+{
+public:
+
+	Sha256 () :
+		sha_length(0),
+		sha_used(0)
+	{
+		static const unsigned int INITIAL_STATE[8] =
+		{
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+		};
+		memcpy(sha_state, INITIAL_STATE, sizeof(sha_state));
+	}
+
+	void add (const void* data, size_t length)
+	{
+		const unsigned char* bytes = (const unsigned char*) data;
+		sha_length += length;
+
+		// complete the pending block
+		if (sha_used > 0)
+		{
+			size_t n = 64 - sha_used;
+			if (n > length) n = length;
+			memcpy(sha_block + sha_used, bytes, n);
+			sha_used += (int) n;
+			bytes += n;
+			length -= n;
+
+			if (sha_used < 64) return;
+			transform(sha_block);
+			sha_used = 0;
+		}
+
+		for (; length >= 64; bytes += 64, length -= 64)
+			transform(bytes);
+
+		memcpy(sha_block, bytes, length);
+		sha_used = (int) length;
+	}
+
+	void digest (unsigned char result[32])
+	{
+		unsigned long long bits = sha_length << 3;
+
+		// padding: a 1 bit, zeros, then the length in bits on 8 bytes
+		sha_block[sha_used++] = 0x80;
+		if (sha_used > 56)
+		{
+			memset(sha_block + sha_used, 0, 64 - sha_used);
+			transform(sha_block);
+			sha_used = 0;
+		}
+		memset(sha_block + sha_used, 0, 56 - sha_used);
+		for (int i = 0; i < 8; i++)
+			sha_block[56 + i] = (unsigned char) (bits >> ((7 - i) << 3));
+		transform(sha_block);
+
+		for (int i = 0; i < 32; i++)
+			result[i] = (unsigned char) (sha_state[i >> 2] >> ((3 - (i & 3)) << 3));
+	}
+
+private:
+
+	static inline unsigned int rotate (unsigned int x, int n)
+	{
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void transform (const unsigned char* block)
+	{
+		static const unsigned int ROUND_CONSTANTS[64] =
+		{
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		unsigned int w[64];
+		for (int i = 0; i < 16; i++)
+			w[i] = ((unsigned int) block[i * 4] << 24) | ((unsigned int) block[i * 4 + 1] << 16) |
+				   ((unsigned int) block[i * 4 + 2] << 8) | (unsigned int) block[i * 4 + 3];
+		for (int i = 16; i < 64; i++)
+		{
+			unsigned int s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			unsigned int s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		unsigned int v[8];
+		memcpy(v, sha_state, sizeof(v));
+
+		for (int i = 0; i < 64; i++)
+		{
+			unsigned int s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25);
+			unsigned int choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+			unsigned int t1 = v[7] + s1 + choice + ROUND_CONSTANTS[i] + w[i];
+			unsigned int s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22);
+			unsigned int majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+			unsigned int t2 = s0 + majority;
+
+			memmove(v + 1, v, 7 * sizeof(unsigned int));
+			v[4] += t1;
+			v[0] = t1 + t2;
+		}
+
+		for (int i = 0; i < 8; i++)
+			sha_state[i] += v[i];
+	}
+
+	unsigned int		sha_state[8];
+	unsigned long long	sha_length;
+	unsigned char		sha_block[64];
+	int					sha_used;
+};
+
+//------------------------------------------------------------
+
+// 128 bit hash in the manner of MurmurHash3, or with <secure> a SHA-256
+// digest, the result does not depend on how the bytes are split between
+// the calls to add
+class ContentHash
+{
+public:
+
+	ContentHash (bool secure) :
+		hash_secure(secure),
+		hash_a(0x243f6a8885a308d3ULL),
+		hash_b(0x13198a2e03707344ULL),
+		hash_length(0),
+		hash_used(0)
+	{}
+
+	void add (const void* data, size_t length)
+	{
+		if (hash_secure)
+		{
+			hash_sha.add(data, length);
+			return;
+		}
+
+		const unsigned char* bytes = (const unsigned char*) data;
+		hash_length += length;
+
+		// complete the pending block
+		if (hash_used > 0)
+		{
+			size_t n = 16 - hash_used;
+			if (n > length) n = length;
+			memcpy(hash_block + hash_used, bytes, n);
+			hash_used += (int) n;
+			bytes += n;
+			length -= n;
+
+			if (hash_used < 16) return;
+			mix(hash_block);
+			hash_used = 0;
+		}
+
+		for (; length >= 16; bytes += 16, length -= 16)
+			mix(bytes);
+
+		memcpy(hash_block, bytes, length);
+		hash_used = (int) length;
+	}
+
+	void add_int (int value)
+	{
+		unsigned char bytes[4] = { (unsigned char) value, (unsigned char) (value >> 8),
+								   (unsigned char) (value >> 16), (unsigned char) (value >> 24) };
+		add(bytes, 4);
+	}
+
+	void add_string (const char* s, int length)
+	{
+		add_int(length);
+		add(s, length);
+	}
+
+	// the key: 32 hexadecimal characters, 64 with <secure>
+	void digest (GString& key)
+	{
+		key.clear();
+
+		if (hash_secure)
+		{
+			unsigned char sha[32];
+			hash_sha.digest(sha);
+			for (int i = 0; i < 32; i++)
+			{
+				key.append(HEXADECIMAL_CHARACTERS[sha[i] >> 4]);
+				key.append(HEXADECIMAL_CHARACTERS[sha[i] & 0x0F]);
+			}
+			return;
+		}
+
+		memset(hash_block + hash_used, 0, 16 - hash_used);
+		mix(hash_block);
+
+		unsigned long long a = hash_a ^ hash_length;
+		unsigned long long b = hash_b ^ hash_length;
+		a += b;
+		b += a;
+		a = finish(a);
+		b = finish(b);
+		a += b;
+		b += a;
+
+		for (int i = 60; i >= 0; i -= 4)
+			key.append(HEXADECIMAL_CHARACTERS[(a >> i) & 0x0F]);
+		for (int i = 60; i >= 0; i -= 4)
+			key.append(HEXADECIMAL_CHARACTERS[(b >> i) & 0x0F]);
+	}
+
+private:
+
+	static inline unsigned long long rotate (unsigned long long x, int n)
+	{
+		return (x << n) | (x >> (64 - n));
+	}
+
+	static inline unsigned long long finish (unsigned long long x)
+	{
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	void mix (const unsigned char* block)
+	{
+		const unsigned long long c1 = 0x87c37b91114253d5ULL;
+		const unsigned long long c2 = 0x4cf5ad432745937fULL;
+
+		unsigned long long k1 = 0, k2 = 0;
+		for (int i = 7; i >= 0; i--)
+		{
+			k1 = (k1 << 8) | block[i];
+			k2 = (k2 << 8) | block[i + 8];
+		}
+
+		hash_a ^= rotate(k1 * c1, 31) * c2;
+		hash_a = (rotate(hash_a, 27) + hash_b) * 5 + 0x52dce729;
+		hash_b ^= rotate(k2 * c2, 33) * c1;
+		hash_b = (rotate(hash_b, 31) + hash_a) * 5 + 0x38495ab5;
+	}
+
+	bool				hash_secure;
+	Sha256				hash_sha;
+	unsigned long long	hash_a;
+	unsigned long long	hash_b;
+	unsigned long long	hash_length;
+	unsigned char		hash_block[16];
+	int					hash_used;
+};
+
+//------------------------------------------------------------
+
+// add the encoded bytes of <str> to <hash>
+static void hash_stream_bytes (ContentHash& hash, Stream* str)
+{
+	BaseStream* base = str->getBaseStream();
+	char* data;
+	Guint length;
+
+	if (base->getData(&data, &length))
+	{
+		hash.add(data, length);
+		return;
+	}
+
+	// the base stream puts the file position back when closed
+	char chunk[65536];
+	int n;
+
+	base->reset();
+	while ((n = base->getBlock(chunk, (int) sizeof(chunk))) > 0)
+		hash.add(chunk, n);
+	base->close();
+}
+
+// add <obj> to <hash>, following the references down to <depth> levels
+// a stream adds its dictionary and its encoded bytes
+static void hash_object (ContentHash& hash, Object* obj, int depth)
+{
+	Object item;
+
+	hash.add_int(obj->getType());
+
+	switch (obj->getType())
+	{
+		case objBool:
+			hash.add_int(obj->getBool());
+			break;
+		case objInt:
+			hash.add_int(obj->getInt());
+			break;
+		case objReal:
+		{
+			double real = obj->getReal();
+			hash.add(&real, sizeof(real));
+			break;
+		}
+		case objString:
+			hash.add_string(obj->getString()->getCString(), obj->getString()->getLength());
+			break;
+		case objName:
+			hash.add_string(obj->getName(), (int) strlen(obj->getName()));
+			break;
+		case objArray:
+			hash.add_int(obj->arrayGetLength());
+			if (depth <= 0) break;
+			for (int i = 0; i < obj->arrayGetLength(); i++)
+			{
+				hash_object(hash, obj->arrayGet(i, &item), depth - 1);
+				item.free();
+			}
+			break;
+		case objDict:
+			hash.add_int(obj->dictGetLength());
+			if (depth <= 0) break;
+			for (int i = 0; i < obj->dictGetLength(); i++)
+			{
+				const char* key = obj->dictGetKey(i);
+				hash.add_string(key, (int) strlen(key));
+				hash_object(hash, obj->dictGetVal(i, &item), depth - 1);
+				item.free();
+			}
+			break;
+		case objStream:
+			if (depth <= 0) break;
+			item.initDict(obj->streamGetDict());
+			hash_object(hash, &item, depth - 1);
+			item.free();
+			hash_stream_bytes(hash, obj->getStream());
+			break;
+		default:
+			break;
+	}
+}
+
+// add the color space of <colorMap> to <hash>: the object it was parsed
+// from, with the functions, lookup tables and ICC profiles it refers to,
+// or only its mode when it is implied by the image data
+static void hash_color_map (ContentHash& hash, GfxImageColorMap* colorMap)
+{
+	hash.add_int(colorMap->getColorSpace()->getMode());
+	hash.add_int(colorMap->getNumPixelComps());
+	hash.add_int(colorMap->getBits());
+	hash_object(hash, colorMap->getColorSpaceObj(), 8);
+}
+
+// key of the picture of the image object read from <str>: its encoded
+// bytes, filters and decoding, and how it is written
+// <shared> for a key also used in the cache directory
+static void stream_picture_key (Stream* str, GfxImageColorMap* colorMap, int width, int height,
+								int flip, const char* extension, const PngProfile& profile, bool shared,
+								GString& key)
+{
+	static const char* const DECODING_KEYS[] = { "Filter", "DecodeParms", "Decode" };
+
+	ContentHash hash(shared);
+	Object item;
+
+	hash.add_string("object", 6);
+	hash.add_int(width);
+	hash.add_int(height);
+	hash.add_int(flip);
+	hash.add_string(extension, (int) strlen(extension));
+	if (strcmp(extension, "png") == 0)
+		hash.add(&profile, sizeof(profile));
+
+	// a mask has no color map
+	hash.add_int(colorMap != NULL);
+	if (colorMap != NULL)
+		hash_color_map(hash, colorMap);
+
+	Dict* dict = str->getDict();
+	for (int i = 0; i < 3; i++)
+	{
+		if (dict != NULL)
+			dict->lookup((char*) DECODING_KEYS[i], &item);
+		else
+			item.initNull();
+		hash_object(hash, &item, 8);
+		item.free();
+	}
+
+	hash_stream_bytes(hash, str);
+	hash.digest(key);
+}
+
+// key of a decoded picture: its pixels and how it is written
+static void pixel_picture_key (unsigned int width, unsigned int height, unsigned int row_stride,
+							   const unsigned char* data, unsigned char bpp, const PngProfile& profile,
+							   bool shared, GString& key)
+{
+	ContentHash hash(shared);
+
+	hash.add_string("pixels", 6);
+	hash.add_int(width);
+	hash.add_int(height);
+	hash.add_int(bpp);
+	hash.add(&profile, sizeof(profile));
+
+	unsigned int row_bytes = (width * bpp + 7) >> 3;
+	for (unsigned int y = 0; y < height; y++)
+		hash.add(data + y * row_stride, row_bytes);
+
+	hash.digest(key);
+}
+
+//------------------------------------------------------------
+
+// "ref flip", the key of a picture in PictureIndex::index_objects
+static GString* object_key (int ref, int flip)
+{
+	GString* key = GString::fromInt(ref);
+	key->append(' ');
+	key->append((char) ('0' + flip));
+	return key;
+}
+
+//------------------------------------------------------------
+
+PictureIndex::PictureIndex () :
+	index_pictures(16),
+	index_objects(gTrue),
+	index_contents(gTrue)
+{
+}
+
+//------------------------------------------------------------
+
+PictureIndex::~PictureIndex ()
+{
+	for (int i = 0; i < index_pictures.getLength(); i++)
+	{
+		delete ((PictureReference*) index_pictures.get(i));
+	}
+}
+
+//------------------------------------------------------------
+
+PictureReference* PictureIndex::find (int ref, int flip, GString& key)
+{
+	PictureReference* picture = NULL;
+
+	if (ref != -1)
+	{
+		GString* name = object_key(ref, flip);
+		picture = (PictureReference*) index_objects.lookup(name);
+		delete name;
+	}
+
+	if ((picture == NULL) && (key.getLength() > 0))
+		picture = (PictureReference*) index_contents.lookup(&key);
+
+	return picture;
+}
+
+//------------------------------------------------------------
+
+PictureReference* PictureIndex::add (int ref, int flip, GString& key, int number, const char* const extension,
+									 const char* const attributes)
+{
+	PictureReference* picture = new PictureReference(ref, flip, number, extension, attributes);
+	index_pictures.append(picture);
+	alias(picture, ref, flip, key);
+	return picture;
+}
+
+//------------------------------------------------------------
+
+void PictureIndex::alias (PictureReference* picture, int ref, int flip, GString& key)
+{
+	if (ref != -1)
+	{
+		GString* name = object_key(ref, flip);
+		if (index_objects.lookup(name) == NULL)
+			index_objects.add(name, picture);
+		else
+			delete name;
+	}
+
+	if ((key.getLength() > 0) && (index_contents.lookup(&key) == NULL))
+		index_contents.add(new GString(&key), picture);
+}
+
+//------------------------------------------------------------
+// Picture cache
+// The PNG pictures are kept in a directory under their key, <key>.png, and
+// copied from there by the conversions finding the same key. The files are
+// written under a temporary name and renamed, so that the conversions of a
+// batch can share the directory.
+//------------------------------------------------------------
+
+class PictureCache
+{
+public:
+
+	PictureCache (const char* directory) :
+		cache_directory(directory),
+		cache_files(0)
+	{}
+
+	// the cached picture for <key>, NULL if none
+	FILE* open (GString& key)
+	{
+		GString file_name;
+		compose_name(key, file_name);
+		return fopen(file_name.getCString(), "rb");
+	}
+
+	// copy the picture file <file_name> as the picture for <key>
+	void store (GString& file_name, GString& key)
+	{
+		GString cache_name, temp_name;
+		compose_name(key, cache_name);
+
+		FILE* cached = fopen(cache_name.getCString(), "rb");
+		if (cached != NULL)
+		{
+			fclose(cached);
+			return;
+		}
+
+		GString* number;
+		{
+			std::lock_guard<std::mutex> guard(cache_lock);
+			number = GString::fromInt(++cache_files);
+		}
+		temp_name.append(&cache_name);
+		temp_name.append('.');
+		temp_name.append(number);
+		temp_name.append(".tmp");
+		delete number;
+
+		FILE* in = fopen(file_name.getCString(), "rb");
+		if (in == NULL) return;
+
+		FILE* out = fopen(temp_name.getCString(), "wb");
+		bool error = (out == NULL);
+
+		if (!error)
+		{
+			char chunk[65536];
+			size_t n;
+
+			while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+				error |= (fwrite(chunk, 1, n, out) != n);
+			error |= (ferror(in) != 0);
+			error |= (fclose(out) != 0);
+
+			// another conversion may have stored it meanwhile
+			if (error || (rename(temp_name.getCString(), cache_name.getCString()) != 0))
+				remove(temp_name.getCString());
+		}
+		fclose(in);
+	}
+
+private:
+
+	void compose_name (GString& key, GString& result)
+	{
+		result.append(&cache_directory);
+		result.append('/');
+		result.append(&key);
+		result.append(".png");
+	}
+
+	GString		cache_directory;
+	std::mutex	cache_lock;
+	int			cache_files;	// temporary files created, for their names
+};
+
+//------------------------------------------------------------
+
+// A picture file to copy in the cache once complete
+class CachedPicture
+{
+public:
+
+	CachedPicture (GString& file, GString& picture_key) :
+		file_name(&file),
+		key(&picture_key),
+		written(false)
+	{}
+
+	GString	file_name;
+	GString	key;
+	bool	written;	// set by save_png, on the encoder threads if there are some
+};
+
+//------------------------------------------------------------
+
+MbpOutputDev::MbpOutputDev(XmlOutput& target, GString& picture_base_name, OutputSink* sink) :
+	dev_output(target),
+	dev_page_state(NULL),
+	dev_current_font_face(),
+	dev_current_font_bold(false),
+	dev_current_font_italic(false),
+	dev_current_font_size(0),
+	dev_sink(sink),
+	dev_picture_file(NULL),
+	dev_picture_base(picture_base_name),
+	dev_picture_number(0),
+	dev_deferred_pictures(NULL),
+	dev_pending_pictures(0),
+	dev_cached_pictures(4)
+{
+}
+
+//------------------------------------------------------------
+
+MbpOutputDev::~MbpOutputDev()
+{
+	// the encoder still refers to dev_pending_pictures
+	finish_pictures();
+}
+
+//------------------------------------------------------------
+
+void MbpOutputDev::finish_pictures()
+{
+	PictureEncoder* encoder = dev_output.get_picture_options().png_encoder;
+
+	if (encoder != NULL)
+		encoder->wait(&dev_pending_pictures);
+
+	// the files are complete, copy the new ones in the cache, a file which
+	// could not be written would give a broken picture to later conversions
+	PictureCache* cache = dev_output.get_picture_options().picture_cache;
+
+	while (dev_cached_pictures.getLength() > 0)
+	{
+		CachedPicture* picture = (CachedPicture*) dev_cached_pictures.del(0);
+
+		if ((cache != NULL) && picture->written)
+			cache->store(picture->file_name, picture->key);
+
+		delete picture;
+	}
+}
+
+//------------------------------------------------------------
+
+bool MbpOutputDev::uses_picture_cache ()
+{
+	return (dev_output.get_picture_options().picture_cache != NULL) && (dev_sink == NULL);
+}
+
+//------------------------------------------------------------
+
+bool MbpOutputDev::copy_cached_picture (GString& key, GString& file_name)
+{
+	if (!uses_picture_cache() || (key.getLength() == 0))
+		return false;
+
+	FILE* cached = dev_output.get_picture_options().picture_cache->open(key);
+	if (cached == NULL)
+		return false;
+
+	bool error = begin_picture(file_name);
+
+	if (!error)
+	{
+		char chunk[65536];
+		size_t n;
+
+		while (!error && ((n = fread(chunk, 1, sizeof(chunk), cached)) > 0))
+			error = write_picture(chunk, (int) n);
+
+		error |= (ferror(cached) != 0);
+		error |= end_picture();
+	}
+
+	fclose(cached);
+
+	// the picture is decoded again over what was copied
+	return !error;
+}
+
+//------------------------------------------------------------
+
+void MbpOutputDev::drawLink(Link *link, Catalog *catalog)
+{
+	bool handled = true;
+
+	if (link != NULL && link->isOk() && dev_page_state != NULL)
+	{
+		// border
+		double x1,y1,x2,y2;
+		// destination
+		double x, y, dx, dy;
+		link->getRect(&x1,&y1,&x2,&y2);
+		Rect active_rect;
+
+		// active area
+		dev_page_state->transform(x1, y1, &x, &y);
+		dev_page_state->transformDelta(x2 - x1, y2 - y1, &dx, &dy);
+		active_rect.x		= round(x);
+		active_rect.y		= round(y);
+		active_rect.width	= round(dx);
+		active_rect.height	= round(dy);
+
+		// action
+		LinkAction* action = link->getAction();
+
+		if (action != NULL && action->isOk())
+		{
+			switch (action->getKind())
+			{
+			// destination is on the web
+			case actionURI:
+				{
+					LinkURI* uri = (LinkURI*)action;
+					if (uri->isOk())
+					{
+						GString* dest = uri->getURI();
 						if (dest != NULL)
 						{
 							dev_output.add_link(active_rect, *dest);
@@ -631,13 +2325,12 @@ void MbpOutputDev::drawLink(Link *link, Catalog *catalog)
 					LinkGoTo* goto_link = (LinkGoTo*)action;
 					if (goto_link->isOk())
 					{
-						bool newlink = false;
 						LinkDest* link_dest = goto_link->getDest();
 						GString*  name_dest = goto_link->getNamedDest();
 						if (name_dest != NULL && catalog != NULL)
 						{
-							link_dest = catalog->findDest(name_dest);
-							newlink   = true;
+							// owned by the catalog, which resolves all named destinations once
+							link_dest = catalog->lookupDest(name_dest);
 						}
 						if (link_dest != NULL && link_dest->isOk())
 						{
@@ -674,10 +2367,6 @@ void MbpOutputDev::drawLink(Link *link, Catalog *catalog)
 								dev_output.add_link(active_rect, page-1, 0, 0); // page counted from 0
 								break;
 							}
-
-							// must delete the link object if it comes from the catalog
-							if (newlink)
-								delete link_dest;
 						}
 					}
 					break;
@@ -999,22 +2688,10 @@ bool MbpOutputDev::compare_with_coalesc(GString& str)
 
 //------------------------------------------------------------
 
-void MbpOutputDev::append_image_block(int x, int y, int width, int height, GString& pic_filename)
+void MbpOutputDev::append_image_block(int x, int y, int width, int height, GString& pic_filename,
+									  const char* attributes)
 {
-	char* pic_chars = pic_filename.getCString();
-	int last_path_separator_index = -1;
-
-	for (int index = 0; ; index++)
-	{
-		if (pic_chars[index] == 0) break;
-		if (   (pic_chars[index] == '\\')
-			|| (pic_chars[index] == '/'))
-		{
-			last_path_separator_index = index;
-		}
-	}
-
-	GString relname(&(pic_chars[last_path_separator_index + 1]));
+	GString relname(strip_directory(pic_filename.getCString()));
 
 	// flush previous text blocks
 	flush_coalesc_blocks();
@@ -1026,7 +2703,7 @@ void MbpOutputDev::append_image_block(int x, int y, int width, int height, GStri
 	rect.height = height;
 
 	// append the block
-	dev_output.add_image_block(relname, rect);
+	dev_output.add_image_block(relname, rect, attributes);
 }
 
 //------------------------------------------------------------
@@ -1079,20 +2756,11 @@ GString& MbpOutputDev::handle_string(GfxState *state, GString *s, double& width,
 
 		for (i=0; i<uLen; i++)
 		{
+			// characters harmful in XML are converted by the output
 			ulen = mapUTF8(u[i], ubuf, UBUF_LEN);
 
 			if (ulen == 1)
-			{
-				char uu = ubuf[0];
-				// if we only need to convert characters harmful in XML, we do it here
-				switch (uu)
-				{
-					case L'<': dev_conversion_buffer.append("&lt;"); break;
-					case L'>': dev_conversion_buffer.append("&gt;"); break;
-					case L'&': dev_conversion_buffer.append("&amp;"); break;
-					default: dev_conversion_buffer.append(uu);
-				}
-			}
+				dev_conversion_buffer.append(ubuf[0]);
 			else
 				dev_conversion_buffer.append((char*) &ubuf, ulen);
 		}
@@ -1132,6 +2800,112 @@ GString& MbpOutputDev::handle_string(GfxState *state, GString *s, double& width,
 
 //------------------------------------------------------------
 
+// true if the JPEG read from <str> has an Adobe APP14 marker, the CMYK
+// values of such JPEGs are shown inverted by the viewers
+static bool has_adobe_marker (Stream* str)
+{
+	bool adobe = false;
+	char chunk[256];
+
+	str->reset();
+
+	if ((str->getChar() == 0xff) && (str->getChar() == 0xd8))
+	{
+		// walk the marker segments up to the scan
+		while (str->getChar() == 0xff)
+		{
+			int marker;
+			do marker = str->getChar(); while (marker == 0xff);
+
+			if ((marker == EOF) || (marker == 0xda) || (marker == 0xd9)) break;
+
+			int length = str->getChar() << 8;
+			length |= str->getChar();
+			if (length < 2) break;
+			length -= 2;
+
+			if ((marker == 0xee) && (length >= 5))
+			{
+				adobe = (str->getBlock(chunk, 5) == 5) && (strncmp(chunk, "Adobe", 5) == 0);
+				break;
+			}
+
+			while (length > 0)
+			{
+				int n = str->getBlock(chunk, (length < (int) sizeof(chunk)) ? length : (int) sizeof(chunk));
+				if (n <= 0) break;
+				length -= n;
+			}
+			if (length > 0) break;
+		}
+	}
+
+	str->close();
+
+	return adobe;
+}
+
+//------------------------------------------------------------
+
+// <img> attributes of a grayscale or CMYK JPEG copied as it is, NULL if
+// it must be decoded: other color spaces or a Decode array that is neither
+// the default nor its inversion
+static const char* raw_jpeg_attributes (Stream* str, GfxImageColorMap* colorMap)
+{
+	GfxColorSpace* space = colorMap->getColorSpace();
+	if (space->getMode() == csICCBased)
+		space = ((GfxICCBasedColorSpace*) space)->getAlt();
+
+	bool cmyk;
+	switch (space->getMode())
+	{
+		case csDeviceGray:
+		case csCalGray:
+			cmyk = false;
+			break;
+		case csDeviceCMYK:
+			cmyk = true;
+			break;
+		default:
+			return NULL;
+	}
+	if (space->getNComps() != colorMap->getNumPixelComps()) return NULL;
+
+	bool invert = (colorMap->getDecodeLow(0) == 1);
+	for (int i = 0; i < colorMap->getNumPixelComps(); i++)
+	{
+		if (   (colorMap->getDecodeLow(i) != (invert ? 1 : 0))
+			|| (colorMap->getDecodeHigh(i) != (invert ? 0 : 1)))
+			return NULL;
+	}
+
+	// the inversion is given against what the viewers show
+	if (cmyk && has_adobe_marker(((DCTStream*) str)->getRawStream()))
+		invert = !invert;
+
+	if (cmyk)
+		return invert ? " colorspace=\"cmyk\" invert=\"true\"" : " colorspace=\"cmyk\"";
+	return invert ? " colorspace=\"gray\" invert=\"true\"" : " colorspace=\"gray\"";
+}
+
+//------------------------------------------------------------
+
+GBool MbpOutputDev::needNonText()
+{
+	return dev_output.get_picture_options().image_policy != PictureOptions::IMAGES_NONE;
+}
+
+//------------------------------------------------------------
+
+GBool MbpOutputDev::needImage(int width, int height)
+{
+	const PictureOptions& options = dev_output.get_picture_options();
+
+	return (width >= options.min_image_width) && (height >= options.min_image_height);
+}
+
+//------------------------------------------------------------
+
 void MbpOutputDev::drawImageMask(GfxState *state, Object *ref, Stream *str,
 					int width, int height, GBool /* invert */,
 					GBool inlineImg)
@@ -1188,83 +2962,177 @@ void MbpOutputDev::drawImageOrMask(GfxState *state, Object* ref, Stream *str,
 		y2 = temp;
 	}
 
+	const PictureOptions& options = dev_output.get_picture_options();
+
+	// only the bounds and the size, the data of an inline image is read
+	// through as it is followed by more content
+	if (options.image_policy == PictureOptions::IMAGES_METADATA)
+	{
+		if (inlineImg)
+		{
+			int row_size = mask ? (width + 7) >> 3
+								: (width * colorMap->getNumPixelComps() * colorMap->getBits() + 7) >> 3;
+			char* row = new char[row_size];
+
+			str->reset();
+			for (int y = 0; (y < height) && (str->getBlock(row, row_size) > 0); y++) ;
+			str->close();
+
+			delete [] row;
+		}
+
+		GString size(" pixel_width=\"");
+		GString* number = GString::fromInt(width);
+		size.append(number);
+		delete number;
+		size.append("\" pixel_height=\"");
+		number = GString::fromInt(height);
+		size.append(number);
+		delete number;
+		size.append('"');
+
+		flush_coalesc_blocks();
+
+		Rect rect;
+		rect.x = round(x1);
+		rect.y = round(y1);
+		rect.width  = round(x2-x1);
+		rect.height = round(y2-y1);
+		dev_output.add_image_bounds(rect, size.getCString());
+		return;
+	}
+
 	int reference = -1;
+	const char* extension = NULL;
+	const char* attributes = NULL;
+	bool written = false;
+	GString key;
+	PictureReference* picture = NULL;
+
 	if ((ref != NULL) && (ref->isRef()))
 	{
 		reference = ref->getRefNum();
+		picture = dev_picture_index.find(reference, flip, key);
+	}
 
-		for (int i = 0; i < dev_picture_references.getLength(); i++)
-		{
-			PictureReference* pic_reference = (PictureReference*) dev_picture_references.get(i);
+	// the color JPEGs are copied, the grayscale and CMYK ones on demand
+	bool copy_jpeg = false;
+	if ((picture == NULL) && (str->getKind() == strDCT) && !inlineImg)
+	{
+		if (!mask && (colorMap->getNumPixelComps() != 3) && options.raw_jpeg)
+			attributes = raw_jpeg_attributes(str, colorMap);
 
-			if (   (pic_reference->reference_number == reference)
-				&& (pic_reference->picture_flip == flip))
-			{
-				// We already created a file for this picture
-				compose_image_filename(dev_picture_base,
-									   pic_reference->picture_number,
-									   pic_reference->picture_extension,
-									   pic_file);
-				break;
-			}
-		}
+		copy_jpeg = mask || (colorMap->getNumPixelComps() == 3) || (attributes != NULL);
+	}
+
+	// another object may hold the same picture
+	if ((picture == NULL) && (reference != -1))
+	{
+		stream_picture_key(str, mask ? NULL : colorMap, width, height, flip,
+						   copy_jpeg ? "jpg" : "png", options.png_profile, uses_picture_cache(), key);
+
+		picture = dev_picture_index.find(-1, 0, key);
+		if (picture != NULL)
+			dev_picture_index.alias(picture, reference, flip, key);
+	}
+
+	if (picture != NULL)
+	{
+		// We already created a file for this picture
+		compose_image_filename(dev_picture_base,
+							   picture->picture_number,
+							   picture->picture_extension,
+							   pic_file);
+		extension = picture->picture_extension;
+		attributes = picture->picture_attributes;
 	}
 
-	if (pic_file.getLength() == 0)
+	// ------------------------------------------------------------
+	// dump JPEG file
+	// ------------------------------------------------------------
+
+	else if (copy_jpeg)
 	{
-		// picture filename is empty, which means this reference was not found
-		// ouput the file
-		const char* extension = NULL;
+		written = true;
 
-		// ------------------------------------------------------------
-		// dump JPEG file
-		// ------------------------------------------------------------
+		// TODO, do we need to flip Jpegs too?
 
-		if (str->getKind() == strDCT && (mask || colorMap->getNumPixelComps() == 3) && !inlineImg)
+		// open image file
+		extension = "jpg";
+		compose_image_filename(dev_picture_base, ++dev_picture_number, extension, pic_file);
+
+		if (!begin_picture(pic_file))
 		{
-			// TODO, do we need to flip Jpegs too?
+			str = ((DCTStream *)str)->getRawStream();
 
-			// open image file
-			extension = "jpg";
-			compose_image_filename(dev_picture_base, ++dev_picture_number, extension, pic_file);
+			// when nothing but the DCT filter sits on the data, the JPEG
+			// is copied as is: straight from memory (mapped file) or from
+			// the source file range
+			BaseStream* base = str->getBaseStream();
+			char* raw_data;
+			FILE* raw_file;
+			Guint raw_start, raw_length;
 
-			FILE* img_file = fopen(pic_file.getCString(), "wb");
-			if (img_file != NULL)
+			if (base == str && base->getData(&raw_data, &raw_length))
+			{
+				write_picture(raw_data, (int) raw_length);
+			}
+			else if (base != str || !base->getFileRange(&raw_file, &raw_start, &raw_length) ||
+					 copy_picture(raw_file, raw_start, raw_length))
 			{
 				// initialize stream
-				str = ((DCTStream *)str)->getRawStream();
 				str->reset();
 
-				int c;
+				char chunk[65536];
+				int length;
 
 				// copy the stream
-				while ((c = str->getChar()) != EOF)
+				while ((length = str->getBlock(chunk, (int) sizeof(chunk))) > 0)
 				{
-					fputc(c, img_file);
+					write_picture(chunk, length);
 				}
 
 				// cleanup
 				str->close();
-				// file cleanup
-				fclose(img_file);
 			}
-			// else TODO report error
+
+			// file cleanup
+			end_picture();
 		}
+		// else TODO report error
+	}
 
-		// ------------------------------------------------------------
-		// dump black and white image
-		// ------------------------------------------------------------
+	// ------------------------------------------------------------
+	// dump PNG file
+	// ------------------------------------------------------------
 
-		else if (mask || (colorMap->getNumPixelComps() == 1 && colorMap->getBits() == 1))
+	else
+	{
+		written = true;
+		extension = "png";
+
+		// the picture of an object may be in the cache
+		bool cached = false;
+		if (key.getLength() > 0)
 		{
-			extension = "png";
 			compose_image_filename(dev_picture_base, ++dev_picture_number, extension, pic_file);
+			cached = copy_cached_picture(key, pic_file);
+		}
 
-			int stride = (width + 7) >> 3;
-			unsigned char* data = new unsigned char[stride * height];
+		if (!cached)
+		{
+			unsigned char* data;
+			int stride;
+			unsigned char bpp;
+			png_color palette[2];
 
-			if (data != NULL)
+			// black and white image
+			if (mask || (colorMap->getNumPixelComps() == 1 && colorMap->getBits() == 1))
 			{
+				stride = (width + 7) >> 3;
+				bpp = 1;
+				data = new unsigned char[stride * height];
+
 				str->reset();
 
 				// Prepare increments and initial value for flipping
@@ -1305,16 +3173,28 @@ void MbpOutputDev::drawImageOrMask(GfxState *state, Object* ref, Stream *str,
 					}
 				}
 
-				// Retrieve the image raw data (columnwise monochrome pixels)
+				// Retrieve the image raw data (columnwise monochrome pixels),
+				// one row per read; missing bytes read as EOF (0xff)
 				for (int y = 0; y < height; y++)
 				{
-					for (int x = 0; x < stride; x++)
+					unsigned char* row = (x_increment > 0) ? data + k : data + k - (stride - 1);
+					int n = str->getBlock((char*) row, stride);
+
+					if (n < stride)
+					{
+						memset(row + n, 0xff, stride - n);
+					}
+					if (x_increment < 0)
 					{
-						data[k] = (unsigned char) str->getChar();
-						k += x_increment;
+						for (int l = 0, r = stride - 1; l < r; l++, r--)
+						{
+							unsigned char a = row[l];
+							row[l] = row[r];
+							row[r] = a;
+						}
 					}
 
-					k += y_increment;
+					k += stride * x_increment + y_increment;
 				}
 
 				// there is more if the image is flipped in x...
@@ -1356,124 +3236,221 @@ void MbpOutputDev::drawImageOrMask(GfxState *state, Object* ref, Stream *str,
 				str->close();
 
 				// Set a B&W palette
-				png_color palette[2];
 				palette[0].red = palette[0].green = palette[0].blue = 0;
 				palette[1].red = palette[1].green = palette[1].blue = 0xFF;
-
-				// Save PNG file
-				save_png(pic_file, width, height, stride, data, 1, PNG_COLOR_TYPE_PALETTE, palette, 2);
-                delete data;
 			}
-		}
-
-		// ------------------------------------------------------------
-		// dump color or greyscale image
-		// ------------------------------------------------------------
-
-		else
-		{
-			extension = "png";
-			compose_image_filename(dev_picture_base, ++dev_picture_number, extension, pic_file);
 
-			unsigned char* data = new unsigned char[width * height * 3];
-
-			if (data != NULL)
+			// color or greyscale image
+			else
 			{
+				stride = width * 3;
+				bpp = 24;
+				data = new unsigned char[stride * height];
+
 				ImageStream* imgStr = new ImageStream(str, width, colorMap->getNumPixelComps(), colorMap->getBits());
 				imgStr->reset();
 
-				GfxRGB rgb;
-
-				// Prepare increments and initial value for flipping
-				int k, x_increment, y_increment;
+				// a row is converted at once, into place, or into a temporary
+				// row reversed afterwards if the image is flipped in x
+				int row_bytes = 3 * width;
+				unsigned char* line = flip_x ? new unsigned char[row_bytes] : NULL;
 
-				if (flip_x)
+				// Retrieve the image raw data (RGB pixels)
+				for (int y = 0; y < height; y++)
 				{
-					if (flip_y)
+					Guchar* p = imgStr->getLine();
+					unsigned char* row = data + (flip_y ? height - 1 - y : y) * row_bytes;
+
+					if (flip_x)
 					{
-						// both flipped
-						k = 3 * height * width - 3;
-						x_increment = -6;
-						y_increment = 0;
+						colorMap->getRGBLine(p, line, width);
+						for (int x = 0, k = row_bytes - 3; x < row_bytes; x += 3, k -= 3)
+						{
+							row[k]		= line[x];
+							row[k + 1]	= line[x + 1];
+							row[k + 2]	= line[x + 2];
+						}
 					}
 					else
-					{
-						// x flipped
-						k = 3 * (width - 1);
-						x_increment = -6;
-						y_increment = 6 * width;
-					}
+						colorMap->getRGBLine(p, row, width);
+				}
+
+				delete[] line;
+				delete imgStr;
+			}
+
+			// an inline image is only known from its pixels
+			if (inlineImg)
+			{
+				pixel_picture_key(width, height, stride, data, bpp, options.png_profile, uses_picture_cache(), key);
+				picture = dev_picture_index.find(-1, 0, key);
+			}
+
+			if (picture != NULL)
+			{
+				compose_image_filename(dev_picture_base,
+									   picture->picture_number,
+									   picture->picture_extension,
+									   pic_file);
+				written = false;
+				delete [] data;
+			}
+			else
+			{
+				if (pic_file.getLength() == 0)
+				{
+					compose_image_filename(dev_picture_base, ++dev_picture_number, extension, pic_file);
+					cached = copy_cached_picture(key, pic_file);
 				}
+
+				if (cached)
+					delete [] data;
 				else
 				{
-					if (flip_y)
+					// copied in the cache once written
+					bool* written = NULL;
+					if (uses_picture_cache())
 					{
-						// y flipped
-						k = 3 * (height - 1) * width;
-						x_increment = 0;
-						y_increment = -6 * width;
+						CachedPicture* picture = new CachedPicture(pic_file, key);
+						dev_cached_pictures.append(picture);
+						written = &picture->written;
 					}
+
+					// Save PNG file
+					if (bpp == 1)
+						save_png(pic_file, width, height, stride, data, 1, PNG_COLOR_TYPE_PALETTE, palette, 2, written);
 					else
-					{
-						// not flipped
-						k = 0;
-						x_increment = 0;
-						y_increment = 0;
-					}
+						save_png(pic_file, width, height, stride, data, 24, PNG_COLOR_TYPE_RGB, NULL, 0, written);
 				}
+			}
+		}
+	}
+
+	if (written)
+	{
+		// Save this in the references
+		dev_picture_index.add(reference, flip, key, dev_picture_number, extension, attributes);
+	}
+
+	if (dev_deferred_pictures != NULL)
+	{
+		// the final name is given when the page is written, leave src empty
+		GString temp_file(&pic_file);
+		pic_file.clear();
+		append_image_block(round(x1), round(y1), round(x2-x1), round(y2-y1), pic_file, attributes);
+		dev_deferred_pictures->append(new DeferredPicture(reference, flip, key, extension, written,
+														  temp_file, dev_output.get_image_position()));
+	}
+	else
+		append_image_block(round(x1), round(y1), round(x2-x1), round(y2-y1), pic_file, attributes);
+}
 
-				// Retrieve the image raw data (RGB pixels)
-				for (int y = 0; y < height; y++)
-				{
-					Guchar* p = imgStr->getLine();
-					for (int x = 0; x < width; x++)
-					{
-						colorMap->getRGB(p, &rgb);
-						data[k++] = clamp(rgb.r >> 8);
-						data[k++] = clamp(rgb.g >> 8);
-						data[k++] = clamp(rgb.b >> 8);
-						k += x_increment;
-						p += colorMap->getNumPixelComps();
-					}
+//------------------------------------------------------------
 
-					k += y_increment;
-				}
+bool MbpOutputDev::begin_picture (GString& file_name)
+{
+	if (dev_sink != NULL)
+		return dev_sink->begin_picture(strip_directory(file_name.getCString()));
 
-				delete imgStr;
+	dev_picture_file = fopen(file_name.getCString(), "wb");
 
-				// Save PNG file
-				save_png(pic_file, width, height, width * 3, data, 24, PNG_COLOR_TYPE_RGB, NULL, 0);
-                delete data;
-			}
-		}
+	return dev_picture_file == NULL;
+}
+
+//------------------------------------------------------------
+
+bool MbpOutputDev::write_picture (const char* data, int length)
+{
+	if (dev_sink != NULL)
+		return dev_sink->write_picture(data, length);
+
+	return fwrite(data, 1, length, dev_picture_file) != (size_t) length;
+}
+
+//------------------------------------------------------------
+
+bool MbpOutputDev::copy_picture (FILE* file, Guint start, Guint length)
+{
+#ifdef _WIN32
+	return true;
+#else
+	int in = fileno(file);
+	off_t offset = (off_t) start;
+	Guint remaining = length;
+
+#ifdef __linux__
+	// file to file, the kernel copies the range
+	if (dev_sink == NULL && fflush(dev_picture_file) == 0)
+	{
+		int out = fileno(dev_picture_file);
 
-		if ((extension != NULL) && (reference != -1))
+		while (remaining > 0)
 		{
-			// Save this in the references
-			dev_picture_references.append(new PictureReference(reference, flip, dev_picture_number, extension));
+			off64_t in_offset = offset;
+			ssize_t n = copy_file_range(in, &in_offset, out, NULL, remaining, 0);
+
+			if (n > 0)
+				offset = (off_t) in_offset;
+
+			if (n < 0)
+				n = sendfile(out, in, &offset, remaining);
+			if (n <= 0)
+				break;
+			remaining -= (Guint) n;
 		}
 	}
+#endif
+
+	// otherwise read the range in chunks
+	// pread leaves the file position of the streams alone
+	char chunk[65536];
+
+	while (remaining > 0)
+	{
+		ssize_t n = pread(in, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk), offset);
+
+		if (n <= 0)
+			return remaining == length;
+		if (write_picture(chunk, (int) n))
+			return false;
+		offset += n;
+		remaining -= (Guint) n;
+	}
 
-	append_image_block(round(x1), round(y1), round(x2-x1), round(y2-y1), pic_file);
+	return false;
+#endif
+}
+
+//------------------------------------------------------------
+
+bool MbpOutputDev::end_picture ()
+{
+	if (dev_sink != NULL)
+		return dev_sink->end_picture();
+
+	bool error = fclose(dev_picture_file) != 0;
+	dev_picture_file = NULL;
+
+	return error;
 }
 
 //------------------------------------------------------------
 
-void file_write_data (png_structp png_ptr, png_bytep data, png_size_t length)
+void MbpOutputDev::png_write_data (png_structp png_ptr, png_bytep data, png_size_t length)
 {
-	FILE* file = (FILE*) png_ptr->io_ptr;
+	MbpOutputDev* dev = (MbpOutputDev*) png_ptr->io_ptr;
 
-	if (fwrite(data, 1, length,file) != length)
+	if (dev->write_picture((const char*) data, (int) length))
 		png_error(png_ptr, "Write Error");
 }
 
 //------------------------------------------------------------
 
-void file_flush_data (png_structp png_ptr)
+void MbpOutputDev::png_flush_data (png_structp png_ptr)
 {
-	FILE* file = (FILE*) png_ptr->io_ptr;
+	MbpOutputDev* dev = (MbpOutputDev*) png_ptr->io_ptr;
 
-	if (fflush(file))
+	if ((dev->dev_picture_file != NULL) && fflush(dev->dev_picture_file))
 		png_error(png_ptr, "Flush Error");
 }
 
@@ -1482,121 +3459,409 @@ void file_flush_data (png_structp png_ptr)
 bool MbpOutputDev::save_png (GString& file_name,
 							 unsigned int width, unsigned int height, unsigned int row_stride,
 							 unsigned char* data,
-							 unsigned char bpp, unsigned char color_type, png_color* palette, unsigned short color_count)
+							 unsigned char bpp, unsigned char color_type, png_color* palette, unsigned short color_count,
+							 bool* written)
 {
-	png_struct *png_ptr;
-	png_info *info_ptr;
+	const PictureOptions& options = dev_output.get_picture_options();
 
-	// Create necessary structs
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (png_ptr == NULL)
+	if (options.png_benchmark != NULL)
 	{
-		return false;
+		options.png_benchmark->run(strip_directory(file_name.getCString()),
+								   width, height, row_stride, data, bpp, color_type, palette, color_count);
 	}
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL)
+	// the file is written by the encoder threads, the name is already in the XML
+	if ((options.png_encoder != NULL) && (dev_sink == NULL))
 	{
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+		options.png_encoder->encode(new PngPicture(file_name, options.png_profile, width, height, row_stride, data,
+												   bpp, color_type, palette, color_count, written),
+									&dev_pending_pictures);
 		return false;
 	}
 
-	// Open file
-	FILE* file = fopen(file_name.getCString(), "wb");
-	if (file == NULL)
+	bool error = begin_picture(file_name);
+
+	if (!error)
 	{
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-		return false;
+		error = encode_png((png_voidp) this, (png_rw_ptr) png_write_data, (png_flush_ptr) png_flush_data,
+						   options.png_profile, width, height, row_stride, data, bpp, color_type, palette, color_count);
+		error |= end_picture();
 	}
 
-	if (setjmp(png_ptr->jmpbuf))
+	delete [] data;
+
+	if (written != NULL) *written = !error;
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+void MbpOutputDev::compose_image_filename(GString& base_name, int num, const char *const ext, GString& result)
+{
+	result.clear();
+	result.append(&base_name);
+	result.append("_pic");
+
+	for (int i = 0; i < 4; i++)
+		result.append(HEXADECIMAL_CHARACTERS[(num >> ((3 - i) << 2)) & 0x0F]);
+
+	result.append('.');
+	result.append(ext);
+}
+
+//------------------------------------------------------------
+
+bool convert_pdf_buffer (const char* data, int length, GString& picture_base_name, OutputSink& sink,
+						 const PictureOptions& options)
+{
+	XmlOutput out;
+	if (out.open(&sink)) return true;
+
+	out.set_picture_options(options);
+
+	bool error = out.load_from_memory(data, length, picture_base_name, &sink);
+
+	error |= out.close();
+
+	return error;
+}
+
+//------------------------------------------------------------
+
+// Derive the xml file name and the picture base name from the pdf file name,
+// both in the current directory
+static void compose_output_names (const char* pdf_file_name, GString& output_file, GString& images_base)
+{
+	const char* output_start = strip_directory(pdf_file_name);
+
+	output_file.clear();
+	output_file.append(output_start);
+	images_base.clear();
+	images_base.append(output_start);
+
+	int length = output_file.getLength();
+
+	if ((length >= 4) && (output_file.getChar(length - 4) == '.'))
 	{
-		png_destroy_write_struct(&png_ptr, (png_infopp) &info_ptr);
-		fclose(file);
-		return false;
+		// Change file extension to xml
+		output_file.setChar(length - 3, 'x');
+		output_file.setChar(length - 2, 'm');
+		output_file.setChar(length - 1, 'l');
+
+		// remove extension for the picture base name
+		images_base.del(length - 4, 4);
 	}
- 
-	// Writing functions
-    png_set_write_fn(png_ptr, file, (png_rw_ptr) file_write_data, (png_flush_ptr) file_flush_data);
+	else
+	{
+		output_file.append(".xml");
+	}
+}
 
-	// Image header
-	info_ptr->width				= width;
-	info_ptr->height			= height;
-	info_ptr->pixel_depth		= bpp;
-	info_ptr->channels			= (bpp>8) ? (unsigned char)3: (unsigned char)1;
-	info_ptr->bit_depth			= (unsigned char)(bpp/info_ptr->channels);
-	info_ptr->color_type		= color_type;
-	info_ptr->compression_type	= info_ptr->filter_type = 0;
-	info_ptr->valid				= 0;
-	info_ptr->rowbytes			= row_stride;
-	info_ptr->interlace_type	= PNG_INTERLACE_NONE;
+//------------------------------------------------------------
 
-	// Background
-	png_color_16 image_background={ 0, 255, 255, 255, 0 };
-	png_set_bKGD(png_ptr, info_ptr, &image_background);
+// Convert one pdf file to the names given by compose_output_names,
+// returns true on error
+static bool convert_file (const char* pdf_file_name, GString& output_file, GString& images_base,
+						  int jobs, const PictureOptions& options)
+{
+	GString input_file(pdf_file_name);
 
-	// Metrics
-	png_set_pHYs(png_ptr, info_ptr, 3780, 3780, PNG_RESOLUTION_METER); // 3780 dot per meter
+	XmlOutput out;
+	if (out.open(output_file)) return true;
 
-	// Palette
-	if (palette != NULL)
+	out.set_picture_options(options);
+
+	bool error = out.load_from_pdf(input_file, images_base, jobs);
+
+	error |= out.close();
+
+	return error;
+}
+
+//------------------------------------------------------------
+// Batch conversion
+// The documents listed in a manifest (one path per line) are converted by
+// several threads sharing the same globalParams, a status line is printed
+// for each of them as soon as it is done.
+// The outputs are all written to the current directory, so a file whose
+// name is already taken by an earlier line (a/report.pdf then b/report.pdf)
+// is not converted and reported as FAILED.
+//------------------------------------------------------------
+
+class BatchConversion
+{
+public:
+
+	BatchConversion (FILE* manifest_file, const PictureOptions& options) :
+		manifest(manifest_file),
+		picture_options(options),
+		output_names(gTrue),
+		converted(0),
+		failed(0)
+	{}
+
+	FILE*					manifest;
+	const PictureOptions&	picture_options;
+	std::mutex				lock;			// protects the manifest, the output names, the counters and stdout
+	GHash					output_names;	// xml file names already given to a line
+	int						converted;
+	int						failed;
+};
+
+//------------------------------------------------------------
+
+// Read a whole line of any length without its end of line,
+// returns false at the end of the file
+static bool read_line (FILE* file, GString& line)
+{
+	line.clear();
+
+	int c = getc(file);
+	if (c == EOF) return false;
+
+	while ((c != EOF) && (c != '\n'))
 	{
-		png_set_IHDR(png_ptr, info_ptr, info_ptr->width, info_ptr->height, info_ptr->bit_depth, 
-					 PNG_COLOR_TYPE_PALETTE, info_ptr->interlace_type, 
-					 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		info_ptr->valid |= PNG_INFO_PLTE;
-		info_ptr->palette = palette;
-		info_ptr->num_palette = color_count;
-	}  
+		if (c != '\r') line.append((char) c);
+		c = getc(file);
+	}
 
-	// Write the file header
-	png_write_info(png_ptr, info_ptr);
- 
-	// Interlace handling
-	int num_pass = png_set_interlace_handling(png_ptr);
-	for (int pass = 0; pass < num_pass; pass++){
-		for (unsigned int y = 0; y < height; y++)
+	return true;
+}
+
+//------------------------------------------------------------
+
+// Case is ignored on Windows, where the file names are not case sensitive
+static GString* output_name_key (GString& output_file)
+{
+	GString* key = new GString(&output_file);
+#ifdef _WIN32
+	key->lowerCase();
+#endif
+	return key;
+}
+
+//------------------------------------------------------------
+
+static void convert_batch_files (BatchConversion* batch)
+{
+	GString line;
+	GString output_file;
+	GString images_base;
+
+	for (;;)
+	{
+		bool name_taken;
 		{
-			png_write_row(png_ptr, &data[row_stride * y]);
+			std::lock_guard<std::mutex> guard(batch->lock);
+			if (!read_line(batch->manifest, line)) break;
+			if (line.getLength() == 0) continue;
+
+			// the names are claimed in the manifest order, the first line wins
+			compose_output_names(line.getCString(), output_file, images_base);
+			GString* key = output_name_key(output_file);
+			name_taken = (batch->output_names.lookup(key) != NULL);
+			if (name_taken)
+				delete key;
+			else
+				batch->output_names.add(key, batch);
 		}
-	}
-	
-	// Finish writing
-	png_write_end(png_ptr, info_ptr);
-
-	// Cleanup
-	png_destroy_write_struct(&png_ptr, (png_infopp) &info_ptr);
 
-	fclose(file);
+		bool error = name_taken ||
+					 convert_file(line.getCString(), output_file, images_base, 1, batch->picture_options);
 
-	return true;
+		std::lock_guard<std::mutex> guard(batch->lock);
+		if (error)
+		{
+			batch->failed++;
+			if (name_taken)
+				printf("FAILED\t%s\t%s already used\n", line.getCString(), output_file.getCString());
+			else
+				printf("FAILED\t%s\n", line.getCString());
+		}
+		else
+		{
+			batch->converted++;
+			printf("OK\t%s\t%s\n", line.getCString(), output_file.getCString());
+		}
+		fflush(stdout);
+	}
 }
 
 //------------------------------------------------------------
 
-void MbpOutputDev::compose_image_filename(GString& base_name, int num, const char *const ext, GString& result)
+// returns true on error
+static bool convert_batch (const char* manifest_name, int jobs, const PictureOptions& options)
 {
-	result.clear();
-	result.append(&base_name);
-	result.append("_pic");
+	FILE* manifest = stdin;
 
-	for (int i = 0; i < 4; i++)
-		result.append(HEXADECIMAL_CHARACTERS[(num >> ((3 - i) << 2)) & 0x0F]);
+	if ((manifest_name != NULL) && (strcmp(manifest_name, "-") != 0))
+	{
+		manifest = fopen(manifest_name, "r");
+		if (manifest == NULL) return true;
+	}
 
-	result.append('.');
-	result.append(ext);
+	BatchConversion batch(manifest, options);
+
+	std::thread** workers = new std::thread*[jobs];
+	for (int i = 0; i < jobs; i++)
+	{
+		workers[i] = new std::thread(convert_batch_files, &batch);
+	}
+	for (int i = 0; i < jobs; i++)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+	delete [] workers;
+
+	if (manifest != stdin) fclose(manifest);
+
+	fprintf(stderr, "%d converted, %d failed\n", batch.converted, batch.failed);
+
+	return batch.failed != 0;
 }
 
 //------------------------------------------------------------
 
+// names of the image policies on the command line, in PictureOptions::ImagePolicy order
+static const char* const IMAGE_POLICY_NAMES[] = { "all", "none", "metadata" };
+
 int main (int argc, char* argv[])
 {
-	if (argc != 2)
+	int jobs = 1;
+	bool batch = false;
+	PictureOptions options;
+	int png_threads = 0;
+	int png_memory = 256;
+	bool png_benchmark = false;
+	const char* picture_cache = NULL;
+	bool bad_value = false;
+	int arg = 1;
+
+	while ((arg < argc) && (argv[arg][0] == '-') && (argv[arg][1] != 0))
 	{
-		printf("Usage: pdf2xml FILE\n"
-			   "Convert the pdf FILE to an xml file.\n"
-			   "The xml file and images are created in the current directory.\n\n"
+		if (((strcmp(argv[arg], "--jobs") == 0) || (strcmp(argv[arg], "-j") == 0)) && (arg + 1 < argc))
+		{
+			jobs = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--batch") == 0)
+		{
+			batch = true;
+			arg++;
+		}
+		else if ((strcmp(argv[arg], "--images") == 0) && (arg + 1 < argc))
+		{
+			int i = find_name(argv[arg + 1], IMAGE_POLICY_NAMES, 3);
+			if (i >= 0) options.image_policy = (PictureOptions::ImagePolicy) i;
+			bad_value |= (i < 0);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--min-image") == 0) && (arg + 1 < argc))
+		{
+			char end;
+			bad_value |= (sscanf(argv[arg + 1], "%dx%d%c", &options.min_image_width,
+								 &options.min_image_height, &end) != 2);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--raw-jpeg") == 0)
+		{
+			options.raw_jpeg = true;
+			arg++;
+		}
+		else if ((strcmp(argv[arg], "--png-threads") == 0) && (arg + 1 < argc))
+		{
+			png_threads = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--png-memory") == 0) && (arg + 1 < argc))
+		{
+			png_memory = atoi(argv[arg + 1]);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--png-level") == 0) && (arg + 1 < argc))
+		{
+			options.png_profile.level = atoi(argv[arg + 1]);
+			bad_value |= (options.png_profile.level < 0) || (options.png_profile.level > 9);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--png-filter") == 0) && (arg + 1 < argc))
+		{
+			int i = find_name(argv[arg + 1], PNG_FILTER_NAMES, 5);
+			if (i >= 0) options.png_profile.filter = PNG_FILTER_VALUES[i];
+			bad_value |= (i < 0);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--png-strategy") == 0) && (arg + 1 < argc))
+		{
+			options.png_profile.strategy = find_name(argv[arg + 1], PNG_STRATEGY_NAMES, 4);
+			bad_value |= (options.png_profile.strategy < 0);
+			arg += 2;
+		}
+		else if ((strcmp(argv[arg], "--png-bilevel-strategy") == 0) && (arg + 1 < argc))
+		{
+			options.png_profile.bilevel_strategy = find_name(argv[arg + 1], PNG_STRATEGY_NAMES, 4);
+			bad_value |= (options.png_profile.bilevel_strategy < 0);
+			arg += 2;
+		}
+		else if (strcmp(argv[arg], "--png-benchmark") == 0)
+		{
+			png_benchmark = true;
+			arg++;
+		}
+		else if ((strcmp(argv[arg], "--picture-cache") == 0) && (arg + 1 < argc))
+		{
+			picture_cache = argv[arg + 1];
+			arg += 2;
+		}
+		else break;
+	}
+
+	bool usage_ok = batch ? (argc <= arg + 1) : (argc == arg + 1);
 
+	if (!usage_ok || bad_value || (jobs < 1) || (png_threads < 0) || (png_memory < 1) || (png_memory > 2047))
+	{
+		printf("Usage: pdf2xml [OPTIONS] FILE\n"
+			   "       pdf2xml --batch [OPTIONS] [MANIFEST]\n"
+			   "Convert the pdf FILE to an xml file.\n"
+			   "The xml file and images are created in the current directory.\n"
+			   "  --jobs N   render the pages on N threads,\n"
+			   "             with --batch convert N files at a time\n"
+			   "  --batch    convert the files listed in MANIFEST, one per line,\n"
+			   "             or read from the standard input, and print a status\n"
+			   "             line for each of them\n"
+			   "  --images all|none|metadata\n"
+			   "             write the pictures, leave them out, or only give their\n"
+			   "             bounds and their size in pixels\n"
+			   "  --min-image WxH\n"
+			   "             leave out the images of less than W x H pixels\n"
+			   "  --raw-jpeg copy the grayscale and CMYK JPEG pictures as they are,\n"
+			   "             their img tag gives colorspace=\"gray\" or \"cmyk\" and\n"
+			   "             invert=\"true\" when the colors shown by a JPEG viewer\n"
+			   "             must be inverted\n"
+			   "  --png-threads N\n"
+			   "             encode the PNG pictures on N threads while rendering,\n"
+			   "             0 (the default) to encode them on the rendering threads\n"
+			   "  --png-memory MB\n"
+			   "             pixels waiting for the PNG threads, 256 MB by default\n"
+			   "  --png-level N\n"
+			   "             zlib level of the PNG pictures, 0 (stored) to 9 (best),\n"
+			   "             6 by default\n"
+			   "  --png-filter none|sub|up|paeth|adaptive\n"
+			   "             PNG row filter, by default none for the black and white\n"
+			   "             pictures and adaptive for the others\n"
+			   "  --png-strategy default|filtered|huffman|rle\n"
+			   "  --png-bilevel-strategy default|filtered|huffman|rle\n"
+			   "             zlib strategy of the color and greyscale pictures, and of\n"
+			   "             the black and white ones; rle is much faster on scans\n"
+			   "  --png-benchmark\n"
+			   "             also encode each PNG picture with each level, filter and\n"
+			   "             strategy, and print the size and time of each on stderr\n"
+			   "  --picture-cache DIR\n"
+			   "             keep a copy of the PNG pictures in the existing directory\n"
+			   "             DIR, and copy from there the pictures found again in\n"
+			   "             later conversions instead of decoding them\n\n"
 			   "pdf2xml comes with ABSOLUTELY NO WARRANTY; This is free software,\n"
 			   "and you are welcome to redistribute it under certain conditions.\n"
 			   "It is licensed under the GNU General Public License (GPL)\n"
@@ -1627,45 +3892,45 @@ int main (int argc, char* argv[])
 		return 1;
 	}
 
-	char* output_start = argv[1];
+	// configuration shared by all the conversions
+	globalParams = new GlobalParams(NULL);
+	if (globalParams == NULL) return 1;
 
-	for (int index = 0; ; index++)
-	{
-		if (argv[1][index] == 0) break;
-		if (   (argv[1][index] == '\\')
-			|| (argv[1][index] == '/'))
-		{
-			output_start = &(argv[1][index + 1]);
-		}
-	}
+	// the PNG encoding threads serve all the conversions
+	if (png_threads > 0)
+		options.png_encoder = new PictureEncoder(png_threads, (size_t) png_memory << 20);
 
-	GString input_file(argv[1]);
-	GString output_file(output_start);
-	GString images_base(output_start);
+	if (png_benchmark)
+		options.png_benchmark = new PngBenchmark(options.png_profile);
 
-	int length = output_file.getLength();
+	if (picture_cache != NULL)
+		options.picture_cache = new PictureCache(picture_cache);
 
-	if ((length >= 4) && (output_file.getChar(length - 4) == '.'))
-	{
-		// Change file extension to xml
-		output_file.setChar(length - 3, 'x');
-		output_file.setChar(length - 2, 'm');
-		output_file.setChar(length - 1, 'l');
+	bool error;
 
-		// remove extension for the picture base name
-		images_base.del(length - 4, 4);
+	if (batch)
+	{
+		error = convert_batch((arg < argc) ? argv[arg] : NULL, jobs, options);
 	}
 	else
 	{
-		output_file.append(".xml");
+		GString output_file;
+		GString images_base;
+		compose_output_names(argv[arg], output_file, images_base);
+		error = convert_file(argv[arg], output_file, images_base, jobs, options);
 	}
 
-	XmlOutput out;
-	if (out.open(output_file)) return 1;
+	// waits for the last pictures
+	delete options.png_encoder;
 
-	bool error = out.load_from_pdf(input_file, images_base);
+	if (options.png_benchmark != NULL)
+	{
+		options.png_benchmark->print_totals();
+		delete options.png_benchmark;
+	}
 
-	out.close();
+	delete options.picture_cache;
+	delete globalParams;
 
 	return error ? 1 : 0;
 }
@@ -37,12 +37,16 @@
 
 // GNU pdf libs
 #include "GList.h"
+#include "GHash.h"
 #include "PDFDoc.h"
 #include "OutputDev.h"
 
 // PNG lib
 #include "png.h"
 
+// General libs
+#include <string.h>
+
 //-------------- classes --------------------
 
 // Simle class to describe rectangular bounds
@@ -70,20 +74,179 @@ class PictureReference
 {
 public:
 
-	PictureReference (int ref, int flip, int number, const char* const extension) :
+	PictureReference (int ref, int flip, int number, const char* const extension,
+					  const char* const attributes = NULL) :
 		reference_number(ref),
 		picture_flip(flip),
 		picture_number(number),
-		picture_extension(extension)
+		picture_extension(extension),
+		picture_attributes(attributes)
 	{}
 
 	int					reference_number;
 	int					picture_flip;		// 0 = none, 1 = flip X, 2 = flip Y, 3 = flip both
 	int					picture_number;
 	const char *const	picture_extension;
+	const char *const	picture_attributes;	// extra attributes of the <img> tag, or NULL
+};
+
+// Picture produced by a worker of a parallel conversion. Its final name is
+// only known once the pages are stitched back in order.
+class DeferredPicture
+{
+public:
+
+	DeferredPicture (int ref, int flip, GString& key, const char* const extension, bool written,
+					 GString& file, int position) :
+		reference_number(ref),
+		picture_flip(flip),
+		picture_key(&key),
+		picture_extension(extension),
+		picture_written(written),
+		picture_file(&file),
+		xml_position(position)
+	{}
+
+	int					reference_number;
+	int					picture_flip;		// 0 = none, 1 = flip X, 2 = flip Y, 3 = flip both
+	GString				picture_key;		// content key, empty if unknown
+	const char *const	picture_extension;
+	bool				picture_written;	// false if the worker reused one of its previous pictures
+	GString				picture_file;		// temporary file written by the worker
+	int					xml_position;		// position of the src attribute in the page fragment
+};
+
+// Pictures already written, found by object number and flip, or by content
+// key: a hash of the encoded bytes and of everything changing their decoding,
+// so that copies of a picture stored in different objects are written once
+class PictureIndex
+{
+public:
+
+	PictureIndex ();
+
+	// Destructor, deletes the references
+	~PictureIndex ();
+
+	// the picture of object <ref> shown with <flip>, or else the picture
+	// with content <key>, NULL if none
+	// -1 and an empty key are not looked up
+	PictureReference* find (int ref, int flip, GString& key);
+
+	// register a new picture, written in file <number>
+	PictureReference* add (int ref, int flip, GString& key, int number, const char* const extension,
+						   const char* const attributes = NULL);
+
+	// also find <picture> from <ref>, <flip> and <key>
+	void alias (PictureReference* picture, int ref, int flip, GString& key);
+
+private:
+
+	GList	index_pictures;		// PictureReference*
+	GHash	index_objects;		// "ref flip" -> PictureReference*
+	GHash	index_contents;		// key -> PictureReference*
+};
+
+// Pool of threads encoding the PNG pictures, see pdf2xml.cpp
+class PictureEncoder;
+
+// Statistics of --png-benchmark, see pdf2xml.cpp
+class PngBenchmark;
+
+// Directory of pictures shared by conversions, see pdf2xml.cpp
+class PictureCache;
+
+// Compression settings of the PNG pictures, -1 leaves the choice to libpng
+// (zlib level 6, no filter and the default strategy for palette pictures,
+// adaptive filtering and the filtered strategy otherwise)
+class PngProfile
+{
+public:
+
+	PngProfile () :
+		level(-1),
+		filter(-1),
+		strategy(-1),
+		bilevel_strategy(-1)
+	{}
+
+	int		level;				// zlib level, 0 (stored) to 9
+	int		filter;				// PNG_FILTER_NONE, _SUB, _UP, _PAETH or PNG_ALL_FILTERS
+	int		strategy;			// zlib strategy of the color and greyscale pictures
+	int		bilevel_strategy;	// zlib strategy of the black and white pictures
+};
+
+// How the pictures are written, set on the XmlOutput before loading a document
+class PictureOptions
+{
+public:
+
+	// which images are written
+	enum ImagePolicy
+	{
+		IMAGES_ALL,			// the pictures are written
+		IMAGES_NONE,		// the images are left out, their data is not read
+		IMAGES_METADATA		// only an <img> tag with the bounds and the size in pixels
+	};
+
+	PictureOptions () :
+		image_policy(IMAGES_ALL),
+		min_image_width(0),
+		min_image_height(0),
+		raw_jpeg(false),
+		png_encoder(NULL),
+		png_benchmark(NULL),
+		picture_cache(NULL)
+	{}
+
+	ImagePolicy	image_policy;
+
+	// images narrower or lower than this, in pixels, are left out without
+	// reading their data
+	int		min_image_width;
+	int		min_image_height;
+
+	// copy the grayscale and CMYK JPEGs as they are instead of converting
+	// them to RGB PNGs, their <img> tag then gives the color space and
+	// whether the colors must be inverted
+	bool	raw_jpeg;
+
+	// encodes and writes the PNG files in the background, NULL to encode
+	// them on the rendering thread. Pictures sent to a sink are always
+	// encoded on the rendering thread.
+	PictureEncoder*	png_encoder;
+
+	PngProfile		png_profile;
+
+	// when set, each PNG picture is also encoded with a range of profiles
+	// and the size and time of each is reported
+	PngBenchmark*	png_benchmark;
+
+	// pictures written by earlier conversions, found by content key, NULL
+	// if none; not used with a sink
+	PictureCache*	picture_cache;
+};
+
+// Destination of a conversion done without files
+// The XML arrives in order, in chunks. Each picture is sent between
+// begin_picture and end_picture, <name> is the one used in the src
+// attribute of its <img> tag. Methods return true on error.
+class OutputSink
+{
+public:
+
+	virtual ~OutputSink () {}
+
+	virtual bool write_xml (const char* data, int length) = 0;
+
+	virtual bool begin_picture (const char* name) = 0;
+	virtual bool write_picture (const char* data, int length) = 0;
+	virtual bool end_picture () = 0;
 };
 
-// Output XML in a file
+// Output XML in a file, in memory or to a sink
+// The output is accumulated in a buffer, which is written to the file when
+// it is full or when the output is closed
 class XmlOutput
 {
 public:
@@ -91,15 +254,76 @@ public:
 	// Constructor
 	XmlOutput ();
 
+	// Destructor
+	~XmlOutput ();
+
 	// returns true on error
 	bool open (GString& filename);
-	bool write (const char* content);
-	bool write (int number);
+	bool open (OutputSink* sink);
 	bool close ();
 
+	// keep the output in memory instead of a file
+	// used for the page fragments of a parallel conversion
+	bool open_memory ();
+
+	// in-memory output, valid after open_memory
+	const char* get_data () const { return buffer; }
+	int get_length () const { return buffer_length; }
+	void clear_memory () { buffer_length = 0; }
+
+	// append <length> bytes of <content>
+	// returns true on error
+	inline bool write (const char* content, int length)
+	{
+		if (buffer_length + length <= buffer_capacity)
+		{
+			memcpy(buffer + buffer_length, content, length);
+			buffer_length += length;
+			return false;
+		}
+
+		return write_overflow(content, length);
+	}
+
+	// append a string literal, its length is known at compile time
+	template <int N> inline bool write (const char (&literal)[N])
+	{
+		return write(literal, N - 1);
+	}
+
+	// append a null terminated string
+	inline bool write_string (const char* content)
+	{
+		return write(content, (int) strlen(content));
+	}
+
+	// append a number in decimal
+	bool write (int number);
+
+	// append a null terminated string, XML encoding < > and &
+	bool write_escaped (const char* content);
+
+	// write the buffered output to the file
+	// returns true on error
+	bool flush ();
+
+	// position in memory of the src attribute of the last image block
+	int get_image_position () const { return image_position; }
+
+	// options for the pictures of the documents loaded next
+	void set_picture_options (const PictureOptions& options) { picture_options = options; }
+	const PictureOptions& get_picture_options () const { return picture_options; }
+
 	// glue function for loading a PDF
+	// <jobs> is the number of threads rendering pages
+	// globalParams must be initialized
+	// returns true on error
+	bool load_from_pdf (GString& pdf_file_name, GString& picture_base_name, int jobs = 1);
+
+	// same from the <length> bytes of a PDF in <data>, the pictures are
+	// sent to <sink> (files are written if NULL)
 	// returns true on error
-	bool load_from_pdf (GString& pdf_file_name, GString& picture_base_name);
+	bool load_from_memory (const char* data, int length, GString& picture_base_name, OutputSink* sink);
 
 	// Add a meta tag <tag> if <value> is not NULL
 	// This looks for a Byte Order Mark at the begining of <value> to convert the
@@ -111,6 +335,10 @@ public:
 	// return true on error
 	bool start_page (int width, int height);
 
+	// close the font and page tags still opened
+	// return true on error
+	bool end_page ();
+
 	// 
 	bool change_font (GString* face, int size, int color, bool bold, bool italic);
 
@@ -120,26 +348,53 @@ public:
 	// add an external link
 	bool add_link (const Rect& rect, GString& dest_url);
 
-	// Add a block of text. The block is attached to the current page.
+	// Add a block of text, < > and & are XML encoded here.
+	// The block is attached to the current page.
 	// An error occurs if there is no current page.
 	// return true on error
 	bool add_text_block (GString& str, const Rect& rect);
 
-	// Add a picture
+	// Add a picture, <attributes> are written after the src attribute
 	// An error occurs if there is no current page.
 	// return true on error
-	bool add_image_block(GString& filename, const Rect& rect);
+	bool add_image_block(GString& filename, const Rect& rect, const char* attributes = NULL);
+
+	// Add the bounds of a picture that is not written, with <attributes>
+	// return true on error
+	bool add_image_bounds(const Rect& rect, const char* attributes);
 
 private:
 
-	// the underlying file
+	// convert an opened document
+	// <pdf_file_name> is used to reopen the document for parallel rendering
+	// returns true on error
+	bool load_from_doc (PDFDoc* doc, GString* pdf_file_name, GString& picture_base_name,
+						OutputSink* sink, int jobs);
+
+	// render the pages on <jobs> threads and write them back in page order
+	// return true on error
+	bool display_pages_parallel (GString& pdf_file_name, GString& picture_base_name, int nb_pages, int jobs);
+
+	// append when the buffer is full
+	bool write_overflow (const char* content, int length);
+
+	// the underlying file or sink, both NULL for an in-memory output
 	FILE* xml_file;
+	OutputSink* xml_sink;
+
+	// the buffered output
+	char* buffer;
+	int buffer_length;
+	int buffer_capacity;
+	int image_position;
 
 	// A page tag has been opened yet
 	bool page_opened;
 
 	// A font tag has been opened yet
 	bool font_opened;
+
+	PictureOptions picture_options;
 };
 
 // subclass the output device class
@@ -147,11 +402,22 @@ class MbpOutputDev: public OutputDev
 {
 public:
 	// constructor
-	MbpOutputDev(XmlOutput& target, GString& picture_base_name);
+	// the pictures go to <sink>, or to files if it is NULL
+	MbpOutputDev(XmlOutput& target, GString& picture_base_name, OutputSink* sink = NULL);
 
 	// destructor
 	~MbpOutputDev();
 
+	// collect the pictures in <pictures> instead of naming them,
+	// used by the workers of a parallel conversion
+	void defer_pictures (GList* pictures) { dev_deferred_pictures = pictures; }
+
+	// wait until the PNG files queued on the encoder are written
+	void finish_pictures ();
+
+	// build the name for a file from a base namen a number and an extension
+	static void compose_image_filename (GString& base_name, int num, const char *const ext, GString& result);
+
 	//---- get info about output device
 	
 	// Does this device use upside-down coordinates?
@@ -166,7 +432,15 @@ public:
 	virtual GBool interpretType3Chars() { return gFalse; }
 	
 	// Does this device need non-text content?
-	virtual GBool needNonText() { return gTrue; }
+	// not when the images are left out
+	virtual GBool needNonText();
+
+	// Does this device need the image of <width> x <height> pixels?
+	virtual GBool needImage(int width, int height);
+
+	// Only text, images and links are written, Gfx can skip the paths,
+	// shadings and patterns
+	virtual GBool needVectorGraphics() { return gFalse; }
 
 	//----- image drawing
 	virtual void drawImageMask(GfxState *state, Object *ref, Stream *str,
@@ -223,29 +497,55 @@ private:
 	void append_coalesc_block (GString& str, const Rect& rect, bool prepend_space);
 
 	// output a picture block into the block stream
-	void append_image_block (int x, int y, int width, int height, GString& pic_filename);
+	void append_image_block (int x, int y, int width, int height, GString& pic_filename,
+							 const char* attributes = NULL);
 
 	// dimensions of a string
 	// also converts the string and stores it into "output_text"
-	// returned text will be encoded in UTF8
+	// returned text will be encoded in UTF8, not XML encoded
 	// Returns a reference to the output string
 	GString& handle_string (GfxState *state, GString *s, double& width, double& height);
 
-	// build the name for a file from a base namen a number and an extension
-	static void compose_image_filename (GString& base_name, int num, const char *const ext, GString& result);
-
 	// utility function used by drawImage and drawImageMask
 	void drawImageOrMask (GfxState *state, Object *ref, Stream *str,
 						  int width, int height,
 						  GfxImageColorMap *colorMap,
 						  int *maskColors, GBool inlineImg, bool mask);
 
-	// utility function to save raw data to a png file using the ong lib
+	// picture output, to a file or to the sink
+	// return true on error
+	bool begin_picture (GString& file_name);
+	bool write_picture (const char* data, int length);
+	bool end_picture ();
+
+	// copy <length> bytes at <start> in <file> to the picture
+	// returns true if nothing could be copied, the caller then reads the stream
+	bool copy_picture (FILE* file, Guint start, Guint length);
+
+	// whether the pictures are looked up and stored in the cache directory,
+	// their keys are then SHA-256 digests
+	bool uses_picture_cache ();
+
+	// copy the picture with content <key> from the cache to <file_name>
+	// returns false if the cache has none or it could not be copied
+	bool copy_cached_picture (GString& key, GString& file_name);
+
+	// libpng output functions, sending the data to write_picture
+	static void png_write_data (png_structp png_ptr, png_bytep data, png_size_t length);
+	static void png_flush_data (png_structp png_ptr);
+
+	// save raw data to a png file using the png lib, on the encoder threads
+	// if there are some
+	// <data> is allocated with new[] and freed here
+	// <*written> is set if the file is complete, on the encoder thread after
+	// this returns if there is one: read it after finish_pictures
+	// returns true on error
 	bool save_png (GString& file_name,
 				   unsigned int width, unsigned int height, unsigned int row_stride,
 				   unsigned char* data,
 				   unsigned char bpp = 24, unsigned char color_type = PNG_COLOR_TYPE_RGB,
-				   png_color* palette = NULL, unsigned short color_count = 0);
+				   png_color* palette = NULL, unsigned short color_count = 0,
+				   bool* written = NULL);
 
 	// XML output stream
 	XmlOutput&	dev_output;
@@ -270,13 +570,28 @@ private:
 	bool		dev_coalesc_valid;
 
 	// pictures
-	GList		dev_picture_references;
+	OutputSink*	dev_sink;
+	FILE*		dev_picture_file;
+	PictureIndex	dev_picture_index;
 	GString&	dev_picture_base;
 	int			dev_picture_number;
+	GList*		dev_deferred_pictures;
+	int			dev_pending_pictures;	// queued on the encoder, guarded by its lock
+	GList		dev_cached_pictures;	// CachedPicture*, stored by finish_pictures
 
 	// conversion buffers, used internally by "handle_string"
 	GString		dev_conversion_buffer;
 
 };
 
+//-------------- functions --------------------
+
+// Convert the PDF held in memory (<length> bytes at <data>) without any file
+// access: the XML and the pictures are sent to <sink>, the pictures are named
+// from <picture_base_name> and written as set by <options>. globalParams
+// must be initialized.
+// returns true on error
+bool convert_pdf_buffer (const char* data, int length, GString& picture_base_name, OutputSink& sink,
+						 const PictureOptions& options = PictureOptions());
+
 #endif // _PDF2XML_H
@@ -0,0 +1,476 @@
+//**************************************************************
+//*  File: flate_test.cpp
+//*  Description: compares the output of the xpdf FlateStream with
+//*               the inflate of the bundled zlib
+//*  Platform: cross
+//**************************************************************
+
+// flate_test [FILE...]
+//
+// Every stream is decoded with zlib's inflate and with FlateStream read
+// through getChar(), through getBlock() in 777-byte and 3-byte reads, and
+// through an EmbedStream as for inline images (one byte of input at a
+// time). The outputs must be identical.
+//
+// The streams come from
+//  - built-in deflate streams: matches reaching back across the window
+//    wrap, up to the maximal distance and length, and fixed-code blocks,
+//  - the FlateDecode streams of the FILEs which are PDF documents,
+//  - the other FILEs compressed with zlib at levels 0 to 9, with each
+//    strategy and with 9, 12 and 15 bit windows, and their first bytes
+//    alone, which get fixed-code blocks.
+//
+// Prints the number of comparisons, returns 1 if any differ.
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "GString.h"
+#include "GlobalParams.h"
+#include "Object.h"
+#include "Stream.h"
+#include "XRef.h"
+#include "PDFDoc.h"
+
+#include "zlib.h"
+
+//------------------------------------------------------------
+
+class Buffer
+{
+public:
+
+	Buffer () :
+		data(NULL),
+		length(0),
+		size(0)
+	{}
+
+	~Buffer () { free(data); }
+
+	void clear () { length = 0; }
+
+	void append (const void* bytes, int n)
+	{
+		if (length + n > size)
+		{
+			size = (length + n) * 2 + 256;
+			data = (unsigned char*) realloc(data, size);
+		}
+		memcpy(data + length, bytes, n);
+		length += n;
+	}
+
+	void append (unsigned char byte) { append(&byte, 1); }
+
+	unsigned char*	data;
+	int				length;
+	int				size;
+};
+
+static int comparisons = 0;
+static int differences = 0;
+
+//------------------------------------------------------------
+
+// inflate <input> with zlib, returns false if it is not a valid zlib stream
+static bool zlib_inflate (Buffer& input, Buffer& output)
+{
+	unsigned char chunk[16384];
+	z_stream z;
+	int status;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) return false;
+
+	output.clear();
+	z.next_in = input.data;
+	z.avail_in = input.length;
+	do
+	{
+		z.next_out = chunk;
+		z.avail_out = sizeof(chunk);
+		status = inflate(&z, Z_NO_FLUSH);
+		output.append(chunk, (int) (sizeof(chunk) - z.avail_out));
+	}
+	while (status == Z_OK);
+
+	inflateEnd(&z);
+
+	return status == Z_STREAM_END;
+}
+
+//------------------------------------------------------------
+
+// decode <input> with FlateStream, reading <block> bytes at a time,
+// or with getChar() when <block> is 0, from an EmbedStream if <embedded>
+static void flate_inflate (Buffer& input, int block, bool embedded, Buffer& output)
+{
+	Object dict;
+	dict.initNull();
+
+	BaseStream* base = new MemStream((char*) input.data, 0, input.length, &dict);
+	Stream* source = base;
+	if (embedded)
+		source = new EmbedStream(base, &dict, gTrue, input.length);
+
+	FlateStream* flate = new FlateStream(source, 1, 0, 0, 0);
+	char chunk[777];
+	int c, n;
+
+	output.clear();
+	flate->reset();
+	if (block == 0)
+	{
+		while ((c = flate->getChar()) != EOF)
+			output.append((unsigned char) c);
+	}
+	else
+	{
+		while ((n = flate->getBlock(chunk, block)) > 0)
+			output.append(chunk, n);
+	}
+	flate->close();
+
+	// the filter deletes its source, an EmbedStream leaves its own
+	delete flate;
+	if (source != base) delete base;
+}
+
+//------------------------------------------------------------
+
+static void compare (Buffer& input, const char* name)
+{
+	static const int BLOCKS[] = { 0, 777, 3 };
+	Buffer expected, decoded;
+
+	if (!zlib_inflate(input, expected)) return;
+
+	for (int embedded = 0; embedded < 2; embedded++)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			// the embedded stream is read byte by byte anyway
+			if (embedded && (i > 0)) break;
+
+			flate_inflate(input, BLOCKS[i], embedded != 0, decoded);
+
+			comparisons++;
+			if ((decoded.length != expected.length) ||
+				(memcmp(decoded.data, expected.data, expected.length) != 0))
+			{
+				differences++;
+				printf("DIFFERENT\t%s\tblock %d%s\t%d bytes instead of %d\n", name, BLOCKS[i],
+					   embedded ? " embedded" : "", decoded.length, expected.length);
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------
+// Built-in streams
+// Written with the fixed codes, so that the distances and lengths are
+// chosen here and not by zlib's deflate, which never reaches back further
+// than 32506 bytes.
+//------------------------------------------------------------
+
+class FixedDeflate
+{
+public:
+
+	FixedDeflate (Buffer& target) :
+		output(target),
+		bits(0),
+		count(0)
+	{
+		// zlib header: 32K window, no dictionary
+		output.append((unsigned char) 0x78);
+		output.append((unsigned char) 0x01);
+		put(1, 1);		// last block
+		put(1, 2);		// fixed codes
+	}
+
+	void literal (int c)
+	{
+		if (c < 144)
+			code(0x30 + c, 8);
+		else
+			code(0x190 + c - 144, 9);
+	}
+
+	// <length> 3 to 258, <distance> 1 to 32768
+	void match (int length, int distance)
+	{
+		static const int LENGTH_BASE[29] =
+		{
+			3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+		};
+		static const int LENGTH_EXTRA[29] =
+		{
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+		};
+		static const int DISTANCE_BASE[30] =
+		{
+			1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+		};
+
+		int l = 28;
+		while (LENGTH_BASE[l] > length) l--;
+		int symbol = 257 + l;
+		if (symbol < 280)
+			code(symbol - 256, 7);
+		else
+			code(0xC0 + symbol - 280, 8);
+		put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+
+		int d = 29;
+		while (DISTANCE_BASE[d] > distance) d--;
+		code(d, 5);
+		put(distance - DISTANCE_BASE[d], (d < 2) ? 0 : (d >> 1) - 1);
+	}
+
+	void finish (const Buffer& data)
+	{
+		code(0, 7);		// end of block
+		if (count > 0) output.append((unsigned char) bits);
+
+		unsigned long adler = adler32(0L, Z_NULL, 0);
+		adler = adler32(adler, data.data, data.length);
+		for (int i = 3; i >= 0; i--)
+			output.append((unsigned char) (adler >> (i * 8)));
+	}
+
+private:
+
+	// <n> bits of <value>, least significant first
+	void put (int value, int n)
+	{
+		for (int i = 0; i < n; i++)
+			bit((value >> i) & 1);
+	}
+
+	// Huffman codes are sent most significant bit first
+	void code (int value, int n)
+	{
+		for (int i = n - 1; i >= 0; i--)
+			bit((value >> i) & 1);
+	}
+
+	void bit (int b)
+	{
+		bits |= b << count;
+		if (++count == 8)
+		{
+			output.append((unsigned char) bits);
+			bits = 0;
+			count = 0;
+		}
+	}
+
+	Buffer&	output;
+	int		bits;
+	int		count;
+};
+
+//------------------------------------------------------------
+
+// <literals> pseudo-random bytes, then matches of each length in
+// <lengths> at each distance in <distances>
+static void far_matches (int literals, const int* lengths, int nb_lengths,
+						 const int* distances, int nb_distances, const char* name)
+{
+	Buffer data, stream;
+	FixedDeflate deflate(stream);
+	unsigned int seed = 12345;
+
+	for (int i = 0; i < literals; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int c = (seed >> 16) & 0xFF;
+		deflate.literal(c);
+		data.append((unsigned char) c);
+	}
+
+	for (int round = 0; round < 3; round++)
+	{
+		for (int l = 0; l < nb_lengths; l++)
+		{
+			for (int d = 0; d < nb_distances; d++)
+			{
+				if (distances[d] > data.length) continue;
+
+				deflate.match(lengths[l], distances[d]);
+				for (int i = 0; i < lengths[l]; i++)
+					data.append(data.data[data.length - distances[d]]);
+			}
+		}
+	}
+
+	deflate.finish(data);
+	compare(stream, name);
+}
+
+static void builtin_streams ()
+{
+	static const int LENGTHS[] = { 3, 10, 57, 255, 258 };
+	static const int DISTANCES[] = { 1, 2, 100, 257, 258, 300, 32000, 32510, 32511, 32700, 32767, 32768 };
+
+	// the window wraps while the matches are copied, at several offsets
+	for (int literals = 32768 - 300; literals <= 32768 + 300; literals += 37)
+		far_matches(literals, LENGTHS, 5, DISTANCES, 12, "far matches");
+
+	far_matches(70000, LENGTHS, 5, DISTANCES, 12, "far matches after 70000 bytes");
+	far_matches(10, LENGTHS, 5, DISTANCES, 12, "short matches");
+}
+
+//------------------------------------------------------------
+
+// compress <data> with zlib, returns false on error
+static bool zlib_deflate (const unsigned char* data, int length, int level, int strategy, int window,
+						  Buffer& output)
+{
+	unsigned char chunk[16384];
+	z_stream z;
+	int status;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED, window, 8, strategy) != Z_OK) return false;
+
+	output.clear();
+	z.next_in = (Bytef*) data;
+	z.avail_in = length;
+	do
+	{
+		z.next_out = chunk;
+		z.avail_out = sizeof(chunk);
+		status = deflate(&z, Z_FINISH);
+		output.append(chunk, (int) (sizeof(chunk) - z.avail_out));
+	}
+	while (status == Z_OK);
+
+	deflateEnd(&z);
+
+	return status == Z_STREAM_END;
+}
+
+static void compressed_file (const char* file_name)
+{
+	static const int STRATEGIES[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE };
+	static const int WINDOWS[] = { 9, 12, 15 };
+
+	Buffer data, stream;
+	char chunk[65536];
+	size_t n;
+
+	FILE* file = fopen(file_name, "rb");
+	if (file == NULL)
+	{
+		printf("CANNOT OPEN\t%s\n", file_name);
+		differences++;
+		return;
+	}
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		data.append(chunk, (int) n);
+	fclose(file);
+
+	for (int level = 0; level <= 9; level++)
+		for (int s = 0; s < 4; s++)
+			for (int w = 0; w < 3; w++)
+				if (zlib_deflate(data.data, data.length, level, STRATEGIES[s], WINDOWS[w], stream))
+					compare(stream, file_name);
+
+	// short slices get fixed-code blocks
+	for (int length = 1; (length <= 200) && (length <= data.length); length += 13)
+		if (zlib_deflate(data.data, length, 6, Z_DEFAULT_STRATEGY, 15, stream))
+			compare(stream, file_name);
+}
+
+//------------------------------------------------------------
+
+// the FlateDecode streams of a pdf document
+static void pdf_streams (const char* file_name)
+{
+	PDFDoc doc(new GString(file_name));
+
+	if (!doc.isOk() || doc.getXRef()->isEncrypted())
+	{
+		printf("SKIPPED\t%s\n", file_name);
+		return;
+	}
+
+	XRef* xref = doc.getXRef();
+	Buffer stream;
+	char chunk[65536];
+	int n;
+
+	for (int num = 0; num < xref->getNumObjects(); num++)
+	{
+		XRefEntry* entry = xref->getEntry(num);
+		if (entry->type != xrefEntryUncompressed) continue;
+
+		Object obj, filter;
+		if (xref->fetch(num, entry->gen, &obj)->isStream())
+		{
+			obj.streamGetDict()->lookup("Filter", &filter);
+			if (filter.isArray() && (filter.arrayGetLength() == 1))
+			{
+				Object first;
+				filter.arrayGet(0, &first);
+				filter.free();
+				first.copy(&filter);
+				first.free();
+			}
+
+			if (filter.isName("FlateDecode") || filter.isName("Fl"))
+			{
+				BaseStream* base = obj.getStream()->getBaseStream();
+
+				stream.clear();
+				base->reset();
+				while ((n = base->getBlock(chunk, (int) sizeof(chunk))) > 0)
+					stream.append(chunk, n);
+				base->close();
+
+				compare(stream, file_name);
+			}
+			filter.free();
+		}
+		obj.free();
+	}
+}
+
+//------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+	globalParams = new GlobalParams(NULL);
+	globalParams->setErrQuiet(gTrue);
+
+	builtin_streams();
+
+	for (int arg = 1; arg < argc; arg++)
+	{
+		char header[5] = { 0 };
+		FILE* file = fopen(argv[arg], "rb");
+		if (file != NULL)
+		{
+			fread(header, 1, 4, file);
+			fclose(file);
+		}
+
+		if (strcmp(header, "%PDF") == 0)
+			pdf_streams(argv[arg]);
+		else
+			compressed_file(argv[arg]);
+	}
+
+	delete globalParams;
+
+	printf("%d comparisons, %d differences\n", comparisons, differences);
+
+	return (differences != 0) ? 1 : 0;
+}
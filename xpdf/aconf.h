@@ -25,7 +25,7 @@
 /*
  * Enable multithreading support.
  */
-#undef MULTITHREADED // 1
+#define MULTITHREADED 1
 
 /*
  * Directory with the Xpdf app-defaults file.
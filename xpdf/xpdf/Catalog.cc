@@ -13,7 +13,10 @@
 #endif
 
 #include <stddef.h>
+#include <stdio.h>
 #include "gmem.h"
+#include "GString.h"
+#include "GHash.h"
 #include "Object.h"
 #include "XRef.h"
 #include "Array.h"
@@ -21,6 +24,7 @@
 #include "Page.h"
 #include "Error.h"
 #include "Link.h"
+#include "Gfx.h"
 #include "Catalog.h"
 
 //------------------------------------------------------------------------
@@ -38,6 +42,10 @@ Catalog::Catalog(XRef *xrefA) {
   pages = NULL;
   pageRefs = NULL;
   numPages = pagesSize = 0;
+  pageIndex = NULL;
+  pageIndexSize = 0;
+  destIndex = NULL;
+  formCache = NULL;
   baseURI = NULL;
 
   xref->getCatalog(&catDict);
@@ -76,6 +84,7 @@ Catalog::Catalog(XRef *xrefA) {
     error(-1, "Page count in top-level pages object is incorrect");
   }
   pagesDict.free();
+  buildPageIndex();
 
   // read named destination dictionary
   catDict.dictLookup("Dests", &dests);
@@ -134,6 +143,13 @@ Catalog::~Catalog() {
     gfree(pages);
     gfree(pageRefs);
   }
+  gfree(pageIndex);
+  if (destIndex) {
+    deleteGHash(destIndex, LinkDest);
+  }
+  if (formCache) {
+    delete formCache;
+  }
   dests.free();
   nameTree.free();
   if (baseURI) {
@@ -145,6 +161,13 @@ Catalog::~Catalog() {
   acroForm.free();
 }
 
+GfxFormCache *Catalog::getFormCache() {
+  if (!formCache) {
+    formCache = new GfxFormCache();
+  }
+  return formCache;
+}
+
 GString *Catalog::readMetadata() {
   GString *s;
   Dict *dict;
@@ -238,116 +261,169 @@ int Catalog::readPageTree(Dict *pagesDict, PageAttrs *attrs, int start) {
   return -1;
 }
 
-int Catalog::findPage(int num, int gen) {
-  int i;
+static inline int hashRef(int num, int gen) {
+  return (int)(((Guint)num * 31 + (Guint)gen) & 0x7fffffff);
+}
+
+// Index the page references, so findPage doesn't have to scan them.
+void Catalog::buildPageIndex() {
+  int h, i;
 
+  if (numPages <= 0) {
+    return;
+  }
+  pageIndexSize = 16;
+  while (pageIndexSize < 2 * numPages) {
+    pageIndexSize *= 2;
+  }
+  pageIndex = (int *)gmallocn(pageIndexSize, sizeof(int));
+  for (h = 0; h < pageIndexSize; ++h) {
+    pageIndex[h] = -1;
+  }
   for (i = 0; i < numPages; ++i) {
+    if (pageRefs[i].num < 0) {
+      continue;
+    }
+    h = hashRef(pageRefs[i].num, pageRefs[i].gen) & (pageIndexSize - 1);
+    while (pageIndex[h] >= 0 &&
+	   !(pageRefs[pageIndex[h]].num == pageRefs[i].num &&
+	     pageRefs[pageIndex[h]].gen == pageRefs[i].gen)) {
+      h = (h + 1) & (pageIndexSize - 1);
+    }
+    // if a page object is used twice, keep its first page number
+    if (pageIndex[h] < 0) {
+      pageIndex[h] = i;
+    }
+  }
+}
+
+int Catalog::findPage(int num, int gen) {
+  int h, i;
+
+  if (!pageIndex) {
+    return 0;
+  }
+  h = hashRef(num, gen) & (pageIndexSize - 1);
+  while ((i = pageIndex[h]) >= 0) {
     if (pageRefs[i].num == num && pageRefs[i].gen == gen)
       return i + 1;
+    h = (h + 1) & (pageIndexSize - 1);
   }
   return 0;
 }
 
 LinkDest *Catalog::findDest(GString *name) {
   LinkDest *dest;
-  Object obj1, obj2;
-  GBool found;
 
-  // try named destination dictionary then name tree
-  found = gFalse;
-  if (dests.isDict()) {
-    if (!dests.dictLookup(name->getCString(), &obj1)->isNull())
-      found = gTrue;
-    else
-      obj1.free();
-  }
-  if (!found && nameTree.isDict()) {
-    if (!findDestInTree(&nameTree, name, &obj1)->isNull())
-      found = gTrue;
-    else
-      obj1.free();
+  return (dest = lookupDest(name)) ? dest->copy() : (LinkDest *)NULL;
+}
+
+LinkDest *Catalog::lookupDest(GString *name) {
+  if (!destIndex) {
+    buildDestIndex();
   }
-  if (!found)
-    return NULL;
+  return (LinkDest *)destIndex->lookup(name);
+}
 
-  // construct LinkDest
-  dest = NULL;
-  if (obj1.isArray()) {
-    dest = new LinkDest(obj1.getArray());
-  } else if (obj1.isDict()) {
-    if (obj1.dictLookup("D", &obj2)->isArray())
-      dest = new LinkDest(obj2.getArray());
-    else
-      error(-1, "Bad named destination value");
-    obj2.free();
-  } else {
-    error(-1, "Bad named destination value");
+// Resolve all named destinations, from the named destination
+// dictionary first and then from the name tree, into <destIndex>.
+void Catalog::buildDestIndex() {
+  Object obj1;
+  GHash *visited;
+  int i;
+
+  destIndex = new GHash(gTrue);
+  if (dests.isDict()) {
+    for (i = 0; i < dests.dictGetLength(); ++i) {
+      addDest(new GString(dests.dictGetKey(i)), dests.dictGetVal(i, &obj1));
+      obj1.free();
+    }
   }
-  obj1.free();
-  if (dest && !dest->isOk()) {
-    delete dest;
-    dest = NULL;
+  if (nameTree.isDict()) {
+    visited = new GHash(gTrue);
+    addDestsFromTree(&nameTree, visited, 0);
+    delete visited;
   }
-
-  return dest;
 }
 
-Object *Catalog::findDestInTree(Object *tree, GString *name, Object *obj) {
-  Object names, name1;
-  Object kids, kid, limits, low, high;
-  GBool done, found;
-  int cmp, i;
+// Add the destinations of the name tree node <tree> and of its kids.
+// <visited> holds the refs of the nodes already added ("num gen"):
+// a node listed twice, or a loop in a broken tree, is only walked
+// once.
+void Catalog::addDestsFromTree(Object *tree, GHash *visited, int depth) {
+  Object names, name1, obj1, kids, kid, kidRef;
+  char buf[32];
+  GString *key;
+  int i;
+
+  if (depth > catalogMaxNameTreeDepth) {
+    return;
+  }
 
   // leaf node
   if (tree->dictLookup("Names", &names)->isArray()) {
-    done = found = gFalse;
-    for (i = 0; !done && i < names.arrayGetLength(); i += 2) {
+    for (i = 0; i + 1 < names.arrayGetLength(); i += 2) {
       if (names.arrayGet(i, &name1)->isString()) {
-	cmp = name->cmp(name1.getString());
-	if (cmp == 0) {
-	  names.arrayGet(i+1, obj);
-	  found = gTrue;
-	  done = gTrue;
-	} else if (cmp < 0) {
-	  done = gTrue;
-	}
+	addDest(name1.getString()->copy(), names.arrayGet(i+1, &obj1));
+	obj1.free();
       }
       name1.free();
     }
-    names.free();
-    if (!found)
-      obj->initNull();
-    return obj;
   }
   names.free();
 
   // root or intermediate node
-  done = gFalse;
   if (tree->dictLookup("Kids", &kids)->isArray()) {
-    for (i = 0; !done && i < kids.arrayGetLength(); ++i) {
-      if (kids.arrayGet(i, &kid)->isDict()) {
-	if (kid.dictLookup("Limits", &limits)->isArray()) {
-	  if (limits.arrayGet(0, &low)->isString() &&
-	      name->cmp(low.getString()) >= 0) {
-	    if (limits.arrayGet(1, &high)->isString() &&
-		name->cmp(high.getString()) <= 0) {
-	      findDestInTree(&kid, name, obj);
-	      done = gTrue;
-	    }
-	    high.free();
-	  }
-	  low.free();
+    for (i = 0; i < kids.arrayGetLength(); ++i) {
+      if (kids.arrayGetNF(i, &kidRef)->isRef()) {
+	sprintf(buf, "%d %d", kidRef.getRefNum(), kidRef.getRefGen());
+	key = new GString(buf);
+	if (visited->lookup(key)) {
+	  delete key;
+	  kidRef.free();
+	  continue;
 	}
-	limits.free();
+	visited->add(key, 1);
+      }
+      kidRef.free();
+      if (kids.arrayGet(i, &kid)->isDict()) {
+	addDestsFromTree(&kid, visited, depth + 1);
       }
       kid.free();
     }
   }
   kids.free();
+}
 
-  // name was outside of ranges of all kids
-  if (!done)
-    obj->initNull();
+// Add a destination to the index, unless <name> is already there.
+// Takes ownership of <name>.
+void Catalog::addDest(GString *name, Object *obj) {
+  LinkDest *dest;
+  Object obj2;
 
-  return obj;
+  if (obj->isNull() || destIndex->lookup(name)) {
+    delete name;
+    return;
+  }
+  dest = NULL;
+  if (obj->isArray()) {
+    dest = new LinkDest(obj->getArray());
+  } else if (obj->isDict()) {
+    if (obj->dictLookup("D", &obj2)->isArray())
+      dest = new LinkDest(obj2.getArray());
+    else
+      error(-1, "Bad named destination value");
+    obj2.free();
+  } else {
+    error(-1, "Bad named destination value");
+  }
+  if (dest && !dest->isOk()) {
+    delete dest;
+    dest = NULL;
+  }
+  if (dest) {
+    destIndex->add(name, dest);
+  } else {
+    delete name;
+  }
 }
@@ -17,15 +17,20 @@
 
 class XRef;
 class Object;
+class GHash;
 class Page;
 class PageAttrs;
 struct Ref;
 class LinkDest;
+class GfxFormCache;
 
 //------------------------------------------------------------------------
 // Catalog
 //------------------------------------------------------------------------
 
+// Name trees nested deeper than this are assumed to be broken.
+#define catalogMaxNameTreeDepth 64
+
 class Catalog {
 public:
 
@@ -62,13 +67,23 @@ public:
   int findPage(int num, int gen);
 
   // Find a named destination.  Returns the link destination, or
-  // NULL if <name> is not a destination.
+  // NULL if <name> is not a destination.  The caller owns the
+  // returned copy.
   LinkDest *findDest(GString *name);
 
+  // Same as findDest, but returns the catalog's own destination,
+  // which must not be deleted.  All named destinations are resolved
+  // and indexed on the first call.
+  LinkDest *lookupDest(GString *name);
+
   Object *getOutline() { return &outline; }
 
   Object *getAcroForm() { return &acroForm; }
 
+  // Get the document's cache of parsed Form XObject content, which is
+  // created on first use.
+  GfxFormCache *getFormCache();
+
 private:
 
   XRef *xref;			// the xref table for this PDF file
@@ -76,6 +91,13 @@ private:
   Ref *pageRefs;		// object ID for each page
   int numPages;			// number of pages
   int pagesSize;		// size of pages array
+  int *pageIndex;		// open-addressed index of <pageRefs>
+				//   (page number - 1, -1 = empty slot)
+  int pageIndexSize;		// size of <pageIndex> array (power of 2)
+  GHash *destIndex;		// all named destinations (LinkDest*,
+				//   keyed by name), built on first use
+  GfxFormCache *formCache;	// parsed form content, created on first
+				//   use
   Object dests;			// named destination dictionary
   Object nameTree;		// name tree
   GString *baseURI;		// base URI for URI-type links
@@ -86,7 +108,10 @@ private:
   GBool ok;			// true if catalog is valid
 
   int readPageTree(Dict *pages, PageAttrs *attrs, int start);
-  Object *findDestInTree(Object *tree, GString *name, Object *obj);
+  void buildPageIndex();
+  void buildDestIndex();
+  void addDestsFromTree(Object *tree, GHash *visited, int depth);
+  void addDest(GString *name, Object *obj);
 };
 
 #endif
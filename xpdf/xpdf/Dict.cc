@@ -18,6 +18,7 @@
 #include "Object.h"
 #include "XRef.h"
 #include "Dict.h"
+#include "Lexer.h"
 
 //------------------------------------------------------------------------
 // Dict
@@ -28,16 +29,21 @@ Dict::Dict(XRef *xrefA) {
   entries = NULL;
   size = length = 0;
   ref = 1;
+  hashTab = NULL;
+  hashSize = 0;
 }
 
 Dict::~Dict() {
   int i;
 
   for (i = 0; i < length; ++i) {
-    gfree(entries[i].key);
+    if (!Lexer::isInterned(entries[i].key)) {
+      gfree(entries[i].key);
+    }
     entries[i].val.free();
   }
   gfree(entries);
+  gfree(hashTab);
 }
 
 void Dict::add(char *key, Object *val) {
@@ -48,15 +54,74 @@ void Dict::add(char *key, Object *val) {
       size *= 2;
     }
     entries = (DictEntry *)greallocn(entries, size, sizeof(DictEntry));
+    // the index is sized for the old array, rebuild it on demand
+    gfree(hashTab);
+    hashTab = NULL;
   }
   entries[length].key = key;
   entries[length].val = *val;
+  if (hashTab) {
+    hashAdd(length);
+  }
   ++length;
 }
 
+static inline unsigned int hashKey(char *key) {
+  char *p;
+  unsigned int h;
+
+  h = 0;
+  for (p = key; *p; ++p) {
+    h = 17 * h + (unsigned int)(*p & 0xff);
+  }
+  return h;
+}
+
+void Dict::buildHash() {
+  int i;
+
+  hashSize = 2 * size;
+  hashTab = (int *)gmallocn(hashSize, sizeof(int));
+  for (i = 0; i < hashSize; ++i) {
+    hashTab[i] = -1;
+  }
+  for (i = 0; i < length; ++i) {
+    hashAdd(i);
+  }
+}
+
+// Add entries[i] to the index.  If the key is already there, the
+// earlier entry is kept, as with the linear search.
+void Dict::hashAdd(int i) {
+  unsigned int h;
+
+  h = hashKey(entries[i].key) & (hashSize - 1);
+  while (hashTab[h] >= 0) {
+    if (!strcmp(entries[i].key, entries[hashTab[h]].key)) {
+      return;
+    }
+    h = (h + 1) & (hashSize - 1);
+  }
+  hashTab[h] = i;
+}
+
 inline DictEntry *Dict::find(char *key) {
+  unsigned int h;
   int i;
 
+  if (length > dictHashThreshold) {
+    if (!hashTab) {
+      buildHash();
+    }
+    h = hashKey(key) & (hashSize - 1);
+    while ((i = hashTab[h]) >= 0) {
+      if (!strcmp(key, entries[i].key)) {
+	return &entries[i];
+      }
+      h = (h + 1) & (hashSize - 1);
+    }
+    return NULL;
+  }
   for (i = 0; i < length; ++i) {
     if (!strcmp(key, entries[i].key))
       return &entries[i];
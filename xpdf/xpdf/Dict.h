@@ -26,6 +26,10 @@ struct DictEntry {
   Object val;
 };
 
+// Dictionaries with more entries than this get a hash index for
+// lookups; smaller ones are searched linearly.
+#define dictHashThreshold 16
+
 class Dict {
 public:
 
@@ -42,7 +46,8 @@ public:
   // Get number of entries.
   int getLength() { return length; }
 
-  // Add an entry.  NB: does not copy key.
+  // Add an entry.  NB: does not copy key.  The key is freed with the
+  // dictionary unless it is one of the Lexer's interned names.
   void add(char *key, Object *val);
 
   // Check if dictionary is of specified type.
@@ -70,8 +75,13 @@ private:
   int size;			// size of <entries> array
   int length;			// number of entries in dictionary
   int ref;			// reference count
+  int *hashTab;			// open-addressed index into <entries>,
+				//   -1 = empty slot; built on demand
+  int hashSize;			// size of <hashTab> array (2 * <size>)
 
   DictEntry *find(char *key);
+  void buildHash();
+  void hashAdd(int i);
 };
 
 #endif
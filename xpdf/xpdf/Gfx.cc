@@ -18,6 +18,8 @@
 #include <string.h>
 #include <math.h>
 #include "gmem.h"
+#include "GString.h"
+#include "GHash.h"
 #include "GlobalParams.h"
 #include "CharTypes.h"
 #include "Object.h"
@@ -415,6 +417,148 @@ GBool GfxResources::lookupGState(char *name, Object *obj) {
   return gFalse;
 }
 
+//------------------------------------------------------------------------
+// GfxFormCache
+//------------------------------------------------------------------------
+
+GfxFormCache::GfxFormCache() {
+  index = new GHash(gTrue);
+  first = last = NULL;
+  size = gfxDefaultFormCacheSize;
+  used = 0;
+}
+
+GfxFormCache::~GfxFormCache() {
+  while (first) {
+    remove(first);
+  }
+  delete index;
+}
+
+void GfxFormCache::setSize(Guint sizeA) {
+  size = sizeA;
+  makeRoom(0);
+}
+
+GfxFormContent *GfxFormCache::get(XRef *xref, Ref ref, Object *str) {
+  GfxFormContent *content;
+  char key[32];
+
+  sprintf(key, "%d %d", ref.num, ref.gen);
+  if ((content = (GfxFormContent *)index->lookup(key))) {
+    unlink(content);
+  } else {
+    if (size == 0) {
+      return NULL;
+    }
+    content = parse(xref, str);
+    makeRoom(content->bytes);
+    content->key = new GString(key);
+    index->add(content->key, content);
+    used += content->bytes;
+  }
+
+  // move to the front of the LRU list
+  content->prev = NULL;
+  content->next = first;
+  if (first) {
+    first->prev = content;
+  } else {
+    last = content;
+  }
+  first = content;
+
+  if (!content->objs) {
+    return NULL;
+  }
+  ++content->useCount;
+  return content;
+}
+
+// Parse a form's content stream.  Forms with inline images, whose data
+// is read straight from the stream, or that are larger than the limit
+// get an entry with no objects so they aren't parsed again.
+GfxFormContent *GfxFormCache::parse(XRef *xref, Object *str) {
+  GfxFormContent *content;
+  Lexer *lexer;
+  Parser *parser;
+  Object obj;
+  int objsSize;
+
+  content = (GfxFormContent *)gmalloc(sizeof(GfxFormContent));
+  content->objs = NULL;
+  content->nObjs = objsSize = 0;
+  content->bytes = sizeof(GfxFormContent);
+  content->useCount = 0;
+  lexer = new Lexer(xref, str);
+  lexer->bufferInput();
+  parser = new Parser(xref, lexer);
+  parser->getObj(&obj);
+  while (!obj.isEOF()) {
+    content->bytes += obj.getMemSize();
+    if (obj.isCmd("BI") || content->bytes > size) {
+      obj.free();
+      break;
+    }
+    if (content->nObjs == objsSize) {
+      objsSize = objsSize ? 2 * objsSize : 256;
+      content->objs = (Object *)greallocn(content->objs, objsSize,
+					  sizeof(Object));
+    }
+    content->objs[content->nObjs++] = obj;
+    parser->getObj(&obj);
+  }
+  delete parser;
+  if (!obj.isEOF()) {
+    for (; content->nObjs > 0; --content->nObjs) {
+      content->objs[content->nObjs - 1].free();
+    }
+    gfree(content->objs);
+    content->objs = NULL;
+    content->bytes = sizeof(GfxFormContent);
+  }
+  return content;
+}
+
+// Drop least recently used forms until <bytes> more will fit.  Forms
+// that are being replayed stay.
+void GfxFormCache::makeRoom(Guint bytes) {
+  GfxFormContent *content, *prev;
+
+  for (content = last; content && used + bytes > size; content = prev) {
+    prev = content->prev;
+    if (content->useCount == 0) {
+      remove(content);
+    }
+  }
+}
+
+void GfxFormCache::unlink(GfxFormContent *content) {
+  if (content->prev) {
+    content->prev->next = content->next;
+  } else {
+    first = content->next;
+  }
+  if (content->next) {
+    content->next->prev = content->prev;
+  } else {
+    last = content->prev;
+  }
+}
+
+void GfxFormCache::remove(GfxFormContent *content) {
+  int i;
+
+  unlink(content);
+  index->remove(content->key);
+  used -= content->bytes;
+  for (i = 0; i < content->nObjs; ++i) {
+    content->objs[i].free();
+  }
+  gfree(content->objs);
+  gfree(content);
+}
+
 //------------------------------------------------------------------------
 // Gfx
 //------------------------------------------------------------------------
@@ -435,6 +579,7 @@ Gfx::Gfx(XRef *xrefA, OutputDev *outA, int pageNum, Dict *resDict,
 
   // initialize
   out = outA;
+  vectorGraphics = out->needVectorGraphics();
   state = new GfxState(hDPI, vDPI, box, rotate, out->upsideDown());
   fontChanged = gFalse;
   clip = clipNone;
@@ -446,6 +591,8 @@ Gfx::Gfx(XRef *xrefA, OutputDev *outA, int pageNum, Dict *resDict,
     baseMatrix[i] = state->getCTM()[i];
   }
   formDepth = 0;
+  arena = new LexerArena();
+  formCache = NULL;
   abortCheckCbk = abortCheckCbkA;
   abortCheckCbkData = abortCheckCbkDataA;
 
@@ -477,6 +624,7 @@ Gfx::Gfx(XRef *xrefA, OutputDev *outA, Dict *resDict,
 
   // initialize
   out = outA;
+  vectorGraphics = out->needVectorGraphics();
   state = new GfxState(72, 72, box, 0, gFalse);
   fontChanged = gFalse;
   clip = clipNone;
@@ -485,6 +633,8 @@ Gfx::Gfx(XRef *xrefA, OutputDev *outA, Dict *resDict,
     baseMatrix[i] = state->getCTM()[i];
   }
   formDepth = 0;
+  arena = new LexerArena();
+  formCache = NULL;
   abortCheckCbk = abortCheckCbkA;
   abortCheckCbkData = abortCheckCbkDataA;
 
@@ -514,11 +664,13 @@ Gfx::~Gfx() {
   if (state) {
     delete state;
   }
+  delete arena;
 }
 
 void Gfx::display(Object *obj, GBool topLevel) {
+  Lexer *lexer;
   Object obj2;
-  int i;
+  int mark, i;
 
   if (obj->isArray()) {
     for (i = 0; i < obj->arrayGetLength(); ++i) {
@@ -534,10 +686,17 @@ void Gfx::display(Object *obj, GBool topLevel) {
     error(-1, "Weird page contents");
     return;
   }
-  parser = new Parser(xref, new Lexer(xref, obj));
+  // nested streams (forms, patterns, Type 3 chars) take their tokens
+  // from the arena above the caller's, and give them back when done
+  lexer = new Lexer(xref, obj);
+  lexer->setArena(arena);
+  lexer->bufferInput();
+  mark = arena->getMark();
+  parser = new Parser(xref, lexer);
   go(topLevel);
   delete parser;
   parser = NULL;
+  arena->release(mark);
 }
 
 void Gfx::go(GBool topLevel) {
@@ -628,6 +787,59 @@ void Gfx::go(GBool topLevel) {
   }
 }
 
+// Run a form's cached content.  This is go() without the parser: the
+// operands of each operator are the objects just before it, and they
+// stay in the cache.
+void Gfx::replay(GfxFormContent *content) {
+  Object *objs;
+  int start, numArgs, i, j;
+  int lastAbortCheck;
+
+  updateLevel = lastAbortCheck = 0;
+  objs = content->objs;
+  start = 0;
+  for (i = 0; i < content->nObjs; ++i) {
+    if (!objs[i].isCmd()) {
+      continue;
+    }
+    numArgs = i - start;
+    if (numArgs > maxArgs) {
+      error(getPos(), "Too many args in content stream");
+      numArgs = maxArgs;
+    }
+    if (printCommands) {
+      objs[i].print(stdout);
+      for (j = 0; j < numArgs; ++j) {
+	printf(" ");
+	objs[start + j].print(stdout);
+      }
+      printf("\n");
+      fflush(stdout);
+    }
+    execOp(&objs[i], &objs[start], numArgs);
+    start = i + 1;
+
+    // periodically update display
+    if (++updateLevel >= 20000) {
+      out->dump();
+      updateLevel = 0;
+    }
+
+    // check for an abort
+    if (abortCheckCbk) {
+      if (updateLevel - lastAbortCheck > 10) {
+	if ((*abortCheckCbk)(abortCheckCbkData)) {
+	  break;
+	}
+	lastAbortCheck = updateLevel;
+      }
+    }
+  }
+  if (start < content->nObjs && i == content->nObjs) {
+    error(getPos(), "Leftover args in content stream");
+  }
+}
+
 void Gfx::execOp(Object *cmd, Object args[], int numArgs) {
   Operator *op;
   char *name;
@@ -636,7 +848,7 @@ void Gfx::execOp(Object *cmd, Object args[], int numArgs) {
 
   // find operator
   name = cmd->getCmd();
-  if (!(op = findOp(name))) {
+  if (!(op = findOp(cmd))) {
     if (ignoreUndef == 0)
       error(getPos(), "Unknown operator '%s'", name);
     return;
@@ -675,6 +887,38 @@ void Gfx::execOp(Object *cmd, Object args[], int numArgs) {
   (this->*op->func)(argPtr, numArgs);
 }
 
+// Commands interned by the lexer carry their table index, so the
+// usual case is a direct lookup; anything else falls back to the
+// binary search by name.
+Operator *Gfx::findOp(Object *cmd) {
+  // a function-local static is initialized exactly once, even when
+  // several threads are running content streams
+  static Operator **opIndex = buildOpIndex();
+  int code;
+
+  if ((code = Lexer::getCmdCode(cmd->getCmd())) >= 0) {
+    return opIndex[code];
+  }
+  return findOp(cmd->getCmd());
+}
+
+Operator **Gfx::buildOpIndex() {
+  Operator **index;
+  int code, i;
+
+  index = (Operator **)gmallocn(lexNumCmds, sizeof(Operator *));
+  for (code = 0; code < lexNumCmds; ++code) {
+    index[code] = NULL;
+  }
+  for (i = 0; i < (int)numOps; ++i) {
+    if ((code = Lexer::lookupCmd(opTab[i].name,
+				 strlen(opTab[i].name))) >= 0) {
+      index[code] = &opTab[i];
+    }
+  }
+  return index;
+}
+
 Operator *Gfx::findOp(char *name) {
   int a, b, m, cmp;
 
@@ -1016,7 +1260,7 @@ void Gfx::opSetFillColorN(Object args[], int numArgs) {
       state->setFillColor(&color);
       out->updateFillColor(state);
     }
-    if (args[numArgs-1].isName() &&
+    if (vectorGraphics && args[numArgs-1].isName() &&
 	(pattern = res->lookupPattern(args[numArgs-1].getName()))) {
       state->setFillPattern(pattern);
     }
@@ -1048,7 +1292,7 @@ void Gfx::opSetStrokeColorN(Object args[], int numArgs) {
       state->setStrokeColor(&color);
       out->updateStrokeColor(state);
     }
-    if (args[numArgs-1].isName() &&
+    if (vectorGraphics && args[numArgs-1].isName() &&
 	(pattern = res->lookupPattern(args[numArgs-1].getName()))) {
       state->setStrokePattern(pattern);
     }
@@ -1070,10 +1314,16 @@ void Gfx::opSetStrokeColorN(Object args[], int numArgs) {
 //------------------------------------------------------------------------
 
 void Gfx::opMoveTo(Object args[], int numArgs) {
+  if (!vectorGraphics) {
+    return;
+  }
   state->moveTo(args[0].getNum(), args[1].getNum());
 }
 
 void Gfx::opLineTo(Object args[], int numArgs) {
+  if (!vectorGraphics) {
+    return;
+  }
   if (!state->isCurPt()) {
     error(getPos(), "No current point in lineto");
     return;
@@ -1084,6 +1334,10 @@ void Gfx::opLineTo(Object args[], int numArgs) {
 void Gfx::opCurveTo(Object args[], int numArgs) {
   double x1, y1, x2, y2, x3, y3;
 
+  if (!vectorGraphics) {
+    return;
+  }
+
   if (!state->isCurPt()) {
     error(getPos(), "No current point in curveto");
     return;
@@ -1100,6 +1354,10 @@ void Gfx::opCurveTo(Object args[], int numArgs) {
 void Gfx::opCurveTo1(Object args[], int numArgs) {
   double x1, y1, x2, y2, x3, y3;
 
+  if (!vectorGraphics) {
+    return;
+  }
+
   if (!state->isCurPt()) {
     error(getPos(), "No current point in curveto1");
     return;
@@ -1116,6 +1374,10 @@ void Gfx::opCurveTo1(Object args[], int numArgs) {
 void Gfx::opCurveTo2(Object args[], int numArgs) {
   double x1, y1, x2, y2, x3, y3;
 
+  if (!vectorGraphics) {
+    return;
+  }
+
   if (!state->isCurPt()) {
     error(getPos(), "No current point in curveto2");
     return;
@@ -1132,6 +1394,10 @@ void Gfx::opCurveTo2(Object args[], int numArgs) {
 void Gfx::opRectangle(Object args[], int numArgs) {
   double x, y, w, h;
 
+  if (!vectorGraphics) {
+    return;
+  }
+
   x = args[0].getNum();
   y = args[1].getNum();
   w = args[2].getNum();
@@ -1144,6 +1410,9 @@ void Gfx::opRectangle(Object args[], int numArgs) {
 }
 
 void Gfx::opClosePath(Object args[], int numArgs) {
+  if (!vectorGraphics) {
+    return;
+  }
   if (!state->isCurPt()) {
     error(getPos(), "No current point in closepath");
     return;
@@ -1156,6 +1425,10 @@ void Gfx::opClosePath(Object args[], int numArgs) {
 //------------------------------------------------------------------------
 
 void Gfx::opEndPath(Object args[], int numArgs) {
+  if (!vectorGraphics) {
+    clip = clipNone;
+    return;
+  }
   doEndPath();
 }
 
@@ -1584,6 +1857,10 @@ void Gfx::opShFill(Object args[], int numArgs) {
   GfxPath *savedPath;
   double xMin, yMin, xMax, yMax;
 
+  if (!vectorGraphics) {
+    return;
+  }
+
   if (!(shading = res->lookupShading(args[0].getName()))) {
     return;
   }
@@ -2864,7 +3141,9 @@ void Gfx::opXObject(Object args[], int numArgs) {
       refObj.free();
     }
   } else if (obj2.isName("Form")) {
-    doForm(&obj1);
+    res->lookupXObjectNF(args[0].getName(), &refObj);
+    doForm(&obj1, &refObj);
+    refObj.free();
   } else if (obj2.isName("PS")) {
     obj1.streamGetDict()->lookup("Level1", &obj3);
     out->psXObject(obj1.getStream(),
@@ -2891,9 +3170,10 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
   StreamColorSpaceMode csMode;
   GBool mask;
   GBool invert;
+  GBool skip;
   GfxColorSpace *colorSpace, *maskColorSpace;
   GfxImageColorMap *colorMap, *maskColorMap;
-  Object maskObj, smaskObj;
+  Object csObj, maskObj, smaskObj;
   GBool haveColorKeyMask, haveExplicitMask, haveSoftMask;
   int maskColors[2*gfxColorMaxComps];
   int maskWidth, maskHeight;
@@ -2960,6 +3240,13 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
     obj1.free();
   }
 
+  // skip the images the device doesn't want before reading their
+  // data -- the data of an inline image must still be read through
+  skip = !out->needNonText() || !out->needImage(width, height);
+  if (skip && !inlineImg) {
+    return;
+  }
+
   // display a mask
   if (mask) {
 
@@ -2983,7 +3270,11 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
     obj1.free();
 
     // draw it
-    out->drawImageMask(state, ref, str, width, height, invert, inlineImg);
+    if (skip) {
+      skipImageData(str, width, height, 1, 1);
+    } else {
+      out->drawImageMask(state, ref, str, width, height, invert, inlineImg);
+    }
 
   } else {
 
@@ -3013,8 +3304,10 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
     } else {
       colorSpace = NULL;
     }
-    obj1.free();
+    // kept by the color map
+    csObj = obj1;
     if (!colorSpace) {
+      csObj.free();
       goto err1;
     }
     dict->lookup("Decode", &obj1);
@@ -3024,6 +3317,7 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
     }
     colorMap = new GfxImageColorMap(bits, &obj1, colorSpace);
     obj1.free();
+    colorMap->setColorSpaceObj(&csObj);
     if (!colorMap->isOk()) {
       delete colorMap;
       goto err1;
@@ -3171,8 +3465,11 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
       haveExplicitMask = gTrue;
     }
 
-    // draw it
-    if (haveSoftMask) {
+    // draw it (only inline images are skipped here, they have no
+    // explicit or soft mask)
+    if (skip) {
+      skipImageData(str, width, height, colorMap->getNumPixelComps(), bits);
+    } else if (haveSoftMask) {
       out->drawSoftMaskedImage(state, ref, str, width, height, colorMap,
 			       maskStr, maskWidth, maskHeight, maskColorMap);
       delete maskColorMap;
@@ -3202,7 +3499,7 @@ void Gfx::doImage(Object *ref, Stream *str, GBool inlineImg) {
   error(getPos(), "Bad image parameters");
 }
 
-void Gfx::doForm(Object *str) {
+void Gfx::doForm(Object *str, Object *strRef) {
   Dict *dict;
   Object matrixObj, bboxObj;
   double m[6], bbox[6];
@@ -3262,7 +3559,7 @@ void Gfx::doForm(Object *str) {
 
   // draw it
   ++formDepth;
-  doForm1(str, resDict, m, bbox);
+  doForm1(str, resDict, m, bbox, strRef);
   --formDepth;
 
   resObj.free();
@@ -3382,8 +3679,10 @@ void Gfx::doAnnot(Object *str, double xMin, double yMin,
   bboxObj.free();
 }
 
-void Gfx::doForm1(Object *str, Dict *resDict, double *matrix, double *bbox) {
+void Gfx::doForm1(Object *str, Dict *resDict, double *matrix, double *bbox,
+		  Object *strRef) {
   Parser *oldParser;
+  GfxFormContent *content;
   double oldBaseMatrix[6];
   int i;
 
@@ -3421,8 +3720,15 @@ void Gfx::doForm1(Object *str, Dict *resDict, double *matrix, double *bbox) {
   out->clip(state);
   state->clearPath();
 
-  // draw the form
-  display(str, gFalse);
+  // draw the form, from the cache if it can be
+  if (formCache && strRef && strRef->isRef() &&
+      (content = formCache->get(xref, strRef->getRef(), str))) {
+    parser = NULL;
+    replay(content);
+    formCache->release(content);
+  } else {
+    display(str, gFalse);
+  }
 
   // restore base matrix
   for (i = 0; i < 6; ++i) {
@@ -3445,6 +3751,25 @@ void Gfx::doForm1(Object *str, Dict *resDict, double *matrix, double *bbox) {
 // in-line image operators
 //------------------------------------------------------------------------
 
+void Gfx::skipImageData(Stream *str, int width, int height, int nComps,
+			int bits) {
+  char buf[4096];
+  int rowSize, n, k, i;
+
+  rowSize = (width * nComps * bits + 7) >> 3;
+  str->reset();
+  for (i = 0; i < height; ++i) {
+    for (n = rowSize; n > 0; n -= k) {
+      k = str->getBlock(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf));
+      if (k <= 0) {
+	i = height;
+	break;
+      }
+    }
+  }
+  str->close();
+}
+
 void Gfx::opBeginImage(Object args[], int numArgs) {
   Stream *str;
   int c1, c2;
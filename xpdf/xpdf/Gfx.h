@@ -18,10 +18,12 @@
 #include "gtypes.h"
 
 class GString;
+class GHash;
 class XRef;
 class Array;
 class Stream;
 class Parser;
+class LexerArena;
 class Dict;
 class OutputDev;
 class GfxFontDict;
@@ -41,6 +43,58 @@ struct GfxColor;
 class Gfx;
 class PDFRectangle;
 
+//------------------------------------------------------------------------
+// GfxFormCache
+//------------------------------------------------------------------------
+
+// Default memory limit for the form content cache, in bytes.
+#define gfxDefaultFormCacheSize (8 * 1024 * 1024)
+
+// The content stream of a form, parsed into its operands and
+// operators in stream order.
+struct GfxFormContent {
+  Object *objs;			// parsed objects (NULL if the form can't
+				//   be cached)
+  int nObjs;			// number of objects in <objs>
+  Guint bytes;			// estimated memory used
+  int useCount;			// number of replays in progress
+  GString *key;			// index key ("num gen")
+  GfxFormContent *prev, *next;	// LRU list links
+};
+
+// Parsed content of the Form XObjects in a document, keyed by object
+// reference, so a form drawn on every page is decoded and lexed only
+// once.  The least recently used forms are dropped to stay within the
+// memory limit.
+class GfxFormCache {
+public:
+
+  GfxFormCache();
+  ~GfxFormCache();
+
+  // Set the memory limit.  Zero disables the cache.
+  void setSize(Guint sizeA);
+
+  // Get the parsed content of form <str>, whose reference is <ref>,
+  // parsing it on first use.  Returns NULL if the form can't be
+  // cached (it has inline images, or is larger than the limit);
+  // otherwise the caller must release() it when done.
+  GfxFormContent *get(XRef *xref, Ref ref, Object *str);
+  void release(GfxFormContent *content) { --content->useCount; }
+
+private:
+
+  GfxFormContent *parse(XRef *xref, Object *str);
+  void makeRoom(Guint bytes);
+  void unlink(GfxFormContent *content);
+  void remove(GfxFormContent *content);
+
+  GHash *index;			// cached forms, keyed by reference
+  GfxFormContent *first, *last;	// most and least recently used forms
+  Guint size;			// memory limit
+  Guint used;			// memory used by cached forms
+};
+
 //------------------------------------------------------------------------
 // Gfx
 //------------------------------------------------------------------------
@@ -117,6 +171,9 @@ public:
 
   ~Gfx();
 
+  // Take the content of Form XObjects from <formCacheA>.
+  void setFormCache(GfxFormCache *formCacheA) { formCache = formCacheA; }
+
   // Interpret a stream or array of streams.
   void display(Object *obj, GBool topLevel = gTrue);
 
@@ -138,6 +195,8 @@ private:
 
   XRef *xref;			// the xref table for this PDF file
   OutputDev *out;		// output device
+  GBool vectorGraphics;		// does the device need paths, shadings
+				//   and patterns?
   GBool subPage;		// is this a sub-page object?
   GBool printCommands;		// print the drawing commands (for debugging)
   GfxResources *res;		// resource stack
@@ -152,6 +211,9 @@ private:
   int formDepth;
 
   Parser *parser;		// parser for page content stream(s)
+  LexerArena *arena;		// name and command tokens of the content
+				//   streams being parsed
+  GfxFormCache *formCache;	// parsed form content (may be NULL)
 
   GBool				// callback to check for an abort
     (*abortCheckCbk)(void *data);
@@ -160,8 +222,11 @@ private:
   static Operator opTab[];	// table of operators
 
   void go(GBool topLevel);
+  void replay(GfxFormContent *content);
   void execOp(Object *cmd, Object args[], int numArgs);
+  Operator *findOp(Object *cmd);
   Operator *findOp(char *name);
+  static Operator **buildOpIndex();
   GBool checkArg(Object *arg, TchkType type);
   int getPos();
 
@@ -264,8 +329,11 @@ private:
   // XObject operators
   void opXObject(Object args[], int numArgs);
   void doImage(Object *ref, Stream *str, GBool inlineImg);
-  void doForm(Object *str);
-  void doForm1(Object *str, Dict *resDict, double *matrix, double *bbox);
+  void skipImageData(Stream *str, int width, int height, int nComps,
+		     int bits);
+  void doForm(Object *str, Object *strRef);
+  void doForm1(Object *str, Dict *resDict, double *matrix, double *bbox,
+	       Object *strRef = NULL);
 
   // in-line image operators
   void opBeginImage(Object args[], int numArgs);
@@ -15,6 +15,13 @@
 #include <stddef.h>
 #include <math.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GFX_AVX2_KERNELS 1
+#endif
 #include "gmem.h"
 #include "Error.h"
 #include "Object.h"
@@ -3108,6 +3115,11 @@ GfxImageColorMap::GfxImageColorMap(int bitsA, Object *decode,
 
   ok = gTrue;
 
+  rgbLineMode = gfxRGBLineNone;
+  rgbLineLookup = NULL;
+  cmykLineLookup = NULL;
+  colorSpaceObj.initNull();
+
   // bits per component and color space
   bits = bitsA;
   maxPixel = (1 << bits) - 1;
@@ -3213,6 +3225,10 @@ GfxImageColorMap::GfxImageColorMap(GfxImageColorMap *colorMap) {
   int n, i, k;
 
   colorSpace = colorMap->colorSpace->copy();
+  colorMap->colorSpaceObj.copy(&colorSpaceObj);
+  rgbLineMode = gfxRGBLineNone;
+  rgbLineLookup = NULL;
+  cmykLineLookup = NULL;
   bits = colorMap->bits;
   nComps = colorMap->nComps;
   nComps2 = colorMap->nComps2;
@@ -3250,9 +3266,18 @@ GfxImageColorMap::~GfxImageColorMap() {
   int i;
 
   delete colorSpace;
+  colorSpaceObj.free();
   for (i = 0; i < gfxColorMaxComps; ++i) {
     gfree(lookup[i]);
   }
+  gfree(rgbLineLookup);
+  gfree(cmykLineLookup);
+}
+
+void GfxImageColorMap::setColorSpaceObj(Object *obj) {
+  colorSpaceObj.free();
+  colorSpaceObj = *obj;
+  obj->initNull();
 }
 
 void GfxImageColorMap::getGray(Guchar *x, GfxGray *gray) {
@@ -3315,6 +3340,330 @@ void GfxImageColorMap::getColor(Guchar *x, GfxColor *color) {
   }
 }
 
+// Corners of the CMYK cube, in the order GfxDeviceCMYKColorSpace::getRGB
+// adds them up, and their RGB values.  Summing the nonzero terms in the
+// same order gives the same results.
+static const double cmykCornerRGB[16][3] = {
+  { 1,      1,      1      },	// 0 0 0 0
+  { 0.1373, 0.1216, 0.1255 },	// 0 0 0 1
+  { 1,      0.9490, 0      },	// 0 0 1 0
+  { 0.1098, 0.1020, 0      },	// 0 0 1 1
+  { 0.9255, 0,      0.5490 },	// 0 1 0 0
+  { 0.1412, 0,      0      },	// 0 1 0 1
+  { 0.9294, 0.1098, 0.1412 },	// 0 1 1 0
+  { 0.1333, 0,      0      },	// 0 1 1 1
+  { 0,      0.6784, 0.9373 },	// 1 0 0 0
+  { 0,      0.0588, 0.1412 },	// 1 0 0 1
+  { 0,      0.6510, 0.3137 },	// 1 0 1 0
+  { 0,      0.0745, 0      },	// 1 0 1 1
+  { 0.1804, 0.1922, 0.5725 },	// 1 1 0 0
+  { 0,      0,      0.0078 },	// 1 1 0 1
+  { 0.2118, 0.2119, 0.2235 },	// 1 1 1 0
+  { 0,      0,      0      }	// 1 1 1 1
+};
+
+// The corner loops only run fast unrolled, with the zero terms gone.
+#if defined(__GNUC__) && __GNUC__ >= 8
+#define CMYK_UNROLL _Pragma("GCC unroll 16")
+#else
+#define CMYK_UNROLL
+#endif
+
+static inline Guchar colToLineByte(GfxColorComp x) {
+  x = clip01(x) >> 8;
+  return (x > 255) ? 255 : (Guchar)x;
+}
+
+// One pixel.  The corner products are built up as ((c * m) * y) * k,
+// like getRGB does.
+static void cmykLineScalar(double *tabs[4], Guchar *in, Guchar *out,
+			   int n) {
+  double c, m, y, k, cm[4], cmy[8], x, r, g, b;
+  int i, j;
+
+  for (j = 0; j < n; ++j, in += 4, out += 3) {
+    c = tabs[0][in[0]];
+    m = tabs[1][in[1]];
+    y = tabs[2][in[2]];
+    k = tabs[3][in[3]];
+    cm[0] = (1 - c) * (1 - m);
+    cm[1] = (1 - c) * m;
+    cm[2] = c * (1 - m);
+    cm[3] = c * m;
+    for (i = 0; i < 8; ++i) {
+      cmy[i] = cm[i >> 1] * ((i & 1) ? y : 1 - y);
+    }
+    r = g = b = 0;
+    CMYK_UNROLL
+    for (i = 0; i < 15; ++i) {
+      x = cmy[i >> 1] * ((i & 1) ? k : 1 - k);
+      if (cmykCornerRGB[i][0] != 0) {
+	r += cmykCornerRGB[i][0] * x;
+      }
+      if (cmykCornerRGB[i][1] != 0) {
+	g += cmykCornerRGB[i][1] * x;
+      }
+      if (cmykCornerRGB[i][2] != 0) {
+	b += cmykCornerRGB[i][2] * x;
+      }
+    }
+    out[0] = colToLineByte(dblToCol(r));
+    out[1] = colToLineByte(dblToCol(g));
+    out[2] = colToLineByte(dblToCol(b));
+  }
+}
+
+#if defined(__SSE2__)
+
+// Two pixels at a time.
+static void cmykLineSSE2(double *tabs[4], Guchar *in, Guchar *out,
+			 int n) {
+  __m128d one, scale, c, m, y, k, c1, m1, y1, k1, cm[4], cmy[8], x, r, g, b;
+  __m128i ri, gi, bi, rgb;
+  Guchar buf[16];
+  int i, j;
+
+  one = _mm_set1_pd(1);
+  scale = _mm_set1_pd(gfxColorComp1);
+  for (j = 0; j + 2 <= n; j += 2, in += 8, out += 6) {
+    c = _mm_set_pd(tabs[0][in[4]], tabs[0][in[0]]);
+    m = _mm_set_pd(tabs[1][in[5]], tabs[1][in[1]]);
+    y = _mm_set_pd(tabs[2][in[6]], tabs[2][in[2]]);
+    k = _mm_set_pd(tabs[3][in[7]], tabs[3][in[3]]);
+    c1 = _mm_sub_pd(one, c);
+    m1 = _mm_sub_pd(one, m);
+    y1 = _mm_sub_pd(one, y);
+    k1 = _mm_sub_pd(one, k);
+    cm[0] = _mm_mul_pd(c1, m1);
+    cm[1] = _mm_mul_pd(c1, m);
+    cm[2] = _mm_mul_pd(c, m1);
+    cm[3] = _mm_mul_pd(c, m);
+    for (i = 0; i < 8; ++i) {
+      cmy[i] = _mm_mul_pd(cm[i >> 1], (i & 1) ? y : y1);
+    }
+    r = g = b = _mm_setzero_pd();
+    CMYK_UNROLL
+    for (i = 0; i < 15; ++i) {
+      x = _mm_mul_pd(cmy[i >> 1], (i & 1) ? k : k1);
+      if (cmykCornerRGB[i][0] != 0) {
+	r = _mm_add_pd(r, _mm_mul_pd(_mm_set1_pd(cmykCornerRGB[i][0]), x));
+      }
+      if (cmykCornerRGB[i][1] != 0) {
+	g = _mm_add_pd(g, _mm_mul_pd(_mm_set1_pd(cmykCornerRGB[i][1]), x));
+      }
+      if (cmykCornerRGB[i][2] != 0) {
+	b = _mm_add_pd(b, _mm_mul_pd(_mm_set1_pd(cmykCornerRGB[i][2]), x));
+      }
+    }
+    // truncate like dblToCol, then >> 8 and saturate: the signed
+    // pack takes care of clip01 and the 255 limit
+    ri = _mm_cvttpd_epi32(_mm_mul_pd(r, scale));
+    gi = _mm_cvttpd_epi32(_mm_mul_pd(g, scale));
+    bi = _mm_cvttpd_epi32(_mm_mul_pd(b, scale));
+    rgb = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi64(ri, gi), 8),
+			  _mm_srai_epi32(bi, 8));
+    _mm_storeu_si128((__m128i *)buf, _mm_packus_epi16(rgb, rgb));
+    out[0] = buf[0];  out[1] = buf[2];  out[2] = buf[4];
+    out[3] = buf[1];  out[4] = buf[3];  out[5] = buf[5];
+  }
+  cmykLineScalar(tabs, in, out, n - j);
+}
+
+#endif
+
+#if GFX_AVX2_KERNELS
+
+// Four pixels at a time, with the component tables gathered.
+__attribute__((target("avx2")))
+static void cmykLineAVX2(double *tabs[4], Guchar *in, Guchar *out,
+			 int n) {
+  __m256d one, scale, zero, all, c, m, y, k, c1, m1, y1, k1, cm[4], cmy[8];
+  __m256d x, r, g, b;
+  __m128i px, mask, ri, gi, bi, rgb;
+  Guchar buf[16];
+  int i, j;
+
+  one = _mm256_set1_pd(1);
+  scale = _mm256_set1_pd(gfxColorComp1);
+  mask = _mm_set1_epi32(0xff);
+  // the masked gathers, with every lane enabled, don't leave gcc
+  // warning about the undefined source of the unmasked ones
+  zero = _mm256_setzero_pd();
+  all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+  for (j = 0; j + 4 <= n; j += 4, in += 16, out += 12) {
+    px = _mm_loadu_si128((__m128i *)in);
+    c = _mm256_mask_i32gather_pd(zero, tabs[0],
+				 _mm_and_si128(px, mask), all, 8);
+    m = _mm256_mask_i32gather_pd(zero, tabs[1],
+				 _mm_and_si128(_mm_srli_epi32(px, 8), mask),
+				 all, 8);
+    y = _mm256_mask_i32gather_pd(zero, tabs[2],
+				 _mm_and_si128(_mm_srli_epi32(px, 16), mask),
+				 all, 8);
+    k = _mm256_mask_i32gather_pd(zero, tabs[3], _mm_srli_epi32(px, 24),
+				 all, 8);
+    c1 = _mm256_sub_pd(one, c);
+    m1 = _mm256_sub_pd(one, m);
+    y1 = _mm256_sub_pd(one, y);
+    k1 = _mm256_sub_pd(one, k);
+    cm[0] = _mm256_mul_pd(c1, m1);
+    cm[1] = _mm256_mul_pd(c1, m);
+    cm[2] = _mm256_mul_pd(c, m1);
+    cm[3] = _mm256_mul_pd(c, m);
+    for (i = 0; i < 8; ++i) {
+      cmy[i] = _mm256_mul_pd(cm[i >> 1], (i & 1) ? y : y1);
+    }
+    r = g = b = _mm256_setzero_pd();
+    CMYK_UNROLL
+    for (i = 0; i < 15; ++i) {
+      x = _mm256_mul_pd(cmy[i >> 1], (i & 1) ? k : k1);
+      if (cmykCornerRGB[i][0] != 0) {
+	r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(cmykCornerRGB[i][0]),
+					   x));
+      }
+      if (cmykCornerRGB[i][1] != 0) {
+	g = _mm256_add_pd(g, _mm256_mul_pd(_mm256_set1_pd(cmykCornerRGB[i][1]),
+					   x));
+      }
+      if (cmykCornerRGB[i][2] != 0) {
+	b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_set1_pd(cmykCornerRGB[i][2]),
+					   x));
+      }
+    }
+    ri = _mm_srai_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(r, scale)), 8);
+    gi = _mm_srai_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(g, scale)), 8);
+    bi = _mm_srai_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(b, scale)), 8);
+    rgb = _mm_packus_epi16(_mm_packs_epi32(ri, gi), _mm_packs_epi32(bi, bi));
+    // r0..r3 g0..g3 b0..b3 -> r0 g0 b0 r1 g1 b1 ...
+    rgb = _mm_shuffle_epi8(rgb, _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10,
+					      3, 7, 11, 12, 13, 14, 15));
+    _mm_storeu_si128((__m128i *)buf, rgb);
+    memcpy(out, buf, 12);
+  }
+  cmykLineScalar(tabs, in, out, n - j);
+}
+
+#endif
+
+void GfxImageColorMap::initRGBLine() {
+  GfxColorSpace *cs;
+  GfxRGB rgb;
+  Guchar x[gfxColorMaxComps];
+  int maxPixel, i, k;
+
+  maxPixel = (1 << bits) - 1;
+  cs = colorSpace;
+  while (cs->getMode() == csICCBased) {
+    cs = ((GfxICCBasedColorSpace *)cs)->getAlt();
+  }
+  if (nComps == 1) {
+    // any one-component map (gray, indexed, separation, ...): the
+    // RGB bytes of each possible pixel value
+    rgbLineLookup = (Guchar *)gmallocn(maxPixel + 1, 3);
+    for (i = 0; i <= maxPixel; ++i) {
+      x[0] = (Guchar)i;
+      getRGB(x, &rgb);
+      rgbLineLookup[3*i] = colToLineByte(rgb.r);
+      rgbLineLookup[3*i+1] = colToLineByte(rgb.g);
+      rgbLineLookup[3*i+2] = colToLineByte(rgb.b);
+    }
+    rgbLineMode = gfxRGBLineTable1;
+  } else if (nComps == 3 && !colorSpace2 &&
+	     (cs->getMode() == csDeviceRGB || cs->getMode() == csCalRGB)) {
+    // the components don't mix: one byte table each
+    rgbLineLookup = (Guchar *)gmallocn(maxPixel + 1, 3);
+    rgbLineMode = bits == 8 ? gfxRGBLineCopy : gfxRGBLineTable3;
+    for (i = 0; i <= maxPixel; ++i) {
+      x[0] = x[1] = x[2] = (Guchar)i;
+      getRGB(x, &rgb);
+      rgbLineLookup[i] = colToLineByte(rgb.r);
+      rgbLineLookup[maxPixel + 1 + i] = colToLineByte(rgb.g);
+      rgbLineLookup[2 * (maxPixel + 1) + i] = colToLineByte(rgb.b);
+      for (k = 0; k < 3; ++k) {
+	if (rgbLineLookup[k * (maxPixel + 1) + i] != i) {
+	  rgbLineMode = gfxRGBLineTable3;
+	}
+      }
+    }
+  } else if (nComps == 4 && !colorSpace2 && cs->getMode() == csDeviceCMYK) {
+    // the AVX2 kernel gathers from 256-entry tables
+    cmykLineLookup = (double *)gmallocn(4 * 256, sizeof(double));
+    for (k = 0; k < 4; ++k) {
+      for (i = 0; i < 256; ++i) {
+	cmykLineLookup[k * 256 + i] =
+	    colToDbl(lookup[k][i <= maxPixel ? i : maxPixel]);
+      }
+    }
+    rgbLineMode = gfxRGBLineCMYK;
+  } else {
+    rgbLineMode = gfxRGBLineGeneric;
+  }
+}
+
+void GfxImageColorMap::getRGBLine(Guchar *in, Guchar *out, int n) {
+  GfxRGB rgb;
+  double *tabs[4];
+  Guchar *r, *g, *b, *p;
+  int i;
+
+  if (rgbLineMode == gfxRGBLineNone) {
+    initRGBLine();
+  }
+  switch (rgbLineMode) {
+  case gfxRGBLineTable1:
+    for (i = 0; i < n; ++i) {
+      p = rgbLineLookup + 3 * in[i];
+      out[0] = p[0];
+      out[1] = p[1];
+      out[2] = p[2];
+      out += 3;
+    }
+    break;
+  case gfxRGBLineCopy:
+    memcpy(out, in, 3 * n);
+    break;
+  case gfxRGBLineTable3:
+    r = rgbLineLookup;
+    g = r + (1 << bits);
+    b = g + (1 << bits);
+    for (i = 0; i < n; ++i) {
+      out[0] = r[in[0]];
+      out[1] = g[in[1]];
+      out[2] = b[in[2]];
+      in += 3;
+      out += 3;
+    }
+    break;
+  case gfxRGBLineCMYK:
+    for (i = 0; i < 4; ++i) {
+      tabs[i] = cmykLineLookup + i * 256;
+    }
+#if GFX_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+      cmykLineAVX2(tabs, in, out, n);
+      break;
+    }
+#endif
+#if defined(__SSE2__)
+    cmykLineSSE2(tabs, in, out, n);
+#else
+    cmykLineScalar(tabs, in, out, n);
+#endif
+    break;
+  case gfxRGBLineGeneric:
+  default:
+    for (i = 0; i < n; ++i) {
+      getRGB(in, &rgb);
+      out[0] = colToLineByte(rgb.r);
+      out[1] = colToLineByte(rgb.g);
+      out[2] = colToLineByte(rgb.b);
+      in += nComps;
+      out += 3;
+    }
+    break;
+  }
+}
+
 //------------------------------------------------------------------------
 // GfxSubpath and GfxPath
 //------------------------------------------------------------------------
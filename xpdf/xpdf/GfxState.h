@@ -822,6 +822,16 @@ private:
 // GfxImageColorMap
 //------------------------------------------------------------------------
 
+// How GfxImageColorMap::getRGBLine converts pixels.
+enum GfxRGBLineMode {
+  gfxRGBLineNone,		// not set up yet
+  gfxRGBLineGeneric,		// getRGB per pixel
+  gfxRGBLineTable1,		// one component: RGB bytes per value
+  gfxRGBLineTable3,		// RGB: one byte table per component
+  gfxRGBLineCopy,		// RGB, identity tables: copy the bytes
+  gfxRGBLineCMYK		// CMYK: component tables + matrix
+};
+
 class GfxImageColorMap {
 public:
 
@@ -840,6 +850,14 @@ public:
   // Get the color space.
   GfxColorSpace *getColorSpace() { return colorSpace; }
 
+  // Get the object the color space was parsed from, resolved through
+  // the resources, or null if it was implied by the image data.
+  Object *getColorSpaceObj() { return &colorSpaceObj; }
+
+  // Set the color space object.  Takes ownership of <obj>, which is
+  // left null.
+  void setColorSpaceObj(Object *obj);
+
   // Get stream decoding info.
   int getNumPixelComps() { return nComps; }
   int getBits() { return bits; }
@@ -854,11 +872,19 @@ public:
   void getCMYK(Guchar *x, GfxCMYK *cmyk);
   void getColor(Guchar *x, GfxColor *color);
 
+  // Convert a line of <n> image pixels, one byte per component (as
+  // returned by ImageStream::getLine), to 8-bit RGB, three bytes per
+  // pixel.  Each byte is the top byte of the getRGB component,
+  // saturated at 255.
+  void getRGBLine(Guchar *in, Guchar *out, int n);
+
 private:
 
   GfxImageColorMap(GfxImageColorMap *colorMap);
+  void initRGBLine();
 
   GfxColorSpace *colorSpace;	// the image color space
+  Object colorSpaceObj;		// the object colorSpace was parsed from
   int bits;			// bits per component
   int nComps;			// number of components in a pixel
   GfxColorSpace *colorSpace2;	// secondary color space
@@ -869,6 +895,9 @@ private:
     decodeLow[gfxColorMaxComps];
   double			// max - min value for each component
     decodeRange[gfxColorMaxComps];
+  GfxRGBLineMode rgbLineMode;	// getRGBLine conversion
+  Guchar *rgbLineLookup;	// getRGBLine byte tables
+  double *cmykLineLookup;	// getRGBLine CMYK component tables
   GBool ok;
 };
 
@@ -16,6 +16,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#include "gmem.h"
 #include "Lexer.h"
 #include "Error.h"
 
@@ -42,6 +43,191 @@ static char specialChars[256] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0    // fx
 };
 
+// Interned command names: the content stream operators (Gfx::opTab),
+// followed by the keywords of the object syntax.
+#define lexCmdSize 10
+static char lexCmdTab[lexNumCmds][lexCmdSize] = {
+  "\"", "'", "B", "B*", "BDC", "BI", "BMC", "BT", "BX", "CS", "DP",
+  "Do", "EI", "EMC", "ET", "EX", "F", "G", "ID", "J", "K", "M", "MP",
+  "Q", "RG", "S", "SC", "SCN", "T*", "TD", "TJ", "TL", "Tc", "Td",
+  "Tf", "Tj", "Tm", "Tr", "Ts", "Tw", "Tz", "W", "W*", "b", "b*", "c",
+  "cm", "cs", "d", "d0", "d1", "f", "f*", "g", "gs", "h", "i", "j",
+  "k", "l", "m", "n", "q", "re", "rg", "ri", "s", "sc", "scn", "sh",
+  "v", "w", "y", "[", "]", "<<", ">>", "R", "obj", "endobj", "stream",
+  "endstream", "xref", "trailer"
+};
+
+// Perfect hash of the first (up to) four bytes of a command name,
+// mapping each name in lexCmdTab to a distinct slot.  The multiplier
+// was found by search; changing lexCmdTab means regenerating both it
+// and lexCmdSlots.
+#define lexCmdHashMul 0xdbb657b3U
+#define lexCmdHash(key) ((Guint)((key) * lexCmdHashMul) >> 24)
+
+// Index into lexCmdTab for each hash slot, or -1 for an empty slot.
+static signed char lexCmdSlots[256] = {
+   -1,  38,  28,  49,  13,  -1,  44,  -1,   4,  -1,  -1,  -1,  14,  -1,  -1,  -1,   // 0x
+   -1,  22,  -1,  16,  -1,  21,  18,  -1,  -1,  73,  -1,  43,  82,  56,  -1,  -1,   // 1x
+   -1,  71,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,   0,  -1,   // 2x
+   -1,  -1,  -1,  -1,  64,  -1,  67,  12,  -1,  31,  -1,  75,  25,  -1,  -1,  -1,   // 3x
+   -1,  -1,  55,  -1,  -1,  -1,  70,  -1,  -1,  -1,  37,  -1,  -1,  -1,  -1,  54,   // 4x
+   -1,  -1,  33,   8,  -1,  -1,  -1,  10,  -1,  -1,  -1,  -1,  -1,  -1,  20,  76,   // 5x
+   77,  78,  -1,  -1,  -1,  -1,  53,  83,  61,  -1,  -1,  -1,  11,  -1,  -1,  -1,   // 6x
+   -1,   6,  -1,  -1,  -1,  52,  -1,  -1,   1,   7,  -1,  -1,  -1,  -1,  -1,  -1,   // 7x
+   -1,  -1,  19,  -1,  23,  -1,  -1,  29,  -1,  -1,  51,  -1,  60,  -1,  -1,   3,   // 8x
+   -1,  -1,  -1,  -1,  -1,  42,  -1,  -1,  35,  -1,  46,  32,  -1,  -1,  -1,   9,   // 9x
+   -1,  65,  -1,  -1,   5,   2,  -1,  -1,  -1,  -1,  41,  -1,  -1,  27,  -1,  -1,   // ax
+   59,  -1,  66,  81,  -1,  -1,  -1,  -1,  -1,  -1,  50,  36,  -1,  -1,  34,  -1,   // bx
+   -1,  -1,  -1,  -1,  -1,  -1,  69,  63,  -1,  -1,  -1,  -1,  -1,  30,  -1,  -1,   // cx
+   -1,  74,  -1,  48,  -1,  58,  -1,  -1,  -1,  72,  39,  -1,  -1,  -1,  -1,  -1,   // dx
+   47,  -1,  -1,  -1,  -1,  68,  15,  79,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  17,   // ex
+   -1,  -1,  24,  -1,  -1,  26,  -1,  45,  -1,  57,  -1,  62,  -1,  40,  -1,  80    // fx
+};
+
+// Interned names: the dictionary keys and values that make up most
+// of the names in a typical file.
+#define lexNumNames 165
+#define lexNameSize 17
+static char lexNameTab[lexNumNames][lexNameSize] = {
+  "A", "AIS", "Alternate", "Annot", "Annots", "Artifact", "Ascent",
+  "Author", "BBox", "BM", "BaseEncoding", "BaseFont",
+  "BitsPerComponent", "BlackIs1", "Border", "Bounds", "C0", "C1", "CA",
+  "CIDFontType0", "CIDFontType2", "CIDSystemInfo", "CIDToGIDMap", "CS",
+  "CapHeight", "Catalog", "CharSet", "Colors", "ColorSpace", "Columns",
+  "Contents", "Coords", "Count", "Creator", "CreationDate", "CropBox",
+  "D", "DCTDecode", "DW", "Decode", "DecodeParms", "DescendantFonts",
+  "Descent", "Dest", "DeviceCMYK", "DeviceGray", "DeviceN",
+  "DeviceRGB", "Differences", "Domain", "Encode", "Encoding",
+  "ExtGState", "Extend", "F", "FirstChar", "Filter", "First", "Flags",
+  "FlateDecode", "Font", "FontBBox", "FontDescriptor", "FontFile",
+  "FontFile2", "FontFile3", "FontName", "Form", "FormType", "Function",
+  "FunctionType", "Group", "H", "Height", "I", "ICCBased", "ID",
+  "Identity", "Identity-H", "Image", "ImageB", "ImageC", "ImageI",
+  "ImageMask", "Index", "Indexed", "Info", "Interpolate",
+  "ItalicAngle", "K", "Kids", "LC", "LJ", "LW", "Lang", "LastChar",
+  "Length", "Length1", "Length2", "Length3", "Link", "ML", "MCID",
+  "MacRomanEncoding", "Mask", "Matrix", "MediaBox", "Metadata",
+  "ModDate", "N", "Names", "Normal", "OC", "OP", "OPM", "ObjStm",
+  "Ordering", "P", "PDF", "Page", "Pages", "Parent", "Pattern",
+  "PatternType", "Predictor", "Prev", "ProcSet", "Producer", "Range",
+  "Rect", "Registry", "Resources", "Root", "Rotate", "S", "SA",
+  "SMask", "Separation", "Shading", "ShadingType", "Size", "Span",
+  "StandardEncoding", "StemV", "StructParents", "Subtype",
+  "Supplement", "Text", "Title", "ToUnicode", "TrueType", "Type",
+  "Type0", "Type1", "Type3", "URI", "W", "Width", "Widths",
+  "WinAnsiEncoding", "XML", "XObject", "XRef", "ca", "op"
+};
+
+// Open-addressed index into lexNameTab.
+#define lexNameSlots 512
+class LexerNameIndex {
+public:
+  LexerNameIndex();
+  int lookup(char *s, int len);
+private:
+  short slots[lexNameSlots];	// lexNameTab index, or -1 if empty
+};
+
+static inline Guint hashName(char *s, int len) {
+  Guint h;
+  int i;
+
+  h = 2166136261U;
+  for (i = 0; i < len; ++i) {
+    h = (h ^ (Guint)(s[i] & 0xff)) * 16777619U;
+  }
+  return h;
+}
+
+LexerNameIndex::LexerNameIndex() {
+  int code, h;
+
+  for (h = 0; h < lexNameSlots; ++h) {
+    slots[h] = -1;
+  }
+  for (code = 0; code < lexNumNames; ++code) {
+    h = hashName(lexNameTab[code], strlen(lexNameTab[code])) &
+        (lexNameSlots - 1);
+    while (slots[h] >= 0) {
+      h = (h + 1) & (lexNameSlots - 1);
+    }
+    slots[h] = code;
+  }
+}
+
+int LexerNameIndex::lookup(char *s, int len) {
+  int code, h;
+
+  if (len <= 0 || len >= lexNameSize) {
+    return -1;
+  }
+  h = hashName(s, len) & (lexNameSlots - 1);
+  while ((code = slots[h]) >= 0) {
+    if (!strncmp(lexNameTab[code], s, len) && !lexNameTab[code][len]) {
+      return code;
+    }
+    h = (h + 1) & (lexNameSlots - 1);
+  }
+  return -1;
+}
+
+static int lookupName(char *s, int len) {
+  // a function-local static is initialized exactly once, even when
+  // several threads are lexing
+  static LexerNameIndex index;
+
+  return index.lookup(s, len);
+}
+
+//------------------------------------------------------------------------
+// LexerArena
+//------------------------------------------------------------------------
+
+#define lexArenaChunkSize 16384
+#define lexArenaMaxChunks 64	// 1 MB per arena
+
+LexerArena::LexerArena() {
+  chunks = NULL;
+  nChunks = 0;
+  used = 0;
+}
+
+LexerArena::~LexerArena() {
+  int i;
+
+  for (i = 0; i < nChunks; ++i) {
+    gfree(chunks[i]);
+  }
+  gfree(chunks);
+}
+
+char *LexerArena::copyString(char *s, int len) {
+  char *p;
+  int chunk, offset;
+
+  chunk = used / lexArenaChunkSize;
+  offset = used % lexArenaChunkSize;
+  if (offset + len + 1 > lexArenaChunkSize) {
+    ++chunk;
+    offset = 0;
+    if (len + 1 > lexArenaChunkSize) {
+      return NULL;
+    }
+  }
+  if (chunk >= lexArenaMaxChunks) {
+    return NULL;
+  }
+  if (chunk == nChunks) {
+    chunks = (char **)greallocn(chunks, nChunks + 1, sizeof(char *));
+    chunks[nChunks++] = (char *)gmalloc(lexArenaChunkSize);
+  }
+  p = chunks[chunk] + offset;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  used = chunk * lexArenaChunkSize + offset + len + 1;
+  return p;
+}
+
 //------------------------------------------------------------------------
 // Lexer
 //------------------------------------------------------------------------
@@ -54,6 +240,10 @@ Lexer::Lexer(XRef *xref, Stream *str) {
   streams->add(curStr.copy(&obj));
   strPtr = 0;
   freeArray = gTrue;
+  arena = NULL;
+  buf = bufPtr = bufEnd = NULL;
+  bufStr = NULL;
+  bufLent = gFalse;
   curStr.streamReset();
 }
 
@@ -68,6 +258,10 @@ Lexer::Lexer(XRef *xref, Object *obj) {
     streams = obj->getArray();
     freeArray = gFalse;
   }
+  arena = NULL;
+  buf = bufPtr = bufEnd = NULL;
+  bufStr = NULL;
+  bufLent = gFalse;
   strPtr = 0;
   if (streams->getLength() > 0) {
     streams->get(strPtr, &curStr);
@@ -83,11 +277,105 @@ Lexer::~Lexer() {
   if (freeArray) {
     delete streams;
   }
+  if (bufStr) {
+    delete bufStr;
+  }
+  gfree(buf);
 }
 
-int Lexer::getChar() {
+GBool Lexer::bufferInput() {
+  Object obj;
+  char *b;
+  int size, len, n;
+
+  if (buf) {
+    return gTrue;
+  }
+  if (curStr.isNone()) {
+    return gFalse;
+  }
+  b = NULL;
+  size = len = 0;
+  while (!curStr.isNone()) {
+    if (len == size) {
+      if (size >= lexMaxBufSize) {
+	// too big -- go back to reading the streams from the start
+	gfree(b);
+	curStr.streamClose();
+	curStr.free();
+	strPtr = 0;
+	streams->get(strPtr, &curStr);
+	curStr.streamReset();
+	return gFalse;
+      }
+      size = size ? 2 * size : 65536;
+      b = (char *)grealloc(b, size);
+    }
+    n = curStr.getStream()->getBlock(b + len, size - len);
+    len += n;
+    // getBlock only comes up short at the end of a stream; the next
+    // one follows on directly, as it does when reading char by char
+    if (len < size) {
+      curStr.streamClose();
+      curStr.free();
+      ++strPtr;
+      if (strPtr < streams->getLength()) {
+	streams->get(strPtr, &curStr);
+	curStr.streamReset();
+      }
+    }
+  }
+  buf = bufPtr = b;
+  bufEnd = buf + len;
+  obj.initNull();
+  bufStr = new MemStream(buf, 0, len, &obj);
+  bufLent = gFalse;
+  return gTrue;
+}
+
+Stream *Lexer::getStream() {
+  if (buf) {
+    if (!bufLent) {
+      bufStr->setPos(bufPtr - buf);
+      bufPtr = bufEnd;		// force getChar to sync first
+      bufLent = gTrue;
+    }
+    return bufStr;
+  }
+  return curStr.isNone() ? (Stream *)NULL : curStr.getStream();
+}
+
+int Lexer::getPos() {
+  if (buf) {
+    return bufLent ? bufStr->getPos() : (int)(bufPtr - buf);
+  }
+  return curStr.isNone() ? -1 : (int)curStr.streamGetPos();
+}
+
+void Lexer::setPos(Guint pos, int dir) {
+  if (buf) {
+    bufStr->setPos(pos, dir);
+    syncBuf();
+  } else if (!curStr.isNone()) {
+    curStr.streamSetPos(pos, dir);
+  }
+}
+
+// Pick up the position after someone else has read from bufStr.
+void Lexer::syncBuf() {
+  bufPtr = buf + bufStr->getPos();
+  bufLent = gFalse;
+}
+
+int Lexer::getStreamChar() {
   int c;
 
+  if (bufLent) {
+    syncBuf();
+    if (bufPtr < bufEnd) {
+      return *bufPtr++ & 0xff;
+    }
+  }
   c = EOF;
   while (!curStr.isNone() && (c = curStr.streamGetChar()) == EOF) {
     curStr.streamClose();
@@ -101,7 +389,13 @@ int Lexer::getChar() {
   return c;
 }
 
-int Lexer::lookChar() {
+int Lexer::lookStreamChar() {
+  if (bufLent) {
+    syncBuf();
+    if (bufPtr < bufEnd) {
+      return *bufPtr & 0xff;
+    }
+  }
   if (curStr.isNone()) {
     return EOF;
   }
@@ -109,16 +403,19 @@ int Lexer::lookChar() {
 }
 
 Object *Lexer::getObj(Object *obj) {
-  char *p;
+  char *p, *q;
   int c, c2;
   GBool comment, neg, done;
   int numParen;
   int xi;
   double xf, scale;
   GString *s;
-  int n, m;
+  int n, m, code;
 
   // skip whitespace and comments
+  while (bufPtr < bufEnd && specialChars[*bufPtr & 0xff] == 1) {
+    ++bufPtr;
+  }
   comment = gFalse;
   while (1) {
     if ((c = getChar()) == EOF) {
@@ -152,7 +449,7 @@ Object *Lexer::getObj(Object *obj) {
     }
     while (1) {
       c = lookChar();
-      if (isdigit(c)) {
+      if (c >= '0' && c <= '9') {
 	getChar();
 	xi = xi * 10 + (c - '0');
       } else if (c == '.') {
@@ -178,7 +475,7 @@ Object *Lexer::getObj(Object *obj) {
 	getChar();
 	continue;
       }
-      if (!isdigit(c)) {
+      if (c < '0' || c > '9') {
 	break;
       }
       getChar();
@@ -341,7 +638,13 @@ Object *Lexer::getObj(Object *obj) {
       *p++ = c;
     }
     *p = '\0';
-    obj->initName(tokBuf);
+    if ((code = lookupName(tokBuf, n)) >= 0) {
+      obj->initBorrowedName(lexNameTab[code]);
+    } else if (arena && (p = arena->copyString(tokBuf, n))) {
+      obj->initBorrowedName(p);
+    } else {
+      obj->initName(tokBuf);
+    }
     break;
 
   // array punctuation
@@ -349,7 +652,7 @@ Object *Lexer::getObj(Object *obj) {
   case ']':
     tokBuf[0] = c;
     tokBuf[1] = '\0';
-    obj->initCmd(tokBuf);
+    obj->initBorrowedCmd(lexCmdTab[lookupCmd(tokBuf, 1)]);
     break;
 
   // hex string or dict punctuation
@@ -361,7 +664,7 @@ Object *Lexer::getObj(Object *obj) {
       getChar();
       tokBuf[0] = tokBuf[1] = '<';
       tokBuf[2] = '\0';
-      obj->initCmd(tokBuf);
+      obj->initBorrowedCmd(lexCmdTab[lookupCmd(tokBuf, 2)]);
 
     // hex string
     } else {
@@ -419,7 +722,7 @@ Object *Lexer::getObj(Object *obj) {
       getChar();
       tokBuf[0] = tokBuf[1] = '>';
       tokBuf[2] = '\0';
-      obj->initCmd(tokBuf);
+      obj->initBorrowedCmd(lexCmdTab[lookupCmd(tokBuf, 2)]);
     } else {
       error(getPos(), "Illegal character '>'");
       obj->initError();
@@ -439,6 +742,16 @@ Object *Lexer::getObj(Object *obj) {
     p = tokBuf;
     *p++ = c;
     n = 1;
+    if (bufPtr < bufEnd) {
+      // the rest of the token is in the buffer: scan it in one go
+      for (q = bufPtr; q < bufEnd && !specialChars[*q & 0xff]; ++q) ;
+      if (q - bufPtr < tokBufSize - 1) {
+	n += (int)(q - bufPtr);
+	while (bufPtr < q) {
+	  *p++ = *bufPtr++;
+	}
+      }
+    }
     while ((c = lookChar()) != EOF && !specialChars[c]) {
       getChar();
       if (++n == tokBufSize) {
@@ -454,6 +767,10 @@ Object *Lexer::getObj(Object *obj) {
       obj->initBool(gFalse);
     } else if (tokBuf[0] == 'n' && !strcmp(tokBuf, "null")) {
       obj->initNull();
+    } else if ((code = lookupCmd(tokBuf, n)) >= 0) {
+      obj->initBorrowedCmd(lexCmdTab[code]);
+    } else if (arena && (p = arena->copyString(tokBuf, n))) {
+      obj->initBorrowedCmd(p);
     } else {
       obj->initCmd(tokBuf);
     }
@@ -483,3 +800,33 @@ void Lexer::skipToNextLine() {
 GBool Lexer::isSpace(int c) {
   return c >= 0 && c <= 0xff && specialChars[c] == 1;
 }
+
+GBool Lexer::isInterned(char *s) {
+  return (s >= lexNameTab[0] && s < lexNameTab[lexNumNames]) ||
+         (s >= lexCmdTab[0] && s < lexCmdTab[lexNumCmds]);
+}
+
+int Lexer::getCmdCode(char *cmd) {
+  if (cmd < lexCmdTab[0] || cmd >= lexCmdTab[lexNumCmds]) {
+    return -1;
+  }
+  return (int)((cmd - lexCmdTab[0]) / lexCmdSize);
+}
+
+int Lexer::lookupCmd(char *s, int len) {
+  Guint key;
+  int code, i;
+
+  if (len <= 0 || len >= lexCmdSize) {
+    return -1;
+  }
+  key = 0;
+  for (i = 0; i < len && i < 4; ++i) {
+    key |= (Guint)(s[i] & 0xff) << (8 * i);
+  }
+  if ((code = lexCmdSlots[lexCmdHash(key)]) < 0 ||
+      strncmp(lexCmdTab[code], s, len) || lexCmdTab[code][len]) {
+    return -1;
+  }
+  return code;
+}
@@ -22,6 +22,40 @@ class XRef;
 
 #define tokBufSize 128		// size of token buffer
 
+#define lexNumCmds 84		// number of interned command names
+
+#define lexMaxBufSize (32 * 1024 * 1024) // largest buffered input
+
+//------------------------------------------------------------------------
+// LexerArena
+//------------------------------------------------------------------------
+
+// Storage for the name and command tokens of content stream parses.
+// Objects made from it borrow the bytes instead of owning a heap copy,
+// and release() drops everything taken since a mark in one go.
+class LexerArena {
+public:
+
+  LexerArena();
+  ~LexerArena();
+
+  // Copy <len> chars from <s>, plus a terminating null.  Returns NULL
+  // once the arena has reached its size limit.
+  char *copyString(char *s, int len);
+
+  // Get the current fill level, and release everything allocated
+  // after <mark>.  Marks must be released in LIFO order.
+  int getMark() { return used; }
+  void release(int mark) { used = mark; }
+
+private:
+
+  char **chunks;		// fixed-size storage chunks
+  int nChunks;			// number of allocated chunks
+  int used;			// bytes in use, counting from the start
+				//   of chunk 0
+};
+
 //------------------------------------------------------------------------
 // Lexer
 //------------------------------------------------------------------------
@@ -49,31 +83,66 @@ public:
   // Skip over one character.
   void skipChar() { getChar(); }
 
-  // Get stream.
-  Stream *getStream()
-    { return curStr.isNone() ? (Stream *)NULL : curStr.getStream(); }
+  // Decode all of the input streams into one contiguous buffer and
+  // tokenize from there.  Returns false, and keeps reading the streams
+  // char by char, if the decoded data is larger than lexMaxBufSize.
+  GBool bufferInput();
+
+  // Get stream.  Once the input is buffered this is a MemStream over
+  // the buffer, positioned at the next char; reading from it (inline
+  // image data) moves the lexer along.
+  Stream *getStream();
 
   // Get current position in file.  This is only used for error
   // messages, so it returns an int instead of a Guint.
-  int getPos()
-    { return curStr.isNone() ? -1 : (int)curStr.streamGetPos(); }
+  int getPos();
 
   // Set position in file.
-  void setPos(Guint pos, int dir = 0)
-    { if (!curStr.isNone()) curStr.streamSetPos(pos, dir); }
+  void setPos(Guint pos, int dir = 0);
+
+  // Take uncommon names and commands from <arenaA> instead of the
+  // heap.  The caller must keep the objects from outliving it.
+  void setArena(LexerArena *arenaA) { arena = arenaA; }
 
   // Returns true if <c> is a whitespace character.
   static GBool isSpace(int c);
 
+  // Common names are interned like commands (see below).  Returns
+  // true if <s> points into one of the static name or command tables.
+  static GBool isInterned(char *s);
+
+  // Command names that the lexer recognizes (the content stream
+  // operators plus the object syntax keywords) are returned as
+  // pointers into a static table instead of as heap copies.  Returns
+  // the table index of an interned command name, or -1 if <cmd> was
+  // not interned.
+  static int getCmdCode(char *cmd);
+
+  // Look up the length-<len> command name <s> in the table.  Returns
+  // its index, or -1 if it isn't there.
+  static int lookupCmd(char *s, int len);
+
 private:
 
-  int getChar();
-  int lookChar();
+  int getChar()
+    { return bufPtr < bufEnd ? (*bufPtr++ & 0xff) : getStreamChar(); }
+  int lookChar()
+    { return bufPtr < bufEnd ? (*bufPtr & 0xff) : lookStreamChar(); }
+  int getStreamChar();
+  int lookStreamChar();
+  void syncBuf();
 
   Array *streams;		// array of input streams
   int strPtr;			// index of current stream
   Object curStr;		// current stream
   GBool freeArray;		// should lexer free the streams array?
+  LexerArena *arena;		// token storage (may be NULL)
+  char *buf;			// buffered input (NULL if not buffered)
+  char *bufPtr;			// next char in <buf>
+  char *bufEnd;			// end of the data in <buf>
+  MemStream *bufStr;		// stream over <buf>
+  GBool bufLent;		// has <bufStr> been handed out since the
+				//   last sync?
   char tokBuf[tokBufSize];	// temporary token buffer
 };
 
@@ -13,12 +13,14 @@
 #endif
 
 #include <stddef.h>
+#include <string.h>
 #include "Object.h"
 #include "Array.h"
 #include "Dict.h"
 #include "Error.h"
 #include "Stream.h"
 #include "XRef.h"
+#include "Lexer.h"
 
 //------------------------------------------------------------------------
 // Object
@@ -78,7 +80,10 @@ Object *Object::copy(Object *obj) {
     obj->string = string->copy();
     break;
   case objName:
-    obj->name = copyString(name);
+    if (!borrowed || !Lexer::isInterned(name)) {
+      obj->name = copyString(name);
+      obj->borrowed = gFalse;
+    }
     break;
   case objArray:
     array->incRef();
@@ -90,7 +95,10 @@ Object *Object::copy(Object *obj) {
     stream->incRef();
     break;
   case objCmd:
-    obj->cmd = copyString(cmd);
+    if (!borrowed || !Lexer::isInterned(cmd)) {
+      obj->cmd = copyString(cmd);
+      obj->borrowed = gFalse;
+    }
     break;
   default:
     break;
@@ -112,7 +120,9 @@ void Object::free() {
     delete string;
     break;
   case objName:
-    gfree(name);
+    if (!borrowed) {
+      gfree(name);
+    }
     break;
   case objArray:
     if (!array->decRef()) {
@@ -130,7 +140,9 @@ void Object::free() {
     }
     break;
   case objCmd:
-    gfree(cmd);
+    if (!borrowed) {
+      gfree(cmd);
+    }
     break;
   default:
     break;
@@ -141,6 +153,47 @@ void Object::free() {
   type = objNone;
 }
 
+Guint Object::getMemSize() {
+  Object obj1;
+  Guint bytes;
+  int i;
+
+  bytes = sizeof(Object);
+  switch (type) {
+  case objString:
+    bytes += sizeof(GString) + string->getLength();
+    break;
+  case objName:
+    if (!borrowed) {
+      bytes += strlen(name) + 1;
+    }
+    break;
+  case objArray:
+    bytes += sizeof(Array);
+    for (i = 0; i < arrayGetLength(); ++i) {
+      bytes += arrayGetNF(i, &obj1)->getMemSize();
+      obj1.free();
+    }
+    break;
+  case objDict:
+    bytes += sizeof(Dict);
+    for (i = 0; i < dictGetLength(); ++i) {
+      bytes += sizeof(DictEntry) + strlen(dictGetKey(i)) + 1;
+      bytes += dictGetValNF(i, &obj1)->getMemSize();
+      obj1.free();
+    }
+    break;
+  case objCmd:
+    if (!borrowed) {
+      bytes += strlen(cmd) + 1;
+    }
+    break;
+  default:
+    break;
+  }
+  return bytes;
+}
+
 char *Object::getTypeName() {
   return objTypeNames[type];
 }
@@ -90,7 +90,8 @@ public:
   Object *initString(GString *stringA)
     { initObj(objString); string = stringA; return this; }
   Object *initName(char *nameA)
-    { initObj(objName); name = copyString(nameA); return this; }
+    { initObj(objName); name = copyString(nameA); borrowed = gFalse;
+      return this; }
   Object *initNull()
     { initObj(objNull); return this; }
   Object *initArray(XRef *xref);
@@ -100,7 +101,16 @@ public:
   Object *initRef(int numA, int genA)
     { initObj(objRef); ref.num = numA; ref.gen = genA; return this; }
   Object *initCmd(char *cmdA)
-    { initObj(objCmd); cmd = copyString(cmdA); return this; }
+    { initObj(objCmd); cmd = copyString(cmdA); borrowed = gFalse;
+      return this; }
+
+  // Initialize a name or command that points into storage owned by
+  // the Lexer (its static tables or a LexerArena) instead of taking
+  // a heap copy.
+  Object *initBorrowedName(char *nameA)
+    { initObj(objName); name = nameA; borrowed = gTrue; return this; }
+  Object *initBorrowedCmd(char *cmdA)
+    { initObj(objCmd); cmd = cmdA; borrowed = gTrue; return this; }
   Object *initError()
     { initObj(objError); return this; }
   Object *initEOF()
@@ -116,6 +126,9 @@ public:
   // Free object contents.
   void free();
 
+  // Estimate the memory used by a (direct) object.
+  Guint getMemSize();
+
   // Type checking.
   ObjType getType() { return type; }
   GBool isBool() { return type == objBool; }
@@ -194,6 +207,7 @@ public:
 private:
 
   ObjType type;			// object type
+  GBool borrowed;		// name/cmd storage isn't owned
   union {			// value for each type:
     GBool booln;		//   boolean
     int intg;			//   integer
@@ -68,6 +68,17 @@ public:
   // Does this device need non-text content?
   virtual GBool needNonText() { return gTrue; }
 
+  // Does this device need the image of <width> x <height> samples?
+  // If not, its data is not read (inline images are read through, up
+  // to the EI, but not drawn).
+  virtual GBool needImage(int width, int height) { return gTrue; }
+
+  // Does this device need the vector graphics: paths, clipping,
+  // shadings and pattern fills?  If not, Gfx skips their operators
+  // without building the paths or evaluating the shadings and
+  // patterns.
+  virtual GBool needVectorGraphics() { return gTrue; }
+
   //----- initialization and control
 
   // Set default transform matrix.
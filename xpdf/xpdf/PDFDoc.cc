@@ -95,9 +95,12 @@ PDFDoc::PDFDoc(GString *fileNameA, GString *ownerPassword,
   }
 #endif
 
-  // create stream
+  // create stream, reading the file through a memory mapping when
+  // possible
   obj.initNull();
-  str = new FileStream(file, 0, gFalse, 0, &obj);
+  if (!(str = MapStream::make(file, &obj))) {
+    str = new FileStream(file, 0, gFalse, 0, &obj);
+  }
 
   ok = setup(ownerPassword, userPassword);
 }
@@ -151,9 +154,12 @@ PDFDoc::PDFDoc(wchar_t *fileNameA, int fileNameLen, GString *ownerPassword,
     return;
   }
 
-  // create stream
+  // create stream, reading the file through a memory mapping when
+  // possible
   obj.initNull();
-  str = new FileStream(file, 0, gFalse, 0, &obj);
+  if (!(str = MapStream::make(file, &obj))) {
+    str = new FileStream(file, 0, gFalse, 0, &obj);
+  }
 
   ok = setup(ownerPassword, userPassword);
 }
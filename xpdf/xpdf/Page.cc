@@ -19,6 +19,7 @@
 #include "Dict.h"
 #include "XRef.h"
 #include "Link.h"
+#include "Catalog.h"
 #include "OutputDev.h"
 #ifndef PDF_PARSER_ONLY
 #include "Gfx.h"
@@ -311,6 +312,9 @@ void Page::displaySlice(OutputDev *out, double hDPI, double vDPI,
   gfx = new Gfx(xref, out, num, attrs->getResourceDict(),
 		hDPI, vDPI, &box, crop ? cropBox : (PDFRectangle *)NULL,
 		rotate, abortCheckCbk, abortCheckCbkData);
+  if (catalog) {
+    gfx->setFormCache(catalog->getFormCache());
+  }
   contents.fetch(xref, &obj);
   if (!obj.isNull()) {
     gfx->saveState();
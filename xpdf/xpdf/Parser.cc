@@ -75,10 +75,16 @@ Object *Parser::getObj(Object *obj,
 	error(getPos(), "Dictionary key must be a name object");
 	shift();
       } else {
-	key = copyString(buf1.getName());
+	// interned names can be shared with the dictionary
+	key = buf1.getName();
+	if (!Lexer::isInterned(key)) {
+	  key = copyString(key);
+	}
 	shift();
 	if (buf1.isEOF() || buf1.isError()) {
-	  gfree(key);
+	  if (!Lexer::isInterned(key)) {
+	    gfree(key);
+	  }
 	  break;
 	}
 	obj->dictAdd(key, getObj(&obj2, fileKey, keyLength, objNum, objGen));
@@ -115,7 +121,8 @@ Object *Parser::getObj(Object *obj,
 
   // string
   } else if (buf1.isString() && fileKey) {
-    buf1.copy(obj);
+    *obj = buf1;
+    buf1.initNull();
     s = obj->getString();
     decrypt = new Decrypt(fileKey, keyLength, objNum, objGen);
     for (i = 0, p = obj->getString()->getCString();
@@ -126,9 +133,10 @@ Object *Parser::getObj(Object *obj,
     delete decrypt;
     shift();
 
-  // simple object
+  // simple object (handed over rather than copied)
   } else {
-    buf1.copy(obj);
+    *obj = buf1;
+    buf1.initNull();
     shift();
   }
 
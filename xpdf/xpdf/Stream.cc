@@ -17,9 +17,18 @@
 #include <stddef.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#else
+#include <io.h>
 #endif
 #include <string.h>
 #include <ctype.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DCT_AVX2_KERNELS 1
+#endif
 #include "gmem.h"
 #include "gfile.h"
 #include "config.h"
@@ -64,6 +73,30 @@ int Stream::getRawChar() {
   return EOF;
 }
 
+int Stream::getRawBlock(char *blk, int size) {
+  int n, c;
+
+  for (n = 0; n < size; ++n) {
+    if ((c = getRawChar()) == EOF) {
+      break;
+    }
+    blk[n] = (char)c;
+  }
+  return n;
+}
+
+int Stream::getBlock(char *blk, int size) {
+  int n, c;
+
+  for (n = 0; n < size; ++n) {
+    if ((c = getChar()) == EOF) {
+      break;
+    }
+    blk[n] = (char)c;
+  }
+  return n;
+}
+
 char *Stream::getLine(char *buf, int size) {
   int i;
   int c;
@@ -325,10 +358,17 @@ ImageStream::ImageStream(Stream *strA, int widthA, int nCompsA, int nBitsA) {
   }
   imgLine = (Guchar *)gmallocn(imgLineSize, sizeof(Guchar));
   imgIdx = nVals;
+  inputLineSize = (nVals * nBits + 7) >> 3;
+  if (nBits == 8) {
+    inputLine = NULL;
+  } else {
+    inputLine = (Guchar *)gmallocn(inputLineSize, sizeof(Guchar));
+  }
 }
 
 ImageStream::~ImageStream() {
   gfree(imgLine);
+  gfree(inputLine);
 }
 
 void ImageStream::reset() {
@@ -350,13 +390,22 @@ GBool ImageStream::getPixel(Guchar *pix) {
 
 Guchar *ImageStream::getLine() {
   Gulong buf, bitMask;
+  Guchar *p;
   int bits;
   int c;
-  int i;
+  int i, n;
+
+  // read the packed line in one go; missing bytes at the end of the
+  // stream read as 0xff, as getChar's EOF did
+  p = nBits == 8 ? imgLine : inputLine;
+  n = str->getBlock((char *)p, inputLineSize);
+  if (n < inputLineSize) {
+    memset(p + n, 0xff, inputLineSize - n);
+  }
 
   if (nBits == 1) {
     for (i = 0; i < nVals; i += 8) {
-      c = str->getChar();
+      c = *p++;
       imgLine[i+0] = (Guchar)((c >> 7) & 1);
       imgLine[i+1] = (Guchar)((c >> 6) & 1);
       imgLine[i+2] = (Guchar)((c >> 5) & 1);
@@ -367,16 +416,14 @@ Guchar *ImageStream::getLine() {
       imgLine[i+7] = (Guchar)(c & 1);
     }
   } else if (nBits == 8) {
-    for (i = 0; i < nVals; ++i) {
-      imgLine[i] = str->getChar();
-    }
+    // already in place
   } else {
     bitMask = (1 << nBits) - 1;
     buf = 0;
     bits = 0;
     for (i = 0; i < nVals; ++i) {
       if (bits < nBits) {
-	buf = (buf << 8) | (str->getChar() & 0xff);
+	buf = (buf << 8) | *p++;
 	bits += 8;
       }
       imgLine[i] = (Guchar)((buf >> (bits - nBits)) & bitMask);
@@ -387,11 +434,14 @@ Guchar *ImageStream::getLine() {
 }
 
 void ImageStream::skipLine() {
-  int n, i;
+  char skipBuf[256];
+  int n, m;
 
-  n = (nVals * nBits + 7) >> 3;
-  for (i = 0; i < n; ++i) {
-    str->getChar();
+  for (n = inputLineSize; n > 0; n -= m) {
+    m = n < (int)sizeof(skipBuf) ? n : (int)sizeof(skipBuf);
+    if ((m = str->getBlock(skipBuf, m)) == 0) {
+      break;
+    }
   }
 }
 
@@ -413,10 +463,13 @@ StreamPredictor::StreamPredictor(Stream *strA, int predictorA,
   predLine = (Guchar *)gmalloc(rowBytes);
   memset(predLine, 0, rowBytes);
   predIdx = rowBytes;
+  // one extra byte for the PNG predictor tag
+  rawLine = (Guchar *)gmalloc(rowBytes - pixBytes + 1);
 }
 
 StreamPredictor::~StreamPredictor() {
   gfree(predLine);
+  gfree(rawLine);
 }
 
 int StreamPredictor::lookChar() {
@@ -437,6 +490,27 @@ int StreamPredictor::getChar() {
   return predLine[predIdx++];
 }
 
+int StreamPredictor::getBlock(char *blk, int size) {
+  int n, m;
+
+  n = 0;
+  while (n < size) {
+    if (predIdx >= rowBytes) {
+      if (!getNextLine()) {
+	break;
+      }
+    }
+    m = rowBytes - predIdx;
+    if (m > size - n) {
+      m = size - n;
+    }
+    memcpy(blk + n, predLine + predIdx, m);
+    predIdx += m;
+    n += m;
+  }
+  return n;
+}
+
 GBool StreamPredictor::getNextLine() {
   int curPred;
   Guchar upLeftBuf[gfxColorMaxComps * 2 + 1];
@@ -444,46 +518,55 @@ GBool StreamPredictor::getNextLine() {
   int c;
   Gulong inBuf, outBuf, bitMask;
   int inBits, outBits;
-  int i, j, k, kk;
+  int i, j, k, kk, n;
+  Guchar *raw;
 
-  // get PNG optimum predictor number
+  // read the raw line, preceded by the PNG optimum predictor number
+  raw = rawLine;
   if (predictor >= 10) {
-    if ((curPred = str->getRawChar()) == EOF) {
+    n = str->getRawBlock((char *)rawLine, rowBytes - pixBytes + 1);
+    if (n < 2) {
       return gFalse;
     }
-    curPred += 10;
+    curPred = *raw++ + 10;
+    --n;
   } else {
+    n = str->getRawBlock((char *)rawLine, rowBytes - pixBytes);
+    if (n < 1) {
+      return gFalse;
+    }
     curPred = predictor;
   }
+  // this ought to return false if the line is short, but some
+  // (broken) PDF files contain truncated image data, and Adobe
+  // apparently reads the last partial line
+  n += pixBytes;
 
-  // read the raw line, apply PNG (byte) predictor
-  memset(upLeftBuf, 0, pixBytes + 1);
-  for (i = pixBytes; i < rowBytes; ++i) {
-    for (j = pixBytes; j > 0; --j) {
-      upLeftBuf[j] = upLeftBuf[j-1];
+  // apply PNG (byte) predictor
+  switch (curPred) {
+  case 11:			// PNG sub
+    for (i = pixBytes; i < n; ++i) {
+      predLine[i] = predLine[i - pixBytes] + *raw++;
     }
-    upLeftBuf[0] = predLine[i];
-    if ((c = str->getRawChar()) == EOF) {
-      if (i > pixBytes) {
-	// this ought to return false, but some (broken) PDF files
-	// contain truncated image data, and Adobe apparently reads the
-	// last partial line
-	break;
-      }
-      return gFalse;
+    break;
+  case 12:			// PNG up
+    for (i = pixBytes; i < n; ++i) {
+      predLine[i] = predLine[i] + *raw++;
     }
-    switch (curPred) {
-    case 11:			// PNG sub
-      predLine[i] = predLine[i - pixBytes] + (Guchar)c;
-      break;
-    case 12:			// PNG up
-      predLine[i] = predLine[i] + (Guchar)c;
-      break;
-    case 13:			// PNG average
-      predLine[i] = ((predLine[i - pixBytes] + predLine[i]) >> 1) +
-	            (Guchar)c;
-      break;
-    case 14:			// PNG Paeth
+    break;
+  case 13:			// PNG average
+    for (i = pixBytes; i < n; ++i) {
+      predLine[i] = ((predLine[i - pixBytes] + predLine[i]) >> 1) + *raw++;
+    }
+    break;
+  case 14:			// PNG Paeth
+    memset(upLeftBuf, 0, pixBytes + 1);
+    for (i = pixBytes; i < n; ++i) {
+      for (j = pixBytes; j > 0; --j) {
+	upLeftBuf[j] = upLeftBuf[j-1];
+      }
+      upLeftBuf[0] = predLine[i];
+      c = *raw++;
       left = predLine[i - pixBytes];
       up = predLine[i];
       upLeft = upLeftBuf[pixBytes];
@@ -500,12 +583,12 @@ GBool StreamPredictor::getNextLine() {
 	predLine[i] = up + (Guchar)c;
       else
 	predLine[i] = upLeft + (Guchar)c;
-      break;
-    case 10:			// PNG none
-    default:			// no predictor or TIFF predictor
-      predLine[i] = (Guchar)c;
-      break;
     }
+    break;
+  case 10:			// PNG none
+  default:			// no predictor or TIFF predictor
+    memcpy(predLine + pixBytes, raw, n - pixBytes);
+    break;
   }
 
   // apply TIFF (component) predictor
@@ -614,6 +697,35 @@ void FileStream::close() {
   }
 }
 
+int FileStream::getBlock(char *blk, int size) {
+  int n, k;
+
+  n = 0;
+  while (n < size) {
+    if (bufPtr >= bufEnd && !fillBuf()) {
+      break;
+    }
+    k = bufEnd - bufPtr;
+    if (k > size - n) {
+      k = size - n;
+    }
+    memcpy(blk + n, bufPtr, k);
+    bufPtr += k;
+    n += k;
+  }
+  return n;
+}
+
+GBool FileStream::getFileRange(FILE **fA, Guint *startA, Guint *lengthA) {
+  if (!limited || decrypt) {
+    return gFalse;
+  }
+  *fA = f;
+  *startA = start;
+  *lengthA = length;
+  return gTrue;
+}
+
 GBool FileStream::fillBuf() {
   int n;
   char *p;
@@ -750,6 +862,24 @@ void MemStream::setPos(Guint pos, int dir) {
   bufPtr = buf + i;
 }
 
+int MemStream::getBlock(char *blk, int size) {
+  int n;
+
+  n = bufEnd - bufPtr;
+  if (n > size) {
+    n = size;
+  }
+  memcpy(blk, bufPtr, n);
+  bufPtr += n;
+  return n;
+}
+
+GBool MemStream::getData(char **dataA, Guint *lengthA) {
+  *dataA = buf + start;
+  *lengthA = (Guint)(bufEnd - (buf + start));
+  return gTrue;
+}
+
 void MemStream::moveStart(int delta) {
   start += delta;
   length -= delta;
@@ -775,6 +905,74 @@ void MemStream::doDecryption(Guchar *fileKey, int keyLength,
   }
 }
 
+//------------------------------------------------------------------------
+// MapStream
+//------------------------------------------------------------------------
+
+MapStream *MapStream::make(FILE *fA, Object *dictA) {
+#if defined(WIN32)
+  HANDLE fileHandle, mapHandleA;
+  DWORD sizeHigh, sizeLow;
+  char *mapA;
+
+  fileHandle = (HANDLE)_get_osfhandle(_fileno(fA));
+  if (fileHandle == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+  sizeLow = GetFileSize(fileHandle, &sizeHigh);
+  if (sizeLow == INVALID_FILE_SIZE || sizeHigh != 0 ||
+      sizeLow == 0 || sizeLow > 0x7fffffff) {
+    return NULL;
+  }
+  if (!(mapHandleA = CreateFileMapping(fileHandle, NULL, PAGE_READONLY,
+				       0, 0, NULL))) {
+    return NULL;
+  }
+  if (!(mapA = (char *)MapViewOfFile(mapHandleA, FILE_MAP_READ, 0, 0, 0))) {
+    CloseHandle(mapHandleA);
+    return NULL;
+  }
+  return new MapStream(mapA, (Guint)sizeLow, (void *)mapHandleA, dictA);
+#elif defined(VMS) || defined(ACORN) || defined(MACOS)
+  return NULL;
+#else
+  struct stat st;
+  void *mapA;
+
+  if (fstat(fileno(fA), &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size <= 0 || st.st_size > 0x7fffffff) {
+    return NULL;
+  }
+  mapA = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+	      fileno(fA), 0);
+  if (mapA == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_WILLNEED
+  // nearly every page of the file ends up being read
+  madvise(mapA, (size_t)st.st_size, MADV_WILLNEED);
+#endif
+  return new MapStream((char *)mapA, (Guint)st.st_size, NULL, dictA);
+#endif
+}
+
+MapStream::MapStream(char *mapA, Guint mapLengthA, void *mapHandleA,
+		     Object *dictA):
+    MemStream(mapA, 0, mapLengthA, dictA) {
+  map = mapA;
+  mapLength = mapLengthA;
+  mapHandle = mapHandleA;
+}
+
+MapStream::~MapStream() {
+#if defined(WIN32)
+  UnmapViewOfFile(map);
+  CloseHandle((HANDLE)mapHandle);
+#elif !defined(VMS) && !defined(ACORN) && !defined(MACOS)
+  munmap(map, mapLength);
+#endif
+}
+
 //------------------------------------------------------------------------
 // EmbedStream
 //------------------------------------------------------------------------
@@ -811,6 +1009,17 @@ int EmbedStream::lookChar() {
   return str->lookChar();
 }
 
+int EmbedStream::getBlock(char *blk, int size) {
+  int n;
+
+  if (limited && (Guint)size > length) {
+    size = (int)length;
+  }
+  n = str->getBlock(blk, size);
+  length -= n;
+  return n;
+}
+
 void EmbedStream::setPos(Guint pos, int dir) {
   error(-1, "Internal: called setPos() on EmbedStream");
 }
@@ -897,6 +1106,19 @@ int ASCIIHexStream::lookChar() {
   return buf;
 }
 
+int ASCIIHexStream::getBlock(char *blk, int size) {
+  int n, c;
+
+  for (n = 0; n < size; ++n) {
+    if ((c = ASCIIHexStream::lookChar()) == EOF) {
+      break;
+    }
+    buf = EOF;
+    blk[n] = (char)c;
+  }
+  return n;
+}
+
 GString *ASCIIHexStream::getPSFilter(int psLevel, char *indent) {
   GString *s;
 
@@ -978,6 +1200,21 @@ int ASCII85Stream::lookChar() {
   return b[index];
 }
 
+int ASCII85Stream::getBlock(char *blk, int size) {
+  int i;
+
+  i = 0;
+  while (i < size) {
+    if (index >= n && ASCII85Stream::lookChar() == EOF) {
+      break;
+    }
+    while (index < n && i < size) {
+      blk[i++] = (char)b[index++];
+    }
+  }
+  return i;
+}
+
 GString *ASCII85Stream::getPSFilter(int psLevel, char *indent) {
   GString *s;
 
@@ -1062,6 +1299,34 @@ int LZWStream::getRawChar() {
   return seqBuf[seqIndex++];
 }
 
+int LZWStream::getBlock(char *blk, int size) {
+  if (pred) {
+    return pred->getBlock(blk, size);
+  }
+  return getRawBlock(blk, size);
+}
+
+int LZWStream::getRawBlock(char *blk, int size) {
+  int n, k;
+
+  n = 0;
+  while (n < size && !eof) {
+    if (seqIndex >= seqLength) {
+      if (!processNextCode()) {
+	break;
+      }
+    }
+    k = seqLength - seqIndex;
+    if (k > size - n) {
+      k = size - n;
+    }
+    memcpy(blk + n, seqBuf + seqIndex, k);
+    seqIndex += k;
+    n += k;
+  }
+  return n;
+}
+
 void LZWStream::reset() {
   str->reset();
   eof = gFalse;
@@ -1218,6 +1483,25 @@ GBool RunLengthStream::isBinary(GBool last) {
   return str->isBinary(gTrue);
 }
 
+int RunLengthStream::getBlock(char *blk, int size) {
+  int n, k;
+
+  n = 0;
+  while (n < size) {
+    if (bufPtr >= bufEnd && !fillBuf()) {
+      break;
+    }
+    k = bufEnd - bufPtr;
+    if (k > size - n) {
+      k = size - n;
+    }
+    memcpy(blk + n, bufPtr, k);
+    bufPtr += k;
+    n += k;
+  }
+  return n;
+}
+
 GBool RunLengthStream::fillBuf() {
   int c;
   int n, i;
@@ -1231,8 +1515,11 @@ GBool RunLengthStream::fillBuf() {
   }
   if (c < 0x80) {
     n = c + 1;
-    for (i = 0; i < n; ++i)
-      buf[i] = (char)str->getChar();
+    // a short literal run reads as EOF bytes
+    i = str->getBlock(buf, n);
+    if (i < n) {
+      memset(buf + i, 0xff, n - i);
+    }
   } else {
     n = 0x101 - c;
     c = str->getChar();
@@ -1814,7 +2101,21 @@ GBool CCITTFaxStream::isBinary(GBool last) {
 // clip [-256,511] --> [0,255]
 #define dctClipOffset 256
 static Guchar dctClip[768];
-static int dctClipInit = 0;
+
+static int initDCTClip() {
+  int i;
+
+  for (i = -256; i < 0; ++i)
+    dctClip[dctClipOffset + i] = 0;
+  for (i = 0; i < 256; ++i)
+    dctClip[dctClipOffset + i] = i;
+  for (i = 256; i < 512; ++i)
+    dctClip[dctClipOffset + i] = 255;
+  return 1;
+}
+
+// filled at startup, so DCTStreams on different threads only read it
+static int dctClipInit = initDCTClip();
 
 // zig zag decode map
 static int dctZigZag[64] = {
@@ -1835,6 +2136,276 @@ static int dctZigZag[64] = {
   63
 };
 
+#if DCT_AVX2_KERNELS
+
+// The kernels below do the same integer arithmetic as the scalar code
+// in transformDataUnit() and the color conversion loops, eight values
+// per vector, so their output is identical.
+
+// Transpose an 8x8 block held as eight rows.
+__attribute__((target("avx2")))
+static inline void dctTransposeAVX2(__m256i r[8]) {
+  __m256i t0, t1, t2, t3, t4, t5, t6, t7;
+  __m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+  t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+  t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+  t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+  t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+  t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+  t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+  t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+  t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+  u0 = _mm256_unpacklo_epi64(t0, t2);
+  u1 = _mm256_unpackhi_epi64(t0, t2);
+  u2 = _mm256_unpacklo_epi64(t1, t3);
+  u3 = _mm256_unpackhi_epi64(t1, t3);
+  u4 = _mm256_unpacklo_epi64(t4, t6);
+  u5 = _mm256_unpackhi_epi64(t4, t6);
+  u6 = _mm256_unpacklo_epi64(t5, t7);
+  u7 = _mm256_unpackhi_epi64(t5, t7);
+  r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// (a * c + rnd) >> sh
+__attribute__((target("avx2")))
+static inline __m256i dctMulShiftAVX2(__m256i a, int c, int rnd, int sh) {
+  return _mm256_srai_epi32(_mm256_add_epi32(
+			     _mm256_mullo_epi32(a, _mm256_set1_epi32(c)),
+			     _mm256_set1_epi32(rnd)), sh);
+}
+
+// (a + b + 1) >> 1
+__attribute__((target("avx2")))
+static inline __m256i dctAvgAVX2(__m256i a, __m256i b) {
+  return _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(a, b),
+					    _mm256_set1_epi32(1)), 1);
+}
+
+// (a * c1 + b * c2 + rnd) >> sh
+__attribute__((target("avx2")))
+static inline __m256i dctRotAVX2(__m256i a, int c1, __m256i b, int c2,
+				 int rnd, int sh) {
+  return _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(
+			     _mm256_mullo_epi32(a, _mm256_set1_epi32(c1)),
+			     _mm256_mullo_epi32(b, _mm256_set1_epi32(c2))),
+			     _mm256_set1_epi32(rnd)), sh);
+}
+
+// One 1-D IDCT pass over eight lanes: p[k] holds coefficient k of each
+// lane.  The row and column passes differ only in their fixed point
+// scaling (<dcRnd>/<dcSh> for the all-zero-AC case, <rnd>/<sh> for
+// stages 4 and 3, <oddSh> for the odd inputs to stage 4).
+__attribute__((target("avx2")))
+static inline void dctIDCTPassAVX2(__m256i p[8], int dcRnd, int dcSh,
+				   int rnd, int sh, int oddSh) {
+  __m256i v0, v1, v2, v3, v4, v5, v6, v7, t, dc, zero;
+
+  zero = _mm256_cmpeq_epi32(
+	   _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(p[1], p[2]),
+					   _mm256_or_si256(p[3], p[4])),
+			   _mm256_or_si256(_mm256_or_si256(p[5], p[6]), p[7])),
+	   _mm256_setzero_si256());
+  dc = dctMulShiftAVX2(p[0], dctSqrt2, dcRnd, dcSh);
+
+  // stage 4
+  v0 = dctMulShiftAVX2(p[0], dctSqrt2, rnd, sh);
+  v1 = dctMulShiftAVX2(p[4], dctSqrt2, rnd, sh);
+  v2 = p[2];
+  v3 = p[6];
+  v4 = dctMulShiftAVX2(_mm256_sub_epi32(p[1], p[7]), dctSqrt1d2, rnd, sh);
+  v7 = dctMulShiftAVX2(_mm256_add_epi32(p[1], p[7]), dctSqrt1d2, rnd, sh);
+  v5 = _mm256_slli_epi32(p[3], oddSh);
+  v6 = _mm256_slli_epi32(p[5], oddSh);
+
+  // stage 3
+  t = dctAvgAVX2(v0, _mm256_sub_epi32(_mm256_setzero_si256(), v1));
+  v0 = dctAvgAVX2(v0, v1);
+  v1 = t;
+  t = dctRotAVX2(v2, dctSin6, v3, dctCos6, rnd, sh);
+  v2 = dctRotAVX2(v2, dctCos6, v3, -dctSin6, rnd, sh);
+  v3 = t;
+  t = dctAvgAVX2(v4, _mm256_sub_epi32(_mm256_setzero_si256(), v6));
+  v4 = dctAvgAVX2(v4, v6);
+  v6 = t;
+  t = dctAvgAVX2(v7, v5);
+  v5 = dctAvgAVX2(v7, _mm256_sub_epi32(_mm256_setzero_si256(), v5));
+  v7 = t;
+
+  // stage 2
+  t = dctAvgAVX2(v0, _mm256_sub_epi32(_mm256_setzero_si256(), v3));
+  v0 = dctAvgAVX2(v0, v3);
+  v3 = t;
+  t = dctAvgAVX2(v1, _mm256_sub_epi32(_mm256_setzero_si256(), v2));
+  v1 = dctAvgAVX2(v1, v2);
+  v2 = t;
+  t = dctRotAVX2(v4, dctSin3, v7, dctCos3, 2048, 12);
+  v4 = dctRotAVX2(v4, dctCos3, v7, -dctSin3, 2048, 12);
+  v7 = t;
+  t = dctRotAVX2(v5, dctSin1, v6, dctCos1, 2048, 12);
+  v5 = dctRotAVX2(v5, dctCos1, v6, -dctSin1, 2048, 12);
+  v6 = t;
+
+  // stage 1
+  p[0] = _mm256_blendv_epi8(_mm256_add_epi32(v0, v7), dc, zero);
+  p[7] = _mm256_blendv_epi8(_mm256_sub_epi32(v0, v7), dc, zero);
+  p[1] = _mm256_blendv_epi8(_mm256_add_epi32(v1, v6), dc, zero);
+  p[6] = _mm256_blendv_epi8(_mm256_sub_epi32(v1, v6), dc, zero);
+  p[2] = _mm256_blendv_epi8(_mm256_add_epi32(v2, v5), dc, zero);
+  p[5] = _mm256_blendv_epi8(_mm256_sub_epi32(v2, v5), dc, zero);
+  p[3] = _mm256_blendv_epi8(_mm256_add_epi32(v3, v4), dc, zero);
+  p[4] = _mm256_blendv_epi8(_mm256_sub_epi32(v3, v4), dc, zero);
+}
+
+// Dequantize and inverse transform one data unit.
+__attribute__((target("avx2")))
+static void dctTransformAVX2(Gushort *quantTable, int dataIn[64],
+			     Guchar dataOut[64]) {
+  __m256i p[8], a, b, idx, off;
+  int i;
+
+  for (i = 0; i < 8; ++i) {
+    p[i] = _mm256_mullo_epi32(
+	     _mm256_loadu_si256((__m256i *)(dataIn + 8 * i)),
+	     _mm256_cvtepu16_epi32(
+	       _mm_loadu_si128((__m128i *)(quantTable + 8 * i))));
+  }
+
+  // rows, then columns
+  dctTransposeAVX2(p);
+  dctIDCTPassAVX2(p, 512, 10, 128, 8, 4);
+  dctTransposeAVX2(p);
+  dctIDCTPassAVX2(p, 8192, 14, 2048, 12, 0);
+
+  // convert to 8-bit integers: 128 + ((x + 8) >> 4), clipped
+  off = _mm256_set1_epi32(8 + (128 << 4));
+  for (i = 0; i < 8; ++i) {
+    p[i] = _mm256_srai_epi32(_mm256_add_epi32(p[i], off), 4);
+  }
+  idx = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  for (i = 0; i < 8; i += 4) {
+    a = _mm256_packs_epi32(p[i], p[i+1]);
+    b = _mm256_packs_epi32(p[i+2], p[i+3]);
+    a = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), idx);
+    _mm256_storeu_si256((__m256i *)(dataOut + 8 * i), a);
+  }
+}
+
+// Convert <n> pixels of Y/Cb/Cr rows to R/G/B in place (or to
+// inverted C/M/Y if <invert> is set).
+__attribute__((target("avx2")))
+static void dctYCbCrLineAVX2(Guchar *p0, Guchar *p1, Guchar *p2, int n,
+			     GBool invert) {
+  __m256i y, cb, cr, r, g, b, c128, mask, idx;
+  __m128i lo, hi;
+  int pY, pCb, pCr, pR, pG, pB;
+  int x;
+
+  c128 = _mm256_set1_epi32(128);
+  mask = invert ? _mm256_set1_epi8((char)0xff) : _mm256_setzero_si256();
+  idx = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  for (x = 0; x + 8 <= n; x += 8) {
+    y = _mm256_add_epi32(
+	  _mm256_slli_epi32(
+	    _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(p0 + x))), 16),
+	  _mm256_set1_epi32(32768));
+    cb = _mm256_sub_epi32(
+	   _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(p1 + x))), c128);
+    cr = _mm256_sub_epi32(
+	   _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(p2 + x))), c128);
+    r = _mm256_add_epi32(y, _mm256_mullo_epi32(cr,
+					       _mm256_set1_epi32(dctCrToR)));
+    g = _mm256_add_epi32(_mm256_add_epi32(y,
+		 _mm256_mullo_epi32(cb, _mm256_set1_epi32(dctCbToG))),
+		 _mm256_mullo_epi32(cr, _mm256_set1_epi32(dctCrToG)));
+    b = _mm256_add_epi32(y, _mm256_mullo_epi32(cb,
+					       _mm256_set1_epi32(dctCbToB)));
+    r = _mm256_packs_epi32(_mm256_srai_epi32(r, 16),
+			   _mm256_srai_epi32(g, 16));
+    b = _mm256_srai_epi32(b, 16);
+    b = _mm256_packs_epi32(b, b);
+    r = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(r, b), idx);
+    r = _mm256_xor_si256(r, mask);
+    lo = _mm256_castsi256_si128(r);
+    hi = _mm256_extracti128_si256(r, 1);
+    _mm_storel_epi64((__m128i *)(p0 + x), lo);
+    _mm_storel_epi64((__m128i *)(p1 + x), _mm_unpackhi_epi64(lo, lo));
+    _mm_storel_epi64((__m128i *)(p2 + x), hi);
+  }
+  for (; x < n; ++x) {
+    pY = p0[x];
+    pCb = p1[x] - 128;
+    pCr = p2[x] - 128;
+    pR = ((pY << 16) + dctCrToR * pCr + 32768) >> 16;
+    pG = ((pY << 16) + dctCbToG * pCb + dctCrToG * pCr + 32768) >> 16;
+    pB = ((pY << 16) + dctCbToB * pCb + 32768) >> 16;
+    p0[x] = dctClip[dctClipOffset + pR] ^ (invert ? 0xff : 0);
+    p1[x] = dctClip[dctClipOffset + pG] ^ (invert ? 0xff : 0);
+    p2[x] = dctClip[dctClipOffset + pB] ^ (invert ? 0xff : 0);
+  }
+}
+
+// Same as dctYCbCrLineAVX2, for the int samples in frameBuf.
+__attribute__((target("avx2")))
+static void dctYCbCrFrameLineAVX2(int *p0, int *p1, int *p2, int n,
+				  GBool invert) {
+  __m256i y, cb, cr, r, g, b, c128, zero, max;
+  int pY, pCb, pCr, pR, pG, pB;
+  int x;
+
+  c128 = _mm256_set1_epi32(128);
+  zero = _mm256_setzero_si256();
+  max = _mm256_set1_epi32(255);
+  for (x = 0; x + 8 <= n; x += 8) {
+    y = _mm256_add_epi32(
+	  _mm256_slli_epi32(_mm256_loadu_si256((__m256i *)(p0 + x)), 16),
+	  _mm256_set1_epi32(32768));
+    cb = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(p1 + x)), c128);
+    cr = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(p2 + x)), c128);
+    r = _mm256_add_epi32(y, _mm256_mullo_epi32(cr,
+					       _mm256_set1_epi32(dctCrToR)));
+    g = _mm256_add_epi32(_mm256_add_epi32(y,
+		 _mm256_mullo_epi32(cb, _mm256_set1_epi32(dctCbToG))),
+		 _mm256_mullo_epi32(cr, _mm256_set1_epi32(dctCrToG)));
+    b = _mm256_add_epi32(y, _mm256_mullo_epi32(cb,
+					       _mm256_set1_epi32(dctCbToB)));
+    r = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(r, 16), zero),
+			 max);
+    g = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(g, 16), zero),
+			 max);
+    b = _mm256_min_epi32(_mm256_max_epi32(_mm256_srai_epi32(b, 16), zero),
+			 max);
+    if (invert) {
+      r = _mm256_sub_epi32(max, r);
+      g = _mm256_sub_epi32(max, g);
+      b = _mm256_sub_epi32(max, b);
+    }
+    _mm256_storeu_si256((__m256i *)(p0 + x), r);
+    _mm256_storeu_si256((__m256i *)(p1 + x), g);
+    _mm256_storeu_si256((__m256i *)(p2 + x), b);
+  }
+  for (; x < n; ++x) {
+    pY = p0[x];
+    pCb = p1[x] - 128;
+    pCr = p2[x] - 128;
+    pR = ((pY << 16) + dctCrToR * pCr + 32768) >> 16;
+    pG = ((pY << 16) + dctCbToG * pCb + dctCrToG * pCr + 32768) >> 16;
+    pB = ((pY << 16) + dctCbToB * pCb + 32768) >> 16;
+    p0[x] = dctClip[dctClipOffset + pR] ^ (invert ? 0xff : 0);
+    p1[x] = dctClip[dctClipOffset + pG] ^ (invert ? 0xff : 0);
+    p2[x] = dctClip[dctClipOffset + pB] ^ (invert ? 0xff : 0);
+  }
+}
+
+#endif
+
 DCTStream::DCTStream(Stream *strA):
     FilterStream(strA) {
   int i, j;
@@ -1850,17 +2421,10 @@ DCTStream::DCTStream(Stream *strA):
       rowBuf[i][j] = NULL;
     }
     frameBuf[i] = NULL;
+    dcHuffTables[i].lookOk = gFalse;
+    acHuffTables[i].lookOk = gFalse;
   }
 
-  if (!dctClipInit) {
-    for (i = -256; i < 0; ++i)
-      dctClip[dctClipOffset + i] = 0;
-    for (i = 0; i < 256; ++i)
-      dctClip[dctClipOffset + i] = i;
-    for (i = 256; i < 512; ++i)
-      dctClip[dctClipOffset + i] = 255;
-    dctClipInit = 1;
-  }
 }
 
 DCTStream::~DCTStream() {
@@ -2037,6 +2601,18 @@ int DCTStream::lookChar() {
   }
 }
 
+int DCTStream::getBlock(char *blk, int size) {
+  int n, c;
+
+  for (n = 0; n < size; ++n) {
+    if ((c = DCTStream::getChar()) == EOF) {
+      break;
+    }
+    blk[n] = (char)c;
+  }
+  return n;
+}
+
 void DCTStream::restart() {
   int i;
 
@@ -2133,6 +2709,15 @@ GBool DCTStream::readMCURow() {
 
     // color space conversion
     if (colorXform) {
+#if DCT_AVX2_KERNELS
+      if ((numComps == 3 || numComps == 4) &&
+	  __builtin_cpu_supports("avx2")) {
+	for (y2 = 0; y2 < mcuHeight; ++y2) {
+	  dctYCbCrLineAVX2(&rowBuf[0][y2][x1], &rowBuf[1][y2][x1],
+			   &rowBuf[2][y2][x1], mcuWidth, numComps == 4);
+	}
+      } else
+#endif
       // convert YCbCr to RGB
       if (numComps == 3) {
 	for (y2 = 0; y2 < mcuHeight; ++y2) {
@@ -2541,6 +3126,16 @@ void DCTStream::decodeImage() {
 
       // color space conversion
       if (colorXform) {
+#if DCT_AVX2_KERNELS
+	if ((numComps == 3 || numComps == 4) &&
+	    __builtin_cpu_supports("avx2")) {
+	  for (y2 = 0; y2 < mcuHeight; ++y2) {
+	    i = (y1+y2) * bufWidth + x1;
+	    dctYCbCrFrameLineAVX2(frameBuf[0] + i, frameBuf[1] + i,
+				  frameBuf[2] + i, mcuWidth, numComps == 4);
+	  }
+	} else
+#endif
 	// convert YCbCr to RGB
 	if (numComps == 3) {
 	  for (y2 = 0; y2 < mcuHeight; ++y2) {
@@ -2599,6 +3194,13 @@ void DCTStream::transformDataUnit(Gushort *quantTable,
   int *p;
   int i;
 
+#if DCT_AVX2_KERNELS
+  if (__builtin_cpu_supports("avx2")) {
+    dctTransformAVX2(quantTable, dataIn, dataOut);
+    return;
+  }
+#endif
+
   // dequant
   for (i = 0; i < 64; ++i) {
     dataIn[i] *= quantTable[i];
@@ -2750,6 +3352,31 @@ int DCTStream::readHuffSym(DCTHuffTable *table) {
   Gushort code;
   int bit;
   int codeBits;
+  int look, len;
+
+  // codes of up to 8 bits are looked up from the next 8 buffered
+  // bits; a byte is only pulled in when the code doesn't fit in the
+  // bits already buffered, so the input is consumed exactly as in the
+  // bit-by-bit loop below
+  if (table->lookOk) {
+    if (inputBits < 8) {
+      look = (inputBuf << (8 - inputBits)) & 0xff;
+      len = table->lookLen[look];
+      if (len && len <= inputBits) {
+	inputBits -= len;
+	return table->lookSym[look];
+      }
+      if (!readInputByte()) {
+	inputBits = 0;
+	return 9999;
+      }
+    }
+    look = (inputBuf >> (inputBits - 8)) & 0xff;
+    if ((len = table->lookLen[look])) {
+      inputBits -= len;
+      return table->lookSym[look];
+    }
+  }
 
   code = 0;
   codeBits = 0;
@@ -2775,11 +3402,22 @@ int DCTStream::readAmp(int size) {
   int amp, bit;
   int bits;
 
-  amp = 0;
-  for (bits = 0; bits < size; ++bits) {
-    if ((bit = readBit()) == EOF)
-      return 9999;
-    amp = (amp << 1) + bit;
+  if (size <= 16) {
+    while (inputBits < size) {
+      if (!readInputByte()) {
+	inputBits = 0;
+	return 9999;
+      }
+    }
+    inputBits -= size;
+    amp = (inputBuf >> inputBits) & ((1 << size) - 1);
+  } else {
+    amp = 0;
+    for (bits = 0; bits < size; ++bits) {
+      if ((bit = readBit()) == EOF)
+	return 9999;
+      amp = (amp << 1) + bit;
+    }
   }
   if (amp < (1 << (size - 1)))
     amp -= (1 << size) - 1;
@@ -2788,28 +3426,37 @@ int DCTStream::readAmp(int size) {
 
 int DCTStream::readBit() {
   int bit;
-  int c, c2;
 
   if (inputBits == 0) {
-    if ((c = str->getChar()) == EOF)
+    if (!readInputByte())
       return EOF;
-    if (c == 0xff) {
-      do {
-	c2 = str->getChar();
-      } while (c2 == 0xff);
-      if (c2 != 0x00) {
-	error(getPos(), "Bad DCT data: missing 00 after ff");
-	return EOF;
-      }
-    }
-    inputBuf = c;
-    inputBits = 8;
   }
   bit = (inputBuf >> (inputBits - 1)) & 1;
   --inputBits;
   return bit;
 }
 
+// Append the next byte of entropy-coded data to the low end of
+// inputBuf.  Returns false on EOF or a marker.
+GBool DCTStream::readInputByte() {
+  int c, c2;
+
+  if ((c = str->getChar()) == EOF)
+    return gFalse;
+  if (c == 0xff) {
+    do {
+      c2 = str->getChar();
+    } while (c2 == 0xff);
+    if (c2 != 0x00) {
+      error(getPos(), "Bad DCT data: missing 00 after ff");
+      return gFalse;
+    }
+  }
+  inputBuf = ((inputBuf & ((1 << inputBits) - 1)) << 8) | c;
+  inputBits += 8;
+  return gTrue;
+}
+
 GBool DCTStream::readHeader() {
   GBool doScan;
   int n;
@@ -3059,10 +3706,39 @@ GBool DCTStream::readHuffmanTables() {
     for (i = 0; i < sym; ++i)
       tbl->sym[i] = str->getChar();
     length -= sym;
+    buildHuffLookup(tbl);
   }
   return gTrue;
 }
 
+// Fill in the 8-bit lookahead table by running the readHuffSym()
+// search on every 8-bit prefix.  Tables whose codes would index past
+// sym[] are left to the bit-by-bit search.
+void DCTStream::buildHuffLookup(DCTHuffTable *tbl) {
+  Gushort code;
+  int look, codeBits, i;
+
+  tbl->lookOk = gTrue;
+  for (look = 0; look < 256; ++look) {
+    tbl->lookLen[look] = 0;
+    tbl->lookSym[look] = 0;
+    code = 0;
+    for (codeBits = 1; codeBits <= 8; ++codeBits) {
+      code = (code << 1) + ((look >> (8 - codeBits)) & 1);
+      if (code - tbl->firstCode[codeBits] < tbl->numCodes[codeBits]) {
+	i = tbl->firstSym[codeBits] + (Gushort)(code - tbl->firstCode[codeBits]);
+	if (i >= 256) {
+	  tbl->lookOk = gFalse;
+	  return;
+	}
+	tbl->lookLen[look] = codeBits;
+	tbl->lookSym[look] = tbl->sym[i];
+	break;
+      }
+    }
+  }
+}
+
 GBool DCTStream::readRestartInterval() {
   int length;
 
@@ -3780,7 +4456,7 @@ static FlateCode flateFixedLitCodeTabCodes[512] = {
 };
 
 FlateHuffmanTab FlateStream::fixedLitCodeTab = {
-  flateFixedLitCodeTabCodes, 9
+  flateFixedLitCodeTabCodes, 9, 9
 };
 
 static FlateCode flateFixedDistCodeTabCodes[32] = {
@@ -3819,7 +4495,7 @@ static FlateCode flateFixedDistCodeTabCodes[32] = {
 };
 
 FlateHuffmanTab FlateStream::fixedDistCodeTab = {
-  flateFixedDistCodeTabCodes, 5
+  flateFixedDistCodeTabCodes, 5, 5
 };
 
 FlateStream::FlateStream(Stream *strA, int predictor, int columns,
@@ -3859,13 +4535,13 @@ void FlateStream::reset() {
   eof = gTrue;
 
   str->reset();
+  inPtr = inEnd = inBuf;
+  readAhead = str->getBaseStream()->canReadAhead();
 
   // read header
   //~ need to look at window size?
   endOfBlock = eof = gTrue;
-  cmf = str->getChar();
-  flg = str->getChar();
-  if (cmf == EOF || flg == EOF)
+  if ((cmf = getCodeWord(8)) == EOF || (flg = getCodeWord(8)) == EOF)
     return;
   if ((cmf & 0x0f) != 0x08) {
     error(getPos(), "Unknown compression method in flate stream");
@@ -3929,6 +4605,39 @@ int FlateStream::getRawChar() {
   return c;
 }
 
+int FlateStream::getBlock(char *blk, int size) {
+  if (pred) {
+    return pred->getBlock(blk, size);
+  }
+  return getRawBlock(blk, size);
+}
+
+int FlateStream::getRawBlock(char *blk, int size) {
+  int n, k;
+
+  n = 0;
+  while (n < size) {
+    if (remain == 0) {
+      if (endOfBlock && eof)
+	break;
+      readSome();
+      continue;
+    }
+    k = size - n;
+    if (k > remain) {
+      k = remain;
+    }
+    if (k > flateWindow - index) {
+      k = flateWindow - index;
+    }
+    memcpy(blk + n, buf + index, k);
+    index = (index + k) & flateMask;
+    remain -= k;
+    n += k;
+  }
+  return n;
+}
+
 GString *FlateStream::getPSFilter(int psLevel, char *indent) {
   GString *s;
 
@@ -3946,59 +4655,96 @@ GBool FlateStream::isBinary(GBool last) {
   return str->isBinary(gTrue);
 }
 
+// Decode data into the output buffer, until the end of the current
+// block, or until there may not be room for another match.
 void FlateStream::readSome() {
   int code1, code2;
   int len, dist;
   int i, j, k;
-  int c;
 
   if (endOfBlock) {
     if (!startBlock())
       return;
   }
 
+  i = (index + remain) & flateMask;
   if (compressedBlock) {
-    if ((code1 = getHuffmanCodeWord(&litCodeTab)) == EOF)
-      goto err;
-    if (code1 < 256) {
-      buf[index] = code1;
-      remain = 1;
-    } else if (code1 == 256) {
-      endOfBlock = gTrue;
-      remain = 0;
-    } else {
-      code1 -= 257;
-      code2 = lengthDecode[code1].bits;
-      if (code2 > 0 && (code2 = getCodeWord(code2)) == EOF)
-	goto err;
-      len = lengthDecode[code1].first + code2;
-      if ((code1 = getHuffmanCodeWord(&distCodeTab)) == EOF)
+    while (remain <= flateWindow - flateMaxMatch) {
+      if ((code1 = getHuffmanCodeWord(&litCodeTab)) == EOF)
 	goto err;
-      code2 = distDecode[code1].bits;
-      if (code2 > 0 && (code2 = getCodeWord(code2)) == EOF)
-	goto err;
-      dist = distDecode[code1].first + code2;
-      i = index;
-      j = (index - dist) & flateMask;
-      for (k = 0; k < len; ++k) {
-	buf[i] = buf[j];
+      if (code1 < 256) {
+	buf[i] = (Guchar)code1;
 	i = (i + 1) & flateMask;
-	j = (j + 1) & flateMask;
+	++remain;
+      } else if (code1 == 256) {
+	endOfBlock = gTrue;
+	break;
+      } else {
+	code1 -= 257;
+	if (code1 >= flateMaxLitCodes - 257)
+	  goto err;
+	code2 = lengthDecode[code1].bits;
+	if (code2 > 0 && (code2 = getCodeWord(code2)) == EOF)
+	  goto err;
+	len = lengthDecode[code1].first + code2;
+	if ((code1 = getHuffmanCodeWord(&distCodeTab)) == EOF)
+	  goto err;
+	if (code1 >= flateMaxDistCodes)
+	  goto err;
+	code2 = distDecode[code1].bits;
+	if (code2 > 0 && (code2 = getCodeWord(code2)) == EOF)
+	  goto err;
+	dist = distDecode[code1].first + code2;
+	j = (i - dist) & flateMask;
+	// the source is below the destination, or above it after
+	// wrapping around the window: the ranges must not overlap
+	if (dist >= len && dist <= flateWindow - len &&
+	    i + len <= flateWindow && j + len <= flateWindow) {
+	  memcpy(buf + i, buf + j, len);
+	  i += len;
+	} else {
+	  for (k = 0; k < len; ++k) {
+	    buf[i] = buf[j];
+	    i = (i + 1) & flateMask;
+	    j = (j + 1) & flateMask;
+	  }
+	}
+	i &= flateMask;
+	remain += len;
       }
-      remain = len;
     }
 
   } else {
-    len = (blockLen < flateWindow) ? blockLen : flateWindow;
-    for (i = 0, j = index; i < len; ++i, j = (j + 1) & flateMask) {
-      if ((c = str->getChar()) == EOF) {
+    len = flateWindow - remain;
+    if (len > blockLen) {
+      len = blockLen;
+    }
+    k = 0;
+    // bytes left in the bit buffer come first
+    while (k < len && codeSize >= 8) {
+      buf[i] = (Guchar)getCodeWord(8);
+      i = (i + 1) & flateMask;
+      ++k;
+    }
+    while (k < len) {
+      if (inPtr == inEnd && !fillInBuf()) {
 	endOfBlock = eof = gTrue;
 	break;
       }
-      buf[j] = c & 0xff;
+      j = (int)(inEnd - inPtr);
+      if (j > len - k) {
+	j = len - k;
+      }
+      if (j > flateWindow - i) {
+	j = flateWindow - i;
+      }
+      memcpy(buf + i, inPtr, j);
+      inPtr += j;
+      i = (i + j) & flateMask;
+      k += j;
     }
-    remain = i;
-    blockLen -= len;
+    remain += k;
+    blockLen -= k;
     if (blockLen == 0)
       endOfBlock = gTrue;
   }
@@ -4008,7 +4754,6 @@ void FlateStream::readSome() {
 err:
   error(getPos(), "Unexpected end of file in flate stream");
   endOfBlock = eof = gTrue;
-  remain = 0;
 }
 
 GBool FlateStream::startBlock() {
@@ -4035,22 +4780,23 @@ GBool FlateStream::startBlock() {
   // uncompressed block
   if (blockHdr == 0) {
     compressedBlock = gFalse;
-    if ((c = str->getChar()) == EOF)
+    // skip to a byte boundary
+    codeBuf >>= codeSize & 7;
+    codeSize -= codeSize & 7;
+    if ((c = getCodeWord(8)) == EOF)
       goto err;
-    blockLen = c & 0xff;
-    if ((c = str->getChar()) == EOF)
+    blockLen = c;
+    if ((c = getCodeWord(8)) == EOF)
       goto err;
-    blockLen |= (c & 0xff) << 8;
-    if ((c = str->getChar()) == EOF)
+    blockLen |= c << 8;
+    if ((c = getCodeWord(8)) == EOF)
       goto err;
-    check = c & 0xff;
-    if ((c = str->getChar()) == EOF)
+    check = c;
+    if ((c = getCodeWord(8)) == EOF)
       goto err;
-    check |= (c & 0xff) << 8;
+    check |= c << 8;
     if (check != (~blockLen & 0xffff))
       error(getPos(), "Bad uncompressed block length in flate stream");
-    codeBuf = 0;
-    codeSize = 0;
 
   // compressed block with fixed codes
   } else if (blockHdr == 1) {
@@ -4079,10 +4825,8 @@ err:
 }
 
 void FlateStream::loadFixedCodes() {
-  litCodeTab.codes = fixedLitCodeTab.codes;
-  litCodeTab.maxLen = fixedLitCodeTab.maxLen;
-  distCodeTab.codes = fixedDistCodeTab.codes;
-  distCodeTab.maxLen = fixedDistCodeTab.maxLen;
+  litCodeTab = fixedLitCodeTab;
+  distCodeTab = fixedDistCodeTab;
 }
 
 GBool FlateStream::readDynamicCodes() {
@@ -4124,7 +4868,10 @@ GBool FlateStream::readDynamicCodes() {
       goto err;
     }
   }
-  compHuffmanCodes(codeLenCodeLengths, flateMaxCodeLenCodes, &codeLenCodeTab);
+  if (!compHuffmanCodes(codeLenCodeLengths, flateMaxCodeLenCodes,
+			&codeLenCodeTab)) {
+    goto err;
+  }
 
   // build the literal and distance code tables
   len = 0;
@@ -4173,8 +4920,11 @@ GBool FlateStream::readDynamicCodes() {
       codeLengths[i++] = len = code;
     }
   }
-  compHuffmanCodes(codeLengths, numLitCodes, &litCodeTab);
-  compHuffmanCodes(codeLengths + numLitCodes, numDistCodes, &distCodeTab);
+  if (!compHuffmanCodes(codeLengths, numLitCodes, &litCodeTab) ||
+      !compHuffmanCodes(codeLengths + numLitCodes, numDistCodes,
+			&distCodeTab)) {
+    goto err;
+  }
 
   gfree(codeLenCodeTab.codes);
   return gTrue;
@@ -4186,67 +4936,148 @@ err:
 }
 
 // Convert an array <lengths> of <n> lengths, in value order, into a
-// Huffman code lookup table.
-void FlateStream::compHuffmanCodes(int *lengths, int n, FlateHuffmanTab *tab) {
-  int tabSize, len, code, code2, skip, val, i, t;
-
-  // find max code length
+// Huffman code lookup table.  Codes up to flatePrimaryBits long are
+// looked up directly with their bits; longer codes go through a link
+// to a second level table for their first flatePrimaryBits bits.
+// Returns false if the lengths are over-subscribed.
+GBool FlateStream::compHuffmanCodes(int *lengths, int n,
+				    FlateHuffmanTab *tab) {
+  int lenCount[flateMaxHuffman + 1];
+  int nextCode[flateMaxHuffman + 1];
+  int revCodes[flateMaxLitCodes];
+  int subBits[1 << flatePrimaryBits];
+  int subOffset[1 << flatePrimaryBits];
+  int primBits, primSize, tabSize, len, code, left, prefix, val, i, t;
+
+  tab->codes = NULL;
+
+  // count the codes of each length and check that they fit
+  for (len = 0; len <= flateMaxHuffman; ++len) {
+    lenCount[len] = 0;
+  }
+  for (val = 0; val < n; ++val) {
+    ++lenCount[lengths[val]];
+  }
+  lenCount[0] = 0;
   tab->maxLen = 0;
+  left = 1;
+  for (len = 1; len <= flateMaxHuffman; ++len) {
+    left = (left << 1) - lenCount[len];
+    if (left < 0) {
+      return gFalse;
+    }
+    if (lenCount[len] > 0) {
+      tab->maxLen = len;
+    }
+  }
+  primBits = tab->maxLen < flatePrimaryBits ? tab->maxLen : flatePrimaryBits;
+  tab->primaryBits = primBits;
+  primSize = 1 << primBits;
+
+  // assign the (canonical) codes, bit-reversed since the bits are
+  // read starting with the low order bit
+  code = 0;
+  for (len = 1; len <= flateMaxHuffman; ++len) {
+    code = (code + lenCount[len - 1]) << 1;
+    nextCode[len] = code;
+  }
+  for (i = 0; i < primSize; ++i) {
+    subBits[i] = 0;
+  }
   for (val = 0; val < n; ++val) {
-    if (lengths[val] > tab->maxLen) {
-      tab->maxLen = lengths[val];
+    if ((len = lengths[val]) == 0) {
+      continue;
+    }
+    code = 0;
+    t = nextCode[len]++;
+    for (i = 0; i < len; ++i) {
+      code = (code << 1) | (t & 1);
+      t >>= 1;
+    }
+    revCodes[val] = code;
+    if (len > primBits) {
+      prefix = code & (primSize - 1);
+      if (len - primBits > subBits[prefix]) {
+	subBits[prefix] = len - primBits;
+      }
     }
   }
 
-  // allocate the table
-  tabSize = 1 << tab->maxLen;
+  // lay out the second level tables after the first level one
+  tabSize = primSize;
+  for (i = 0; i < primSize; ++i) {
+    if (subBits[i] > 0) {
+      subOffset[i] = tabSize;
+      tabSize += 1 << subBits[i];
+    }
+  }
   tab->codes = (FlateCode *)gmallocn(tabSize, sizeof(FlateCode));
-
-  // clear the table
   for (i = 0; i < tabSize; ++i) {
     tab->codes[i].len = 0;
     tab->codes[i].val = 0;
   }
+  for (i = 0; i < primSize; ++i) {
+    if (subBits[i] > 0) {
+      tab->codes[i].len = (Gushort)(flateLinkLen + subBits[i]);
+      tab->codes[i].val = (Gushort)subOffset[i];
+    }
+  }
 
-  // build the table
-  for (len = 1, code = 0, skip = 2;
-       len <= tab->maxLen;
-       ++len, code <<= 1, skip <<= 1) {
-    for (val = 0; val < n; ++val) {
-      if (lengths[val] == len) {
-
-	// bit-reverse the code
-	code2 = 0;
-	t = code;
-	for (i = 0; i < len; ++i) {
-	  code2 = (code2 << 1) | (t & 1);
-	  t >>= 1;
-	}
-
-	// fill in the table entries
-	for (i = code2; i < tabSize; i += skip) {
-	  tab->codes[i].len = (Gushort)len;
-	  tab->codes[i].val = (Gushort)val;
-	}
-
-	++code;
+  // fill in the table entries
+  for (val = 0; val < n; ++val) {
+    if ((len = lengths[val]) == 0) {
+      continue;
+    }
+    code = revCodes[val];
+    if (len <= primBits) {
+      for (i = code; i < primSize; i += 1 << len) {
+	tab->codes[i].len = (Gushort)len;
+	tab->codes[i].val = (Gushort)val;
+      }
+    } else {
+      prefix = code & (primSize - 1);
+      for (i = code >> primBits; i < (1 << subBits[prefix]);
+	   i += 1 << (len - primBits)) {
+	tab->codes[subOffset[prefix] + i].len = (Gushort)len;
+	tab->codes[subOffset[prefix] + i].val = (Gushort)val;
       }
     }
   }
+  return gTrue;
 }
 
-int FlateStream::getHuffmanCodeWord(FlateHuffmanTab *tab) {
-  FlateCode *code;
+// Refill the input buffer.  Returns false at the end of the input.
+GBool FlateStream::fillInBuf() {
   int c;
 
+  if (readAhead) {
+    inEnd = inBuf + str->getBlock((char *)inBuf, flateInBufSize);
+  } else if ((c = str->getChar()) != EOF) {
+    inBuf[0] = (Guchar)c;
+    inEnd = inBuf + 1;
+  } else {
+    inEnd = inBuf;
+  }
+  inPtr = inBuf;
+  return inPtr < inEnd;
+}
+
+inline int FlateStream::getHuffmanCodeWord(FlateHuffmanTab *tab) {
+  FlateCode *code;
+
   while (codeSize < tab->maxLen) {
-    if ((c = str->getChar()) == EOF) {
+    if (inPtr == inEnd && !fillInBuf()) {
       break;
     }
-    codeBuf |= (c & 0xff) << codeSize;
+    codeBuf |= *inPtr++ << codeSize;
     codeSize += 8;
   }
-  code = &tab->codes[codeBuf & ((1 << tab->maxLen) - 1)];
+  code = &tab->codes[codeBuf & ((1 << tab->primaryBits) - 1)];
+  if (code->len >= flateLinkLen) {
+    code = &tab->codes[code->val +
+		       ((codeBuf >> tab->primaryBits) &
+			((1 << (code->len - flateLinkLen)) - 1))];
+  }
   if (codeSize == 0 || codeSize < code->len || code->len == 0) {
     return EOF;
   }
@@ -4255,13 +5086,13 @@ int FlateStream::getHuffmanCodeWord(FlateHuffmanTab *tab) {
   return (int)code->val;
 }
 
-int FlateStream::getCodeWord(int bits) {
+inline int FlateStream::getCodeWord(int bits) {
   int c;
 
   while (codeSize < bits) {
-    if ((c = str->getChar()) == EOF)
+    if (inPtr == inEnd && !fillInBuf())
       return EOF;
-    codeBuf |= (c & 0xff) << codeSize;
+    codeBuf |= *inPtr++ << codeSize;
     codeSize += 8;
   }
   c = codeBuf & ((1 << bits) - 1);
@@ -81,6 +81,15 @@ public:
   // This is only used by StreamPredictor.
   virtual int getRawChar();
 
+  // Get up to <size> chars from the stream without using the
+  // predictor.  This is only used by StreamPredictor.
+  virtual int getRawBlock(char *blk, int size);
+
+  // Get up to <size> chars from the stream into <blk>.  Returns the
+  // number of chars read, which is less than <size> only at the end
+  // of the stream.
+  virtual int getBlock(char *blk, int size);
+
   // Get next line from stream.
   virtual char *getLine(char *buf, int size);
 
@@ -138,8 +147,24 @@ public:
   virtual void setPos(Guint pos, int dir = 0) = 0;
   virtual GBool isBinary(GBool last = gTrue) { return last; }
   virtual BaseStream *getBaseStream() { return this; }
+
+  // Can filters read ahead of the data they need?  Not when the
+  // stream is embedded in another one (inline images), since the
+  // caller continues reading the outer stream afterwards.
+  virtual GBool canReadAhead() { return gTrue; }
   virtual Dict *getDict() { return dict.getDict(); }
 
+  // If the (decrypted) stream data is held in memory, set <dataA>
+  // and <lengthA> to it and return true.  The data belongs to the
+  // stream.
+  virtual GBool getData(char **dataA, Guint *lengthA) { return gFalse; }
+
+  // If the stream data can be copied straight out of a file (it is
+  // limited and not encrypted), set <fA>, <startA> and <lengthA> to
+  // its location and return true.
+  virtual GBool getFileRange(FILE **fA, Guint *startA, Guint *lengthA)
+    { return gFalse; }
+
   // Get/set position of first byte of stream within the file.
   virtual Guint getStart() = 0;
   virtual void moveStart(int delta) = 0;
@@ -216,6 +241,8 @@ private:
   int nVals;			// components per line
   Guchar *imgLine;		// line buffer
   int imgIdx;			// current index in imgLine
+  Guchar *inputLine;		// packed input line (if nBits != 8)
+  int inputLineSize;		// bytes per packed input line
 };
 
 //------------------------------------------------------------------------
@@ -234,6 +261,7 @@ public:
 
   int lookChar();
   int getChar();
+  int getBlock(char *blk, int size);
 
 private:
 
@@ -249,6 +277,7 @@ private:
   int rowBytes;			// bytes per line
   Guchar *predLine;		// line buffer
   int predIdx;			// current index in predLine
+  Guchar *rawLine;		// undecoded line
 };
 
 //------------------------------------------------------------------------
@@ -272,7 +301,9 @@ public:
     { return (bufPtr >= bufEnd && !fillBuf()) ? EOF : (*bufPtr++ & 0xff); }
   virtual int lookChar()
     { return (bufPtr >= bufEnd && !fillBuf()) ? EOF : (*bufPtr & 0xff); }
+  virtual int getBlock(char *blk, int size);
   virtual int getPos() { return bufPos + (bufPtr - buf); }
+  virtual GBool getFileRange(FILE **fA, Guint *startA, Guint *lengthA);
   virtual void setPos(Guint pos, int dir = 0);
   virtual Guint getStart() { return start; }
   virtual void moveStart(int delta);
@@ -311,7 +342,9 @@ public:
     { return (bufPtr < bufEnd) ? (*bufPtr++ & 0xff) : EOF; }
   virtual int lookChar()
     { return (bufPtr < bufEnd) ? (*bufPtr & 0xff) : EOF; }
+  virtual int getBlock(char *blk, int size);
   virtual int getPos() { return (int)(bufPtr - buf); }
+  virtual GBool getData(char **dataA, Guint *lengthA);
   virtual void setPos(Guint pos, int dir = 0);
   virtual Guint getStart() { return start; }
   virtual void moveStart(int delta);
@@ -328,6 +361,33 @@ private:
   GBool needFree;
 };
 
+//------------------------------------------------------------------------
+// MapStream
+//
+// A MemStream over a read-only memory mapping of an entire file.
+// Sub-streams are plain MemStreams pointing into the mapping, so
+// they must be deleted before the MapStream.
+//------------------------------------------------------------------------
+
+class MapStream: public MemStream {
+public:
+
+  // Map the file open on <fA>.  Returns NULL if the file can't be
+  // mapped (empty, too large, or mapping not supported), in which case
+  // the caller should fall back to a FileStream.
+  static MapStream *make(FILE *fA, Object *dictA);
+
+  virtual ~MapStream();
+
+private:
+
+  MapStream(char *mapA, Guint mapLengthA, void *mapHandleA, Object *dictA);
+
+  char *map;
+  Guint mapLength;
+  void *mapHandle;		// file mapping object (WIN32 only)
+};
+
 //------------------------------------------------------------------------
 // EmbedStream
 //
@@ -349,10 +409,12 @@ public:
   virtual void reset() {}
   virtual int getChar();
   virtual int lookChar();
+  virtual int getBlock(char *blk, int size);
   virtual int getPos() { return str->getPos(); }
   virtual void setPos(Guint pos, int dir = 0);
   virtual Guint getStart();
   virtual void moveStart(int delta);
+  virtual GBool canReadAhead() { return gFalse; }
 
 private:
 
@@ -375,6 +437,7 @@ public:
   virtual int getChar()
     { int c = lookChar(); buf = EOF; return c; }
   virtual int lookChar();
+  virtual int getBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
 
@@ -398,6 +461,7 @@ public:
   virtual int getChar()
     { int ch = lookChar(); ++index; return ch; }
   virtual int lookChar();
+  virtual int getBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
 
@@ -424,6 +488,8 @@ public:
   virtual int getChar();
   virtual int lookChar();
   virtual int getRawChar();
+  virtual int getBlock(char *blk, int size);
+  virtual int getRawBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
 
@@ -468,6 +534,7 @@ public:
     { return (bufPtr >= bufEnd && !fillBuf()) ? EOF : (*bufPtr++ & 0xff); }
   virtual int lookChar()
     { return (bufPtr >= bufEnd && !fillBuf()) ? EOF : (*bufPtr & 0xff); }
+  virtual int getBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
 
@@ -558,6 +625,10 @@ struct DCTHuffTable {
   Gushort firstCode[17];	// first code for this bit length
   Gushort numCodes[17];		// number of codes of this bit length
   Guchar sym[256];		// symbols
+  GBool lookOk;			// set if lookLen/lookSym are usable
+  Guchar lookLen[256];		// code length for each 8-bit prefix
+				//   (0 = code is longer than 8 bits)
+  Guchar lookSym[256];		// symbol for each 8-bit prefix
 };
 
 class DCTStream: public FilterStream {
@@ -569,6 +640,7 @@ public:
   virtual void reset();
   virtual int getChar();
   virtual int lookChar();
+  virtual int getBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
   Stream *getRawStream() { return str; }
@@ -617,12 +689,14 @@ private:
   int readHuffSym(DCTHuffTable *table);
   int readAmp(int size);
   int readBit();
+  GBool readInputByte();
   GBool readHeader();
   GBool readBaselineSOF();
   GBool readProgressiveSOF();
   GBool readScanInfo();
   GBool readQuantTables();
   GBool readHuffmanTables();
+  void buildHuffLookup(DCTHuffTable *tbl);
   GBool readRestartInterval();
   GBool readJFIFMarker();
   GBool readAdobeMarker();
@@ -641,16 +715,24 @@ private:
 #define flateMaxCodeLenCodes    19    // max # code length codes
 #define flateMaxLitCodes       288    // max # literal codes
 #define flateMaxDistCodes       30    // max # distance codes
-
-// Huffman code table entry
+#define flateMaxMatch          258    // max length of a match
+#define flatePrimaryBits         9    // index bits of first level tables
+#define flateLinkLen            16    // code len marking a second level
+				      //   table link
+#define flateInBufSize        4096    // input buffer size
+
+// Huffman code table entry.  If <len> is flateLinkLen or more, this
+// is a link to a second level table at offset <val>, indexed by the
+// next <len> - flateLinkLen bits.
 struct FlateCode {
-  Gushort len;			// code length, in bits
+  Gushort len;			// code length, in bits (0 = invalid)
   Gushort val;			// value represented by this code
 };
 
 struct FlateHuffmanTab {
   FlateCode *codes;
-  int maxLen;
+  int maxLen;			// max code length
+  int primaryBits;		// index bits of the first level table
 };
 
 // Decoding info for length and distance code words
@@ -670,6 +752,8 @@ public:
   virtual int getChar();
   virtual int lookChar();
   virtual int getRawChar();
+  virtual int getBlock(char *blk, int size);
+  virtual int getRawBlock(char *blk, int size);
   virtual GString *getPSFilter(int psLevel, char *indent);
   virtual GBool isBinary(GBool last = gTrue);
 
@@ -679,8 +763,12 @@ private:
   Guchar buf[flateWindow];	// output data buffer
   int index;			// current index into output buffer
   int remain;			// number valid bytes in output buffer
-  int codeBuf;			// input buffer
-  int codeSize;			// number of bits in input buffer
+  Guchar inBuf[flateInBufSize];	// compressed input
+  Guchar *inPtr;		// next byte in <inBuf>
+  Guchar *inEnd;		// end of valid data in <inBuf>
+  GBool readAhead;		// set if input can be read in blocks
+  int codeBuf;			// input bit buffer
+  int codeSize;			// number of bits in input bit buffer
   int				// literal and distance code lengths
     codeLengths[flateMaxLitCodes + flateMaxDistCodes];
   FlateHuffmanTab litCodeTab;	// literal code table
@@ -705,7 +793,8 @@ private:
   GBool startBlock();
   void loadFixedCodes();
   GBool readDynamicCodes();
-  void compHuffmanCodes(int *lengths, int n, FlateHuffmanTab *tab);
+  GBool compHuffmanCodes(int *lengths, int n, FlateHuffmanTab *tab);
+  GBool fillInBuf();
   int getHuffmanCodeWord(FlateHuffmanTab *tab);
   int getCodeWord(int bits);
 };
@@ -200,7 +200,18 @@ XRef::XRef(BaseStream *strA) {
   entries = NULL;
   streamEnds = NULL;
   streamEndsLen = 0;
-  objStr = NULL;
+  objStrCacheSize = xrefDefaultObjStrCacheSize;
+  objStrs = (ObjectStream **)gmallocn(objStrCacheSize,
+				      sizeof(ObjectStream *));
+  nObjStrs = 0;
+  objStrsSeen = NULL;
+  objStrsSeenLen = 0;
+  objStrBuilds = objStrRebuilds = 0;
+  cache = NULL;
+  cacheFirst = cacheLast = -1;
+  cacheSize = xrefDefaultCacheSize;
+  cacheUsed = 0;
+  cacheHits = cacheMisses = 0;
 
   encrypted = gFalse;
   permFlags = defPermFlags;
@@ -250,16 +261,29 @@ XRef::XRef(BaseStream *strA) {
   // now set the trailer dictionary's xref pointer so we can fetch
   // indirect objects from it
   trailerDict.getDict()->setXRef(this);
+
+  // the table doesn't change any more, so objects can be cached
+  cache = new XRefCacheEntry[size];
 }
 
 XRef::~XRef() {
+  int i;
+
   gfree(entries);
   trailerDict.free();
   if (streamEnds) {
     gfree(streamEnds);
   }
-  if (objStr) {
-    delete objStr;
+  for (i = 0; i < nObjStrs; ++i) {
+    delete objStrs[i];
+  }
+  gfree(objStrs);
+  gfree(objStrsSeen);
+  if (cache) {
+    while (cacheFirst >= 0) {
+      uncacheObject(cacheFirst);
+    }
+    delete[] cache;
   }
 }
 
@@ -781,6 +805,7 @@ GBool XRef::okToAddNotes(GBool ignoreOwnerPW) {
 
 Object *XRef::fetch(int num, int gen, Object *obj) {
   XRefEntry *e;
+  XRefCacheEntry *c;
   Parser *parser;
   Object obj1, obj2, obj3;
 
@@ -789,6 +814,29 @@ Object *XRef::fetch(int num, int gen, Object *obj) {
     goto err;
   }
 
+  // check the parsed object cache
+  if (cache && cacheSize > 0) {
+    c = &cache[num];
+    if (!c->obj.isNone() && c->gen == gen) {
+      ++cacheHits;
+      if (num != cacheFirst) {
+	// move to the front of the LRU list
+	cache[c->prev].next = c->next;
+	if (c->next >= 0) {
+	  cache[c->next].prev = c->prev;
+	} else {
+	  cacheLast = c->prev;
+	}
+	c->prev = -1;
+	c->next = cacheFirst;
+	cache[cacheFirst].prev = num;
+	cacheFirst = num;
+      }
+      return c->obj.copy(obj);
+    }
+    ++cacheMisses;
+  }
+
   e = &entries[num];
   switch (e->type) {
 
@@ -824,25 +872,140 @@ Object *XRef::fetch(int num, int gen, Object *obj) {
     if (gen != 0) {
       goto err;
     }
-    if (!objStr || objStr->getObjStrNum() != (int)e->offset) {
-      if (objStr) {
-	delete objStr;
-      }
-      objStr = new ObjectStream(this, e->offset);
-    }
-    objStr->getObject(e->gen, num, obj);
+    getObjectStream((int)e->offset)->getObject(e->gen, num, obj);
     break;
 
   default:
     goto err;
   }
 
+  // streams are not cached: a Stream has a read position, so it can't
+  // be shared between callers
+  if (cache && cacheSize > 0 && !obj->isStream() && !obj->isError() &&
+      !obj->isEOF() && !obj->isCmd()) {
+    cacheObject(num, gen, obj);
+  }
   return obj;
 
  err:
   return obj->initNull();
 }
 
+void XRef::setObjStrCacheSize(int objStrCacheSizeA) {
+  if (objStrCacheSizeA < 1) {
+    objStrCacheSizeA = 1;
+  }
+  while (nObjStrs > objStrCacheSizeA) {
+    delete objStrs[--nObjStrs];
+  }
+  objStrCacheSize = objStrCacheSizeA;
+  objStrs = (ObjectStream **)greallocn(objStrs, objStrCacheSize,
+				       sizeof(ObjectStream *));
+}
+
+// Return the decoded object stream <objStrNum>, decoding it if it
+// isn't among the most recently used ones.
+ObjectStream *XRef::getObjectStream(int objStrNum) {
+  ObjectStream *objStr;
+  int i;
+
+  for (i = 0; i < nObjStrs; ++i) {
+    if (objStrs[i]->getObjStrNum() == objStrNum) {
+      objStr = objStrs[i];
+      for (; i > 0; --i) {
+	objStrs[i] = objStrs[i - 1];
+      }
+      objStrs[0] = objStr;
+      return objStr;
+    }
+  }
+
+  // NB: this may fetch other objects, so the list is only updated
+  // afterwards
+  objStr = new ObjectStream(this, objStrNum);
+
+  ++objStrBuilds;
+  if (objStrNum >= 0 && objStrNum < size) {
+    if (!objStrsSeen) {
+      objStrsSeenLen = size;
+      objStrsSeen = (Guchar *)gmalloc(objStrsSeenLen);
+      memset(objStrsSeen, 0, objStrsSeenLen);
+    }
+    if (objStrNum < objStrsSeenLen) {
+      if (objStrsSeen[objStrNum]) {
+	++objStrRebuilds;
+      }
+      objStrsSeen[objStrNum] = 1;
+    }
+  }
+
+  if (nObjStrs == objStrCacheSize) {
+    delete objStrs[--nObjStrs];
+  }
+  for (i = nObjStrs; i > 0; --i) {
+    objStrs[i] = objStrs[i - 1];
+  }
+  objStrs[0] = objStr;
+  ++nObjStrs;
+  return objStr;
+}
+
+void XRef::setCacheSize(Guint cacheSizeA) {
+  cacheSize = cacheSizeA;
+  while (cacheUsed > cacheSize && cacheLast >= 0) {
+    uncacheObject(cacheLast);
+  }
+}
+
+// Add a copy of <obj> to the front of the LRU list, evicting the least
+// recently used objects to stay within the memory limit.
+void XRef::cacheObject(int num, int gen, Object *obj) {
+  XRefCacheEntry *c;
+  Guint bytes;
+
+  bytes = obj->getMemSize();
+  if (bytes > cacheSize) {
+    return;
+  }
+  if (!cache[num].obj.isNone()) {
+    uncacheObject(num);
+  }
+  while (cacheUsed + bytes > cacheSize && cacheLast >= 0) {
+    uncacheObject(cacheLast);
+  }
+  c = &cache[num];
+  obj->copy(&c->obj);
+  c->gen = gen;
+  c->bytes = bytes;
+  c->prev = -1;
+  c->next = cacheFirst;
+  if (cacheFirst >= 0) {
+    cache[cacheFirst].prev = num;
+  } else {
+    cacheLast = num;
+  }
+  cacheFirst = num;
+  cacheUsed += bytes;
+}
+
+void XRef::uncacheObject(int num) {
+  XRefCacheEntry *c;
+
+  c = &cache[num];
+  if (c->prev >= 0) {
+    cache[c->prev].next = c->next;
+  } else {
+    cacheFirst = c->next;
+  }
+  if (c->next >= 0) {
+    cache[c->next].prev = c->prev;
+  } else {
+    cacheLast = c->prev;
+  }
+  c->obj.free();
+  cacheUsed -= c->bytes;
+}
+
 Object *XRef::getDocInfo(Object *obj) {
   return trailerDict.dictLookup("Info", obj);
 }
@@ -39,6 +39,19 @@ struct XRefEntry {
   XRefEntryType type;
 };
 
+// Default memory limit for the parsed object cache, in bytes.
+#define xrefDefaultCacheSize (4 * 1024 * 1024)
+
+// Default number of decoded object streams kept.
+#define xrefDefaultObjStrCacheSize 8
+
+struct XRefCacheEntry {
+  Object obj;			// parsed object, or none if not cached
+  int gen;			// generation number of <obj>
+  Guint bytes;			// estimated memory used by <obj>
+  int prev, next;		// LRU list links (object numbers, -1 = end)
+};
+
 class XRef {
 public:
 
@@ -87,6 +100,25 @@ public:
   int getRootNum() { return rootNum; }
   int getRootGen() { return rootGen; }
 
+  // Set the memory limit for the parsed object cache.  Fetched objects
+  // (other than streams) are kept until the limit is reached, and
+  // later fetches return copies of them.  Zero disables the cache.
+  void setCacheSize(Guint cacheSizeA);
+
+  // Parsed object cache statistics.
+  int getCacheHits() { return cacheHits; }
+  int getCacheMisses() { return cacheMisses; }
+
+  // Set the number of decoded object streams kept (at least one).
+  // Objects are fetched from the most recently used object streams
+  // without decoding them again.
+  void setObjStrCacheSize(int objStrCacheSizeA);
+
+  // Object stream statistics: the number of object streams decoded,
+  // and how many of those had been decoded before and were evicted.
+  int getObjStrBuilds() { return objStrBuilds; }
+  int getObjStrRebuilds() { return objStrRebuilds; }
+
   // Get end position for a stream in a damaged file.
   // Returns false if unknown or file is not damaged.
   GBool getStreamEnd(Guint streamStart, Guint *streamEnd);
@@ -111,7 +143,21 @@ private:
   Guint *streamEnds;		// 'endstream' positions - only used in
 				//   damaged files
   int streamEndsLen;		// number of valid entries in streamEnds
-  ObjectStream *objStr;		// cached object stream
+  ObjectStream **objStrs;	// decoded object streams, most recently
+				//   used first
+  int nObjStrs;			// number of valid entries in <objStrs>
+  int objStrCacheSize;		// size of <objStrs> array
+  Guchar *objStrsSeen;		// flags object streams decoded so far,
+				//   indexed by object number
+  int objStrsSeenLen;		// size of <objStrsSeen> array
+  int objStrBuilds;		// object stream statistics
+  int objStrRebuilds;
+  XRefCacheEntry *cache;	// parsed object cache, indexed by object
+				//   number
+  int cacheFirst, cacheLast;	// most and least recently used objects
+  Guint cacheSize;		// memory limit for the cache
+  Guint cacheUsed;		// memory used by cached objects
+  int cacheHits, cacheMisses;	// cache statistics
   GBool encrypted;		// true if file is encrypted
   int permFlags;		// permission bits
   GBool ownerPasswordOk;	// true if owner password is correct
@@ -126,6 +172,9 @@ private:
   GBool readXRefStream(Stream *xrefStr, Guint *pos);
   GBool constructXRef();
   Guint strToUnsigned(char *s);
+  ObjectStream *getObjectStream(int objStrNum);
+  void cacheObject(int num, int gen, Object *obj);
+  void uncacheObject(int num);
 };
 
 #endif